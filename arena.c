@@ -0,0 +1,141 @@
+/*
+ * ARENA ALLOCATOR MODULE
+ * 
+ * Everything that lives only while one file is assembled (macros, file
+ * names, cache and diagnostic text) is allocated from an arena instead of
+ * with a malloc per node.
+ * 
+ * An arena is a list of big blocks. Allocating just moves a "used" counter
+ * forward in the current block ("bump" allocation), and nothing is ever
+ * freed on its own. When the file is done, arena_reset() makes all the
+ * memory available again in one step - the blocks are kept, so the next
+ * file reuses them without going back to malloc at all.
+ * 
+ * Example:
+ *   macro = arena_alloc(&ctx->arena, sizeof(macro_def_t));
+ *   ...
+ *   arena_reset(&ctx->arena);   <- every macro is gone at once
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE 16384   /* Data bytes in a normal block */
+
+/* Every allocation is rounded up to this so any type can be stored in it */
+typedef union {
+    long l;
+    double d;
+    void *p;
+} arena_align_t;
+
+#define ARENA_ALIGN sizeof(arena_align_t)
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+#define ARENA_HEADER_SIZE ARENA_ROUND(sizeof(arena_block_t))
+
+/*
+ * ARENA_INIT - Start with an empty arena (no blocks yet)
+ */
+void arena_init(arena_t *arena) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->allocations = 0;
+    arena->bytes = 0;
+}
+
+/*
+ * ARENA_ALLOC - Hand out size bytes from the arena
+ * 
+ * Blocks after the current one are left over from before the last reset,
+ * so they are free - when the current block is full we just move on to the
+ * next one and start it from the beginning. Only when we run out of blocks
+ * a new one is malloc'd (bigger than normal if the request needs it).
+ * 
+ * Returns: Pointer to the memory, or NULL if malloc failed
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+    arena_block_t *block = arena->current;
+    arena_block_t *last = NULL;
+    void *memory;
+    
+    size = ARENA_ROUND(size);
+    
+    /* Find a block with room, reusing blocks from before the last reset */
+    while (block && block->used + size > block->size) {
+        last = block;
+        block = block->next;
+        if (block) {
+            block->used = 0;  /* Nothing in it is in use any more */
+        }
+    }
+    
+    if (!block) {
+        size_t data_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        
+        block = malloc(ARENA_HEADER_SIZE + data_size);
+        if (!block) {
+            return NULL;
+        }
+        arena->allocations++;
+        arena->bytes += (long)(ARENA_HEADER_SIZE + data_size);  /* For the memory stats (memory.c) */
+        block->next = NULL;
+        block->size = data_size;
+        block->used = 0;
+        
+        /* Add it to the end of the list */
+        if (last) {
+            last->next = block;
+        } else {
+            arena->first = block;
+        }
+    }
+    
+    arena->current = block;
+    memory = (char *)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    return memory;
+}
+
+/*
+ * ARENA_STRDUP - Copy a string into the arena
+ */
+char *arena_strdup(arena_t *arena, const char *text) {
+    size_t length = strlen(text) + 1;
+    char *copy = arena_alloc(arena, length);
+    
+    if (copy) {
+        memcpy(copy, text, length);
+    }
+    return copy;
+}
+
+/*
+ * ARENA_RESET - Throw away everything allocated, keep the blocks
+ * 
+ * This is the whole "free" step for a file - it does not matter how many
+ * things were allocated. Only the first block is rewound here, the others
+ * are rewound by arena_alloc when it gets to them.
+ */
+void arena_reset(arena_t *arena) {
+    arena->current = arena->first;
+    if (arena->first) {
+        arena->first->used = 0;
+    }
+}
+
+/*
+ * ARENA_FREE - Give all the blocks back to the system
+ */
+void arena_free(arena_t *arena) {
+    arena_block_t *block = arena->first;
+    arena_block_t *next;
+    
+    while (block) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->bytes = 0;
+}
@@ -0,0 +1,16 @@
+/* Arena (bump) allocator for per-file state */
+/* arena_t itself is in assembler.h because the context holds one */
+
+/* One block of arena memory - the data follows right after the header */
+typedef struct arena_block {
+    struct arena_block *next;       /* Next block (blocks are kept for reuse) */
+    size_t size;                    /* Bytes of data in this block */
+    size_t used;                    /* Bytes already handed out */
+} arena_block_t;
+
+/* Function declarations */
+void arena_init(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *text);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
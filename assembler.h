@@ -6,23 +6,33 @@
 #include <string.h>
 #include <ctype.h>
 
+/* Goes into every cache key, so a new version never reuses old cached outputs */
+#define ASSEMBLER_VERSION "1.2"
+
 /* File extensions */
 #define AS_EXT ".as"     /* Input assembly file */
 #define AM_EXT ".am"     /* After macro expansion */
 #define OB_EXT ".ob"     /* Object file */
 #define ENT_EXT ".ent"   /* Entries file */
 #define EXT_EXT ".ext"   /* Externals file */
+#define BIN_EXT ".bin"   /* Binary object file (--format=bin) */
 
 /* Size limits */
 #define MAX_LINE_LENGTH 256
 #define MAX_LABEL_LENGTH 32
-#define MAX_MACRO_LINES 100      /* Maximum lines in a macro */
 #define MAX_FILENAME_LENGTH 256  /* Maximum filename length */
-#define MEMORY_SIZE 4096
 #define INITIAL_IC 100
 #define INITIAL_DC 0
 #define MAX_OPERANDS 2           /* Maximum operands per instruction */
 #define MAX_FILES 100            /* Maximum number of input files */
+#define MAX_JOBS 64              /* Most worker threads -j can ask for */
+#define MAX_ERRORS_LIMIT 1000000 /* Largest --max-errors value */
+#define MAX_TOKENS (MAX_LINE_LENGTH / 2 + 1)  /* Most tokens a line can split into */
+
+/* Machine word format */
+#define WORD_VALUES 1024         /* Different values a 10-bit word can hold */
+#define WORD_VALUE_MASK 0x3FF    /* Low 10 bits */
+#define LETTER_WORD_LENGTH 5     /* Base-4 letters needed for one word (or address) */
 
 /* Operand types */
 typedef enum {
@@ -32,6 +42,13 @@ typedef enum {
     REGISTER = 3      /* r1 - register */
 } operand_type_t;
 
+/* An operand type as one bit, for the masks in instruction_table */
+#define OPERAND_BIT(type) (1U << (type))
+
+/* Operand "type" of an operand that isn't there, and the number of modes */
+#define NO_OPERAND 4
+#define OPERAND_MODES 5
+
 /* ARE (Absolute/Relocatable/External) bits */
 typedef enum {
     ARE_ABSOLUTE = 0,     /* A bit - absolute value */
@@ -47,21 +64,63 @@ typedef enum {
     PRN_OP = 12, JSR_OP = 13, RTS_OP = 14, HLT_OP = 15
 } opcode_t;
 
+#define OPCODE_COUNT 16
+
+/* Directives, in the order of directive_names[] in utils.c */
+typedef enum {
+    DIR_DATA = 0, DIR_STRING = 1, DIR_ENTRY = 2, DIR_EXTERN = 3, DIR_MAT = 4
+} directive_t;
+
+/* What kind of word a token is - returned by classify_word() */
+typedef enum {
+    WORD_IDENTIFIER = 0,  /* Anything else: labels, macro names, operands */
+    WORD_INSTRUCTION,     /* mov, cmp, ..., stop (index = instruction_table row) */
+    WORD_DIRECTIVE,       /* .data, .string, ... (index = directive_t) */
+    WORD_REGISTER,        /* r0 - r7 (index = register number) */
+    WORD_MACRO_KEYWORD    /* mcro, mcroend, macr, endmacr */
+} word_class_t;
+
 /* Memory word structure */
 typedef struct {
     unsigned int value : 10;  /* 10-bit value */
     unsigned int are : 2;     /* 2-bit A.R.E field */
 } word_t;
 
+/* One token of a line - points into the caller's line buffer */
+typedef struct {
+    char *text;      /* Start of the token (NUL terminated in place) */
+    int length;      /* Number of characters */
+} token_t;
+
+/* What scan_line() found out about one line, in a single walk over it */
+typedef struct {
+    int start;       /* Offset of the first non-whitespace character */
+    int end;         /* Offset just after the last one (start == end: empty line) */
+    int colon;       /* Offset of the first ':' (a label), -1 if there is none */
+    int is_comment;  /* 1 if the first non-whitespace character is ';' */
+} line_scan_t;
+
+/* Fixed-size token list filled by tokenize_line() - lives on the stack */
+typedef struct {
+    token_t tokens[MAX_TOKENS];
+    int count;       /* Number of tokens found */
+    int truncated;   /* 1 if the line had more than MAX_TOKENS tokens */
+} token_list_t;
+
 /* Instruction information structure */
 typedef struct {
     char name[MAX_LABEL_LENGTH];   /* Instruction name */
     opcode_t opcode;               /* Numeric opcode */
     int operand_count;             /* Number of operands */
-    int valid_src_types[4];        /* Valid source operand types */
-    int valid_dest_types[4];       /* Valid destination operand types */
 } instruction_info_t;
 
+/* One entry of encoding_table (utils.c) - an opcode with given operand types */
+typedef struct {
+    unsigned short first_word;     /* The instruction word, ARE bits 0 */
+    unsigned char length;          /* Words the instruction takes */
+    unsigned char legal;           /* 1 if the instruction takes these operand types */
+} encoding_t;
+
 /* Error codes */
 typedef enum {
     SUCCESS = 0,
@@ -77,12 +136,232 @@ typedef enum {
     ERROR_MACRO_NOT_FOUND
 } error_code_t;
 
-/* Global variables - declared here, defined in main.c */
-extern int IC;  /* Instruction Counter */
-extern int DC;  /* Data Counter */
-extern int error_flag;
-extern char *current_filename;
+/* Object file formats (--format) */
+typedef enum {
+    FORMAT_LETTERS = 0,   /* .ob/.ent/.ext text in base-4 letters (default) */
+    FORMAT_BINARY = 1     /* One .bin file with all the tables (second_pass.c) */
+} object_format_t;
+
+/* Stages of process_single_file that get timed (stats.c) */
+typedef enum {
+    STAGE_MACROS = 0,     /* Reading the .as file and expanding macros */
+    STAGE_FIRST_PASS,     /* First pass on the expanded lines */
+    STAGE_SECOND_PASS,    /* Encoding the line records */
+    STAGE_OUTPUT,         /* Writing the output files */
+    STAGE_COUNT
+} stage_t;
+
+/* What tracked memory is used for (memory.c) - reported by --stats, limited by --mem-limit */
+typedef enum {
+    MEMORY_MACROS = 0,    /* Macro body text, its lines and the macro index */
+    MEMORY_SYMBOLS,       /* Symbol table and index, external references, --one-pass fixups */
+    MEMORY_RECORDS,       /* What the lines become: line records, name pool, data values, cached lines */
+    MEMORY_IMAGES,        /* Code and data images, output file buffers */
+    MEMORY_OTHER,         /* Arena, messages, long lines, thread slices (counted, never refused) */
+    MEMORY_KINDS
+} memory_kind_t;
+
+/* --stats output */
+typedef enum {
+    STATS_OFF = 0,
+    STATS_TEXT,           /* --stats or --stats=text: readable summary per file */
+    STATS_JSON            /* --stats=json: one JSON object per line, for scripts */
+} stats_format_t;
+
+/* Command line options - shared (read only) by every file we assemble */
+typedef struct {
+    int jobs;                       /* -j N: assemble up to N files at the same time */
+    int file_threads;               /* --file-threads N: threads for one file's second pass */
+    int keep_am;                    /* --keep-am: also write the expanded .am file */
+    object_format_t format;         /* --format=letters|bin: what kind of object file to write */
+    const char *cache_dir;          /* --cache-dir DIR: reuse outputs of unchanged files (NULL = off) */
+    const char *output_dir;         /* --output-dir DIR: write the outputs there (NULL = next to the .as) */
+    int server;                     /* --server: read file names from stdin, one per line (server.c) */
+    const char *link;               /* --link OUT: link all the files into OUT.ob (NULL = off, link.c) */
+    const char *bench;              /* --bench[=SPEC]: run the benchmark instead (NULL = off, bench.c) */
+    const char *golden;             /* --golden DIR: compare the samples' outputs with DIR instead (NULL = off, golden.c) */
+    const char *fuzz;               /* --fuzz[=SPEC]: feed broken lines to the parsers instead (NULL = off, fuzz.c) */
+    int timing;                     /* Time every stage into ctx->stats (set by --bench and --stats) */
+    stats_format_t stats;           /* --stats[=text|json]: report times and counters per file */
+    int max_errors;                 /* --max-errors N: errors kept per file (0 = all of them) */
+    int one_pass;                   /* --one-pass: encode in the first pass, backpatch labels */
+    int quiet;                      /* --quiet: no progress messages, only errors and the summary */
+    long mem_limit;                 /* --mem-limit N: most tracked bytes one context may hold (0 = no limit) */
+    int async_write;                /* --async-write: a background thread writes the output files */
+    int sync_outputs;               /* --fsync: fsync every output file before the run ends */
+    struct output_writer *writer;   /* That thread, started by main (NULL = write directly, writer.c) */
+} assembler_options_t;
+
+/*
+ * SEGMENT - a growable block of memory words (second_pass.c)
+ * Used for the instruction image and the data image. The first pass already
+ * knows how many words each one needs, so the second pass allocates exactly
+ * that once and then writes words without checking bounds.
+ */
+typedef struct {
+    word_t *words;
+    int count;                      /* Words in use */
+    int capacity;                   /* Words allocated */
+} segment_t;
+
+/*
+ * ARENA - memory pool for everything that lives for one file (arena.c)
+ * Allocations are never freed one by one - arena_reset drops them all.
+ */
+typedef struct {
+    struct arena_block *first;      /* All blocks, kept across resets */
+    struct arena_block *current;    /* Block we are allocating from */
+    long allocations;               /* Blocks malloc'd since the last reset_context */
+    long bytes;                     /* Bytes of all the blocks (they are kept across resets) */
+} arena_t;
+
+/*
+ * MEMORY USAGE - bytes the context's tables hold right now (memory.c)
+ * The arrays keep their memory from one file to the next, so used is not
+ * reset between files - only the peaks are.
+ */
+typedef struct {
+    long used[MEMORY_KINDS];        /* Bytes held per kind (the arena is added to MEMORY_OTHER) */
+    long total;                     /* Sum of used */
+    long peak[MEMORY_KINDS];        /* Most bytes held since the last reset_context */
+    long peak_total;
+    int limit_reached;              /* --mem-limit refused something (reported once per file) */
+} memory_usage_t;
+
+/*
+ * STATS - what one file cost (filled in by process_single_file)
+ * The stage times are only measured when options->timing is set, the
+ * counters are always kept (they are just increments).
+ * lines, words and files are filled in by stats_collect (stats.c) from
+ * the rest of the context.
+ */
+typedef struct {
+    double stage_seconds[STAGE_COUNT];
+    long files;                     /* Files these numbers are for */
+    long lines_read;                /* Lines of the .as file */
+    long lines;                     /* Expanded lines the first pass saw */
+    long tokens;                    /* Tokens the first pass split the lines into */
+    long symbol_lookups;            /* Searches of the symbol index */
+    long symbol_probes;             /* Index slots looked at by those searches */
+    long macro_expansions;          /* Macro calls replaced by their body */
+    long words;                     /* Code + data words */
+    long bytes_written;             /* Output (and .am) bytes */
+    long allocations;               /* malloc/calloc/realloc calls (plus arena.allocations) */
+    long memory_peak[MEMORY_KINDS]; /* Most tracked bytes held at once, per kind (memory.c) */
+    long memory_peak_total;         /* Most tracked bytes held at once, all kinds together */
+} assembler_stats_t;
+
+/* Count one malloc/calloc/realloc call for the stats */
+#define COUNT_ALLOCATION(ctx) ((ctx)->stats.allocations++)
+
+/*
+ * ASSEMBLER CONTEXT
+ * 
+ * Everything the assembler knows about the file it is working on.
+ * Each stage gets a pointer to the context instead of using globals, so
+ * several files can be assembled at the same time, each with its own
+ * context. The tables are only declared as struct pointers here - their
+ * types live in the module that owns them (assembly.h, first_pass.h,
+ * second_pass.h).
+ */
+typedef struct assembler_context {
+    const assembler_options_t *options;
+
+    int IC;                         /* Instruction Counter */
+    int DC;                         /* Data Counter */
+    int error_flag;                 /* Set when any error was reported */
+    char *current_filename;         /* File name used in error messages (in arena) */
+    
+    /* Macros, file names and message text come from here */
+    arena_t arena;
+    
+    /* What this file cost so far (times, allocations) */
+    assembler_stats_t stats;
+    
+    /* Tracked memory of all the tables below (memory.c) */
+    memory_usage_t memory;
+    
+    /* Cache lookup for the file being assembled, NULL without --cache-dir (cache.c) */
+    struct cache_state *cache;
+    
+    /* This file's id in options->writer, -1 when its outputs are written directly (writer.c) */
+    int writer_file;
+    
+    /* Where messages go - stdout/stderr, or per-file buffers with -j */
+    FILE *out;                      /* Progress messages */
+    FILE *err;                      /* Error messages */
+    
+    /* Errors of this file, written to err in one go at the end (diagnostics.c) */
+    struct diagnostic *diagnostics;
+    int diagnostic_count;
+    int diagnostic_capacity;
+    int diagnostic_errors;          /* Entries that are errors (not notes) */
+    int diagnostics_dropped;        /* Errors over --max-errors */
+    char *diagnostic_text;          /* Output buffer for flush_diagnostics */
+    int diagnostic_text_capacity;
+    
+    /* Macro table, its hash index and the macro body text (assembly.c) */
+    struct macro_def *macro_table;
+    struct macro_def **macro_index;
+    int macro_index_capacity;
+    int macro_index_count;
+    char *macro_text;               /* Every macro body line, back to back */
+    int macro_text_size;
+    int macro_text_capacity;
+    struct macro_line *macro_lines; /* Slices of macro_text, one per body line */
+    int macro_line_count;
+    int macro_line_capacity;
+    
+    /* Symbol table - one array per field, indexed by symbol id - and its hash index (first_pass.c) */
+    int *symbol_names;              /* name_pool offset of each symbol's name */
+    unsigned int *symbol_hashes;    /* hash_string(name), checked before the name */
+    int *symbol_offsets;            /* Words from the start of the symbol's segment */
+    unsigned char *symbol_flags;    /* SYMBOL_DATA / SYMBOL_EXTERNAL / SYMBOL_ENTRY (first_pass.h) */
+    int symbol_count;
+    int symbol_capacity;
+    int *symbol_index;              /* Hash slots: symbol id + 1, 0 if empty */
+    int symbol_index_capacity;
+    int symbol_index_count;
+    
+    /* Parsed program from the first pass (first_pass.c) */
+    int line_number;                /* Expanded lines the first pass has seen */
+    struct line_record *line_records;
+    int line_record_count;
+    int line_record_capacity;
+    char *name_pool;
+    int name_pool_size;
+    int name_pool_capacity;
+    int *data_values;
+    int data_value_count;
+    int data_value_capacity;
+    
+    /* Machine code from the second pass (second_pass.c) */
+    segment_t code;                 /* Instruction image, word 0 is address INITIAL_IC */
+    segment_t data;                 /* Data image, word 0 is address DC 0 */
+    struct external_ref *external_references;  /* In the order they were found */
+    int external_reference_count;
+    int external_reference_capacity;
+    int object_streamed;            /* The second pass already wrote the .ob file */
+    
+    /* Operand words waiting for a label's address, with --one-pass (one_pass.c) */
+    struct fixup *fixups;
+    int fixup_count;
+    int fixup_capacity;
+} assembler_context_t;
+
+/*
+ * LINE SINK
+ * 
+ * The macro expander hands every expanded line to a sink instead of only
+ * writing it to the .am file. The first pass is a sink (first_pass_line),
+ * so it sees the program without the file being written and read back.
+ * text is not null terminated - length says how many chars belong to the line.
+ */
+typedef error_code_t (*line_sink_t)(assembler_context_t *ctx, const char *text, int length);
 
-/* Function declarations */
-error_code_t process_assembly_file(const char *filename);
-void reset_global_state(void);
\ No newline at end of file
+/* Function declarations - defined in main.c */
+void init_context(assembler_context_t *ctx, const assembler_options_t *options, FILE *out, FILE *err);
+void reset_context(assembler_context_t *ctx);
+void free_context(assembler_context_t *ctx);
+error_code_t process_single_file(assembler_context_t *ctx, const char *base_filename);
+int parse_file_option(const char *arg, assembler_options_t *options, FILE *errors);
\ No newline at end of file
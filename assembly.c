@@ -10,7 +10,8 @@
  * 2. Find macro definitions (macr...endmacr blocks)
  * 3. Store them in a macro table
  * 4. Replace macro calls with their actual content
- * 5. Write the expanded code to a .am file
+ * 5. Hand every expanded line to the first pass (a line sink), and
+ *    write it to the .am file too when --keep-am asks for it
  * 
  * Example:
  * Input (.as file):
@@ -27,219 +28,291 @@
  */
 
 #include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
+#include "source.h"
 #include "assembly.h"
+#include "memory.h"
 #include "utils.h"
 
-/* Global macro table - linked list of all defined macros */
-macro_def_t *macro_table = NULL;
+/*
+ * MACRO STORAGE (ctx->macro_text, ctx->macro_lines, ctx->macro_index)
+ * 
+ * All macro bodies of a file live in one growing block of text. Each body
+ * line is just an (offset, length) slice of that block, and a macro is a
+ * run of consecutive slices - so there is no limit on how many lines a
+ * macro has, and no malloc per line.
+ * 
+ * Macros are found through an open-addressing hash index, the same way
+ * as the symbol table in first_pass.c: the capacity is a power of two,
+ * collisions go to the next slot, and it doubles when 3/4 full.
+ */
+#define MACRO_TEXT_INITIAL_SIZE 1024
+#define MACRO_LINES_INITIAL_SIZE 64
+#define MACRO_INDEX_INITIAL_SIZE 16
+
+static error_code_t emit_line(assembler_context_t *ctx, FILE *output, line_sink_t sink, const char *text, int length);
+static error_code_t add_macro_line(assembler_context_t *ctx, const char *text, int length);
+static macro_def_t **find_macro_slot(assembler_context_t *ctx, const char *name, int length, unsigned long hash);
+static error_code_t grow_macro_index(assembler_context_t *ctx);
 
 /*
  * PROCESS_MACROS - Main function for macro expansion
  * 
  * This is like a smart "find and replace" that:
- * 1. Reads the source file line by line
- * 2. When it sees "macr NAME", it starts collecting lines for a macro
- * 3. When it sees "endmacr", it saves the macro definition
+ * 1. Goes through the source file line by line
+ * 2. When it sees "mcro NAME", it starts collecting lines for a macro
+ * 3. When it sees "mcroend", it saves the macro definition
  * 4. When it sees a macro name being used, it expands it
  * 5. Everything else gets copied as-is to the output
  * 
+ * The "output" is the sink plus (optionally) the .am file. Lines go to
+ * the sink as soon as they are expanded, so the first pass runs at the
+ * same time as the expansion and nothing has to be read back from disk.
+ * 
+ * The input is already in memory (source.c), and every line is a slice of
+ * it - nothing is copied and there is no line length limit here. Like the
+ * old fgets loop, trailing whitespace is dropped from the lines we emit
+ * (lines that are only whitespace go out as they are).
+ * 
  * Parameters:
- * - input_filename: The original .as file (without extension)
- * - output_filename: The .am file to create
+ * - ctx: The assembler context - macros go into ctx->macro_table
+ * - input: The original .as file, opened with source_open
+ * - output_filename: The .am file to create, or NULL to not write one
+ * - sink: Gets every expanded line in order (NULL if only the file is wanted)
  * 
  * Returns: SUCCESS if everything went well, error code otherwise
  */
-error_code_t process_macros(const char *input_filename, const char *output_filename) {
-    FILE *input;
-    FILE *output;
-    char line[MAX_LINE_LENGTH];
+error_code_t process_macros(assembler_context_t *ctx, source_file_t *input, const char *output_filename,
+                            line_sink_t sink) {
+    FILE *output = NULL;
+    const char *line;
+    int line_length;
     int in_macro = 0;
     char macro_name[MAX_LABEL_LENGTH];
-    char *macro_content[MAX_MACRO_LINES];  /* Now MAX_MACRO_LINES is defined */
-    int macro_line_count = 0;
-    int i;  /* Will be used for cleanup if needed */
-    char *trimmed;
+    int first_line = 0;      /* Index in ctx->macro_lines of the macro's first line */
+    int text_start = 0;      /* Size of ctx->macro_text when the macro started */
+    const char *trimmed;
+    int trimmed_length;
+    line_scan_t scan;        /* Bounds and comment flag of the current line */
+    int length;              /* Line length without the trailing whitespace */
     macro_def_t *macro;
-    
-    /* Initialize variables */
-    memset(macro_content, 0, sizeof(macro_content));  /* Initialize array to NULL */
-    
-    /* Open files */
-    /* Open input file for reading */
-    input = fopen(input_filename, "r");
-    if (!input) {
-        return ERROR_FILE_NOT_FOUND;
-    }
-    
-    /* Create output file for writing expanded macros */
-    output = fopen(output_filename, "w");
-    if (!output) {
-        fclose(input);
-        return ERROR_FILE_NOT_FOUND;
+    error_code_t result = SUCCESS;
+
+    /* Create output file for writing expanded macros (only if asked for) */
+    if (output_filename) {
+        output = fopen(output_filename, "w");
+        if (!output) {
+            return ERROR_FILE_NOT_FOUND;
+        }
     }
-    
+
     /*
      * MAIN MACRO PROCESSING LOOP
-     * 
+     *
      * We read through the input file line by line, looking for:
      * 1. Macro definitions (mcro NAME ... mcroend)
      * 2. Macro calls (NAME)
      * 3. Regular assembly code (copy as-is)
-     * 
+     *
      * This is a two-state machine:
      * - State 0: Normal processing (copy lines, detect macro calls)
      * - State 1: Inside macro definition (collect lines for later use)
      */
-    while (fgets(line, sizeof(line), input)) {
-        /* Clean up the line */
-        line[strcspn(line, "\n")] = 0;
-        trimmed = trim_whitespace(line);
+    while (result == SUCCESS && source_next_line(input, &line, &line_length)) {
+        ctx->stats.lines_read++;
         
+        /* Clean up the line - one walk finds the bounds and the comment (utils.c) */
+        scan_line(line, line_length, &scan);
+        trimmed = line + scan.start;
+        trimmed_length = scan.end - scan.start;
+        length = trimmed_length ? scan.end : line_length;
+
         /* Copy comments and empty lines without processing */
-        if (is_empty_line(trimmed) || (trimmed[0] == ';')) {
-            fprintf(output, "%s\n", line);
+        if (trimmed_length == 0 || scan.is_comment) {
+            result = emit_line(ctx, output, sink, line, length);
             continue;
         }
-        
+
         /*
          * MACRO DEFINITION START: "mcro macro_name"
          * Switch to macro collection mode.
          */
-        if (strncmp(trimmed, "mcro ", 5) == 0) {
+        if (trimmed_length >= 5 && strncmp(trimmed, "mcro ", 5) == 0) {
             in_macro = 1;
-            macro_line_count = 0;
-            /* Extract macro name (everything after "mcro ") */
-            strcpy(macro_name, trimmed + 5);
-            trimmed = trim_whitespace(macro_name);
-            strcpy(macro_name, trimmed);
+            first_line = ctx->macro_line_count;
+            text_start = ctx->macro_text_size;
+            /* Extract macro name (the word after "mcro ") */
+            extract_macro_name(trimmed, trimmed_length, macro_name);
             continue;  /* Don't write macro definition line to output */
         }
-        
+
         /*
-         * MACRO DEFINITION END: "mcroend"  
+         * MACRO DEFINITION END: "mcroend"
          * Save the collected macro lines and switch back to normal mode.
          */
-        if (strcmp(trimmed, "mcroend") == 0) {
+        if (trimmed_length == 7 && strncmp(trimmed, "mcroend", 7) == 0) {
             if (in_macro) {
-                /* Save the macro we just collected */
-                if (macro_line_count > 0) {
-                    /* Create a permanent copy of the macro content */
-                    char **content_copy = malloc(macro_line_count * sizeof(char*));
-                    if (!content_copy) {
-                        /* Cleanup on memory allocation failure */
-                        for (i = 0; i < macro_line_count; i++) {
-                            free(macro_content[i]);
-                        }
-                        fclose(input);
-                        fclose(output);
-                        return ERROR_MEMORY_ALLOCATION;
-                    }
-                    
-                    /* Copy all the macro lines */
-                    for (i = 0; i < macro_line_count; i++) {
-                        content_copy[i] = macro_content[i];
-                    }
-                    
-                    /* Register the macro in our global macro table */
-                    add_macro(macro_name, content_copy, macro_line_count);
+                /* Save the macro we just collected - its lines are already stored */
+                if (ctx->macro_line_count > first_line) {
+                    result = add_macro(ctx, macro_name, first_line, ctx->macro_line_count - first_line);
                 }
                 in_macro = 0;
-                macro_line_count = 0;
             }
             continue;  /* Don't write "mcroend" to output */
         }
-        
+
         /*
          * COLLECT MACRO CONTENT
          * If we're inside a macro definition, collect this line for later use.
          */
         if (in_macro) {
-            /* Store this line for the macro */
-            if (macro_line_count >= MAX_MACRO_LINES) {
-                printf("Error: Macro too long (maximum %d lines)\n", MAX_MACRO_LINES);
-                /* Cleanup */
-                for (i = 0; i < macro_line_count; i++) {
-                    free(macro_content[i]);
-                }
-                fclose(input);
-                fclose(output);
-                return ERROR_LINE_TOO_LONG;
-            }
-            
-            /* Allocate memory for this macro line */
-            macro_content[macro_line_count] = malloc(strlen(line) + 1);
-            if (!macro_content[macro_line_count]) {
-                /* Cleanup on memory allocation failure */
-                for (i = 0; i < macro_line_count; i++) {
-                    free(macro_content[i]);
-                }
-                fclose(input);
-                fclose(output);
-                return ERROR_MEMORY_ALLOCATION;
-            }
-            strcpy(macro_content[macro_line_count], line);
-            macro_line_count++;
-            
+            result = add_macro_line(ctx, line, length);
         } else {
             /*
              * NORMAL LINE PROCESSING
              * Check if this line is a macro call. If so, expand it.
              * Otherwise, copy the line to output unchanged.
              */
-            macro = find_macro(trimmed);
+            macro = find_macro(ctx, trimmed, trimmed_length);
             if (macro) {
                 /* This line is a macro call - replace it with macro content! */
-                expand_macro(output, macro->name);
+                result = expand_macro(ctx, output, sink, macro);
             } else {
                 /* Regular assembly line - copy as-is */
-                fprintf(output, "%s\n", line);
+                result = emit_line(ctx, output, sink, line, length);
             }
         }
     }
-    
-    /* Cleanup any remaining macro content if file ended inside macro definition */
+
+    /* Drop the lines of a macro that was never closed */
     if (in_macro) {
-        printf("Warning: File ended while inside macro definition\n");
-        for (i = 0; i < macro_line_count; i++) {
-            free(macro_content[i]);
+        if (result == SUCCESS) {
+            fprintf(ctx->out, "Warning: File ended while inside macro definition\n");
+        }
+        ctx->macro_line_count = first_line;
+        ctx->macro_text_size = text_start;
+    }
+
+    if (output) {
+        fclose(output);
+    }
+
+    return result;
+}
+
+/*
+ * EMIT_LINE - Send one expanded line to the sink and/or the .am file
+ * 
+ * text does not have to be null terminated, so macro lines can be sent
+ * straight out of ctx->macro_text without copying them first.
+ */
+static error_code_t emit_line(assembler_context_t *ctx, FILE *output, line_sink_t sink, const char *text, int length) {
+    if (output) {
+        fwrite(text, 1, length, output);
+        fputc('\n', output);
+        ctx->stats.bytes_written += length + 1;
+    }
+    if (sink) {
+        return sink(ctx, text, length);
+    }
+    return SUCCESS;
+}
+
+/*
+ * ADD_MACRO_LINE - Append one body line to the macro text block
+ * 
+ * The text block and the slice array both double when they fill up.
+ * The text is stored without the newline (lines are emitted with their length).
+ */
+static error_code_t add_macro_line(assembler_context_t *ctx, const char *text, int length) {
+    macro_line_t *line;
+    
+    if (ctx->macro_text_size + length > ctx->macro_text_capacity) {
+        int new_capacity = ctx->macro_text_capacity ? ctx->macro_text_capacity : MACRO_TEXT_INITIAL_SIZE;
+        char *new_text;
+    
+        while (ctx->macro_text_size + length > new_capacity) {
+            new_capacity *= 2;
+        }
+        new_text = memory_realloc(ctx, MEMORY_MACROS, ctx->macro_text, ctx->macro_text_capacity, new_capacity);
+        if (!new_text) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+        ctx->macro_text = new_text;
+        ctx->macro_text_capacity = new_capacity;
+    }
+    
+    if (ctx->macro_line_count == ctx->macro_line_capacity) {
+        int new_capacity = ctx->macro_line_capacity ? ctx->macro_line_capacity * 2 : MACRO_LINES_INITIAL_SIZE;
+        macro_line_t *new_lines;
+        
+        new_lines = memory_realloc(ctx, MEMORY_MACROS, ctx->macro_lines, ctx->macro_line_capacity * sizeof(macro_line_t),
+                                   new_capacity * sizeof(macro_line_t));
+        if (!new_lines) {
+            return ERROR_MEMORY_ALLOCATION;
         }
+        ctx->macro_lines = new_lines;
+        ctx->macro_line_capacity = new_capacity;
     }
     
-    fclose(input);
-    fclose(output);
+    memcpy(ctx->macro_text + ctx->macro_text_size, text, length);
+    line = &ctx->macro_lines[ctx->macro_line_count++];
+    line->offset = ctx->macro_text_size;
+    line->length = length;
+    ctx->macro_text_size += length;
     
-    /* Macro processing completed successfully */
     return SUCCESS;
 }
 
 /*
  * ADD_MACRO - Add a new macro to our macro table
  * 
- * Creates a new macro entry and adds it to the front of our linked list.
- * This is like adding a new entry to a dictionary.
+ * The body lines are already in ctx->macro_lines, so the macro only
+ * remembers where they start and how many there are.
+ * New macros go to the front of the list (used for freeing), and the hash
+ * index points at the newest macro with a name, so a redefinition wins
+ * just like it did when the list was searched front to back.
  * 
  * Parameters:
  * - name: The macro name (like "SAVE_REGS")
- * - content: Array of strings, each string is one line of the macro
+ * - first_line: Index of the first body line in ctx->macro_lines
  * - line_count: How many lines the macro has
- * 
- * Note: This function takes OWNERSHIP of the content array - don't free it!
  */
-error_code_t add_macro(const char *name, char **content, int line_count) {
-    /* Allocate memory for new macro structure */
-    macro_def_t *new_macro = malloc(sizeof(macro_def_t));
+error_code_t add_macro(assembler_context_t *ctx, const char *name, int first_line, int line_count) {
+    macro_def_t **slot;
+    macro_def_t *new_macro;
+    unsigned long hash;
+    
+    /* Make sure there is room for one more entry before probing */
+    if ((ctx->macro_index_count + 1) * 4 > ctx->macro_index_capacity * 3) {
+        if (grow_macro_index(ctx) != SUCCESS) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+    }
+    
+    /* Allocate memory for new macro structure (freed with the whole arena) */
+    new_macro = arena_alloc(&ctx->arena, sizeof(macro_def_t));
     if (!new_macro) {
         return ERROR_MEMORY_ALLOCATION;
     }
     
     /* Fill in the macro information */
-    strcpy(new_macro->name, name);      /* Copy the macro name */
-    new_macro->content = content;        /* Take ownership of content array */
+    strcpy(new_macro->name, name);       /* Copy the macro name */
+    new_macro->hash = hash_text(name, (int)strlen(name));
+    new_macro->first_line = first_line;
     new_macro->line_count = line_count;  /* Store number of lines */
+    hash = new_macro->hash;
     
     /* Add to front of linked list (like a stack) */
-    new_macro->next = macro_table;
-    macro_table = new_macro;
+    new_macro->next = ctx->macro_table;
+    ctx->macro_table = new_macro;
+    
+    /* Point the index at the new macro */
+    slot = find_macro_slot(ctx, name, (int)strlen(name), hash);
+    if (!*slot) {
+        ctx->macro_index_count++;
+    }
+    *slot = new_macro;
     
     return SUCCESS;
 }
@@ -247,23 +320,77 @@ error_code_t add_macro(const char *name, char **content, int line_count) {
 /*
  * FIND_MACRO - Look up a macro by name
  * 
- * Searches through our macro table (linked list) to find a macro
- * with the given name. This is like looking up a word in a dictionary.
+ * This runs on every source line that is not part of a macro definition,
+ * so it has to be cheap: lines too long to be a macro name are rejected
+ * straight away, and the rest cost one hash and (usually) one compare.
+ * The name is a slice of the line (length chars, no null needed).
  * 
  * Returns: Pointer to macro if found, NULL if not found
  */
-macro_def_t *find_macro(const char *name) {
-    macro_def_t *current = macro_table;
+macro_def_t *find_macro(assembler_context_t *ctx, const char *name, int length) {
+    if (ctx->macro_index_count == 0 || length >= MAX_LABEL_LENGTH) {
+        return NULL;  /* No macros, or could not be a macro name */
+    }
+    return *find_macro_slot(ctx, name, length, hash_text(name, length));
+}
+
+/*
+ * FIND_MACRO_SLOT - Find the index slot for a macro name
+ * 
+ * Walks forward from hash % capacity until it finds the macro or an
+ * empty slot. The index always has at least one empty slot.
+ */
+static macro_def_t **find_macro_slot(assembler_context_t *ctx, const char *name, int length, unsigned long hash) {
+    unsigned long mask = (unsigned long)ctx->macro_index_capacity - 1;
+    unsigned long i = hash & mask;
     
-    /* Walk through the linked list */
-    while (current) {
-        if (strcmp(current->name, name) == 0) {
-            return current;  /* Found it! */
+    while (ctx->macro_index[i]) {
+        const char *other = ctx->macro_index[i]->name;
+        
+        if (ctx->macro_index[i]->hash == hash && strncmp(other, name, length) == 0 && other[length] == '\0') {
+            return &ctx->macro_index[i];  /* Found it! */
+        }
+        i = (i + 1) & mask;  /* Linear probing - try the next slot */
+    }
+    return &ctx->macro_index[i];  /* Empty slot where the name would go */
+}
+
+/*
+ * GROW_MACRO_INDEX - Double the size of the macro hash index
+ * 
+ * Re-inserts every macro pointer using its saved hash.
+ */
+static error_code_t grow_macro_index(assembler_context_t *ctx) {
+    macro_def_t **old_index = ctx->macro_index;
+    int old_capacity = ctx->macro_index_capacity;
+    int new_capacity;
+    unsigned long mask;
+    unsigned long j;
+    int i;
+    
+    new_capacity = old_capacity ? old_capacity * 2 : MACRO_INDEX_INITIAL_SIZE;
+    ctx->macro_index = memory_alloc(ctx, MEMORY_MACROS, new_capacity * sizeof(macro_def_t *));
+    if (!ctx->macro_index) {
+        ctx->macro_index = old_index;  /* Keep the old index working */
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    memset(ctx->macro_index, 0, new_capacity * sizeof(macro_def_t *));  /* All slots start empty */
+    ctx->macro_index_capacity = new_capacity;
+    mask = (unsigned long)new_capacity - 1;
+    
+    /* Move every used slot over to its new position */
+    for (i = 0; i < old_capacity; i++) {
+        if (old_index[i]) {
+            j = old_index[i]->hash & mask;
+            while (ctx->macro_index[j]) {
+                j = (j + 1) & mask;
+            }
+            ctx->macro_index[j] = old_index[i];
         }
-        current = current->next;  /* Move to next macro */
     }
     
-    return NULL;  /* Not found */
+    memory_free(ctx, MEMORY_MACROS, old_index, old_capacity * sizeof(macro_def_t *));
+    return SUCCESS;
 }
 
 /*
@@ -272,34 +399,28 @@ macro_def_t *find_macro(const char *name) {
  * This function frees all the memory we allocated for macros.
  * It's crucial to call this to prevent memory leaks!
  * 
- * For each macro, we need to free:
- * 1. Each line of content
- * 2. The content array itself  
- * 3. The macro structure
+ * The macro structures are in the arena, so they go away with it. All
+ * the body lines are just two blocks (the text and the slices), so they
+ * go in one free each.
  */
-void free_macros(void) {
-    macro_def_t *current = macro_table;
-    macro_def_t *next;
-    int i;  /* C90: Variable must be declared at beginning of block */
+void free_macros(assembler_context_t *ctx) {
+    ctx->macro_table = NULL;  /* Clear the table pointer */
     
-    while (current) {
-        next = current->next;  /* Save next pointer before freeing */
-        
-        /* Free all the content lines */
-        for (i = 0; i < current->line_count; i++) {
-            free(current->content[i]);
-        }
-        
-        /* Free the content array */
-        free(current->content);
-        
-        /* Free the macro structure itself */
-        free(current);
-        
-        current = next;  /* Move to next macro */
-    }
+    /* The index only held pointers to the macros, so just drop it */
+    memory_free(ctx, MEMORY_MACROS, ctx->macro_index, ctx->macro_index_capacity * sizeof(macro_def_t *));
+    ctx->macro_index = NULL;
+    ctx->macro_index_capacity = 0;
+    ctx->macro_index_count = 0;
     
-    macro_table = NULL;  /* Clear the table pointer */
+    memory_free(ctx, MEMORY_MACROS, ctx->macro_text, ctx->macro_text_capacity);
+    ctx->macro_text = NULL;
+    ctx->macro_text_size = 0;
+    ctx->macro_text_capacity = 0;
+    
+    memory_free(ctx, MEMORY_MACROS, ctx->macro_lines, ctx->macro_line_capacity * sizeof(macro_line_t));
+    ctx->macro_lines = NULL;
+    ctx->macro_line_count = 0;
+    ctx->macro_line_capacity = 0;
 }
 
 /*
@@ -329,47 +450,55 @@ int is_macro_definition_end(const char *line) {
 /*
  * EXTRACT_MACRO_NAME - Get the macro name from a macro definition line
  * 
- * Takes a line like "macr SAVE_REGS" and returns "SAVE_REGS"
+ * Takes a line like "mcro SAVE_REGS" and returns "SAVE_REGS"
  * 
- * Uses a static buffer, so the returned pointer is valid until
- * the next call to this function.
+ * line is the trimmed line as a slice (length chars, starting with "mcro ").
+ * The name is the first word after that, cut to MAX_LABEL_LENGTH - 1 chars,
+ * and is written into the caller's MAX_LABEL_LENGTH buffer.
  */
-char *extract_macro_name(const char *line) {
-    static char name[MAX_LABEL_LENGTH];  /* Static buffer for the name */
-    char *trimmed = trim_whitespace((char*)line);
+char *extract_macro_name(const char *line, int length, char *name) {
+    int i = 5;  /* Skip the "mcro " part */
+    int count = 0;
     
-    /* Use sscanf to extract the word after "macr " */
-    sscanf(trimmed + 5, "%s", name); /* Skip the "macr " part */
+    while (i < length && isspace((unsigned char)line[i])) {
+        i++;
+    }
+    while (i < length && !isspace((unsigned char)line[i]) && count < MAX_LABEL_LENGTH - 1) {
+        name[count++] = line[i++];
+    }
+    name[count] = '\0';
     
     return name;
 }
 
 /*
- * EXPAND_MACRO - Write all lines of a macro to the output file
+ * EXPAND_MACRO - Send all lines of a macro to the output
  * 
  * This is where the actual "expansion" happens. When we encounter
  * a macro call in the source code, we replace it with all the lines
  * that were stored in the macro definition.
  * 
- * Example: If SAVE_REGS contains 2 lines, this function writes
- * both lines to the output file.
+ * The caller already found the macro, so there is no second lookup, and
+ * each line goes out as a slice of ctx->macro_text - nothing is copied
+ * or formatted here.
+ * 
+ * Example: If SAVE_REGS contains 2 lines, this function sends
+ * both lines to the sink (and the .am file if there is one).
  */
-error_code_t expand_macro(FILE *output, const char *macro_name) {
-    macro_def_t *macro;
+error_code_t expand_macro(assembler_context_t *ctx, FILE *output, line_sink_t sink, const macro_def_t *macro) {
+    const macro_line_t *line;
     int i;  /* C90: Variable must be declared at beginning of function */
+    error_code_t result = SUCCESS;
     
-    /* Look up the macro */
-    macro = find_macro(macro_name);
-    if (!macro) {
-        return ERROR_UNDEFINED_LABEL;  /* Macro not found */
-    }
+    ctx->stats.macro_expansions++;
     
-    /* Write each line of the macro to the output file */
-    for (i = 0; i < macro->line_count; i++) {
-        fprintf(output, "%s\n", macro->content[i]);
+    /* Emit each line of the macro */
+    line = &ctx->macro_lines[macro->first_line];
+    for (i = 0; i < macro->line_count && result == SUCCESS; i++, line++) {
+        result = emit_line(ctx, output, sink, ctx->macro_text + line->offset, line->length);
     }
     
-    return SUCCESS;
+    return result;
 }
 
 /* END OF FILE - NO MORE FUNCTIONS AFTER THIS */
\ No newline at end of file
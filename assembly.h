@@ -1,20 +1,28 @@
 /* Assembly/macro processing functions */
 /* Simple header - no includes needed */
 
+/* One line of a macro body - a slice of ctx->macro_text */
+typedef struct macro_line {
+    int offset;                     /* Where the line starts in ctx->macro_text */
+    int length;                     /* Number of chars (no newline, no null) */
+} macro_line_t;
+
 /* Macro definition structure */
 typedef struct macro_def {
     char name[MAX_LABEL_LENGTH];    /* Macro name */
-    char **content;                 /* Array of content lines */
+    unsigned long hash;             /* hash_string(name), used by the macro index */
+    int first_line;                 /* First body line in ctx->macro_lines */
     int line_count;                 /* Number of lines in macro */
     struct macro_def *next;         /* Next macro in linked list */
 } macro_def_t;
 
 /* Function declarations */
-error_code_t process_macros(const char *input_filename, const char *output_filename);
-error_code_t add_macro(const char *name, char **content, int line_count);
-macro_def_t *find_macro(const char *name);
-void free_macros(void);
-error_code_t expand_macro(FILE *output, const char *macro_name);
+error_code_t process_macros(assembler_context_t *ctx, source_file_t *input, const char *output_filename,
+                            line_sink_t sink);
+error_code_t add_macro(assembler_context_t *ctx, const char *name, int first_line, int line_count);
+macro_def_t *find_macro(assembler_context_t *ctx, const char *name, int length);
+void free_macros(assembler_context_t *ctx);
+error_code_t expand_macro(assembler_context_t *ctx, FILE *output, line_sink_t sink, const macro_def_t *macro);
 int is_macro_definition_start(const char *line);
 int is_macro_definition_end(const char *line);
-char *extract_macro_name(const char *line);
\ No newline at end of file
+char *extract_macro_name(const char *line, int length, char *name);
\ No newline at end of file
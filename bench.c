@@ -0,0 +1,548 @@
+/*
+ * BENCHMARK MODULE (--bench)
+ *
+ * The sample .as files are far too small to measure anything, so the
+ * benchmark writes its own program and assembles it a few times:
+ *
+ *   ./assembler --bench
+ *   ./assembler --bench=labels=50000,macros=200,data=10000,runs=10
+ *
+ * The generated program has:
+ * - LABELS labelled instructions, with jumps both back and forward
+ *   (so the second pass really has to resolve forward references)
+ * - MACROS macro definitions, each called a few times
+ * - DATA lines of dense .data, .mat and .string tables after the code,
+ *   which the code refers to (more forward references)
+ * - a few .extern and .entry symbols, so the .ent/.ext files are written
+ *
+ * Every run goes through process_single_file exactly like a normal file,
+ * with timing on, and then we report the time of each stage, lines/s,
+ * words/s, peak memory and how many allocations were made.
+ *
+ * Other options (-j is ignored, --format, --keep-am, --cache-dir) are
+ * used as they are, so they can be measured too.
+ *
+ * BASELINE (baseline=FILE): the first time, the results are saved in FILE -
+ * the program's size, a digest of the output files and the time of every
+ * stage. After that each run is compared with FILE and fails (exit status 1)
+ * if the outputs are not the same bytes any more, or if the throughput went
+ * down by more than tolerance=P percent (default 20). So a change that is
+ * meant to make things faster can't quietly change the .ob/.ent/.ext files
+ * or make them slower. Delete FILE to take a new baseline.
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "bench.h"
+#include "stats.h"
+
+#define BENCH_DEFAULT_LABELS 20000
+#define BENCH_DEFAULT_MACROS 100
+#define BENCH_DEFAULT_DATA 5000
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_DEFAULT_NAME "bench_program"
+#define BENCH_EXTERNS 4          /* EXT0 .. EXT3 */
+#define BENCH_CALLS_PER_MACRO 4  /* Roughly how often each macro is used */
+#define BENCH_DEFAULT_TOLERANCE 20  /* Percent the throughput may drop below the baseline */
+#define BENCH_BASELINE_MAGIC "assembler-bench-baseline 1"
+
+/* What to generate and how often to run it */
+typedef struct {
+    long labels;
+    long macros;
+    long data;
+    long runs;
+    const char *name;            /* Base name of the generated file */
+    int keep;                    /* keep=1: leave the generated files behind */
+    char baseline[MAX_FILENAME_LENGTH];  /* baseline=FILE, "" if none */
+    long tolerance;              /* tolerance=P: allowed slowdown in percent */
+} bench_config_t;
+
+/* Results of one run */
+typedef struct {
+    double stage_seconds[STAGE_COUNT];
+    double total;
+    long lines;                  /* Expanded lines the first pass saw */
+    long words;                  /* Code + data words */
+    long allocations;
+} bench_run_t;
+
+static int parse_bench_spec(const char *spec, bench_config_t *config);
+static int generate_program(const bench_config_t *config, const char *filename);
+static int check_baseline(const bench_config_t *config, const bench_run_t *best, const char *digest);
+
+/*
+ * RUN_BENCHMARK - Generate the program, assemble it config.runs times, report
+ * Returns: exit status for main (0 if every run worked)
+ */
+int run_benchmark(const assembler_options_t *options) {
+    bench_config_t config;
+    assembler_options_t bench_options = *options;
+    assembler_context_t *ctx;
+    bench_run_t run;
+    bench_run_t best;
+    bench_run_t sum;
+    long first_allocations = 0;
+    char filename[MAX_FILENAME_LENGTH];
+    char digest[BENCH_DIGEST_LENGTH + 1];
+    FILE *chatter;
+    FILE *input;
+    long input_size;
+    long r;
+    int s;
+    int status = 0;
+
+    if (!parse_bench_spec(options->bench, &config)) {
+        return 1;
+    }
+    if (strlen(config.name) + strlen(AS_EXT) >= sizeof(filename)) {
+        fprintf(stderr, "Error: Benchmark name '%s' is too long.\n", config.name);
+        return 1;
+    }
+    sprintf(filename, "%s%s", config.name, AS_EXT);
+
+    if (!generate_program(&config, filename)) {
+        fprintf(stderr, "Error: Could not write benchmark program '%s'.\n", filename);
+        return 1;
+    }
+    input = fopen(filename, "rb");
+    input_size = 0;
+    if (input) {
+        fseek(input, 0, SEEK_END);
+        input_size = ftell(input);
+        fclose(input);
+    }
+
+    ctx = malloc(sizeof(assembler_context_t));
+    chatter = tmpfile();  /* The stage banners are not part of the report */
+    if (!ctx) {
+        fprintf(stderr, "Error: Memory allocation failed for assembler context.\n");
+        if (chatter) {
+            fclose(chatter);
+        }
+        return 1;
+    }
+
+    bench_options.timing = 1;
+    init_context(ctx, &bench_options, chatter ? chatter : stdout, stderr);
+    memset(&best, 0, sizeof(best));
+    memset(&sum, 0, sizeof(sum));
+
+    for (r = 0; r < config.runs; r++) {
+        if (chatter) {
+            rewind(chatter);  /* Don't let the banners pile up */
+        }
+        if (process_single_file(ctx, config.name) != SUCCESS) {
+            fprintf(stderr, "Error: Benchmark program did not assemble (run %ld).\n", r + 1);
+            status = 1;
+            break;
+        }
+
+        /* Collect this run while the context still has it */
+        run.total = 0;
+        for (s = 0; s < STAGE_COUNT; s++) {
+            run.stage_seconds[s] = ctx->stats.stage_seconds[s];
+            run.total += run.stage_seconds[s];
+            sum.stage_seconds[s] += run.stage_seconds[s];
+        }
+        run.lines = ctx->line_number;
+        run.words = ctx->code.count + ctx->data.count;
+        run.allocations = ctx->stats.allocations + ctx->arena.allocations;
+        sum.total += run.total;
+        if (r == 0) {
+            first_allocations = run.allocations;
+        }
+        if (r == 0 || run.total < best.total) {
+            best = run;
+        }
+    }
+
+    if (status == 0) {
+        printf("Benchmark: %s - %ld labels, %ld macros, %ld data lines, %ld bytes\n",
+               filename, config.labels, config.macros, config.data, input_size);
+        printf("  %ld expanded lines, %ld words, %ld runs (best run, mean in brackets)\n",
+               best.lines, best.words, config.runs);
+        for (s = 0; s < STAGE_COUNT; s++) {
+            printf("  %-16s %10.6f s  (%.6f)\n", stats_stage_name((stage_t)s),
+                   best.stage_seconds[s], sum.stage_seconds[s] / config.runs);
+        }
+        printf("  %-16s %10.6f s  (%.6f)\n", "Total", best.total, sum.total / config.runs);
+        if (best.total > 0) {
+            printf("  Throughput: %.0f lines/s, %.0f words/s\n", best.lines / best.total, best.words / best.total);
+        }
+        printf("  Peak RSS: %ld KB\n", stats_peak_rss_kb());
+        printf("  Allocations: %ld in the first run, %ld in the last run\n", first_allocations, run.allocations);
+        if (config.baseline[0]) {
+            bench_digest(config.name, digest);  /* The last run's files are still there */
+            status = check_baseline(&config, &best, digest);
+        }
+    }
+
+    reset_context(ctx);
+    free_context(ctx);
+    free(ctx);
+    if (chatter) {
+        fclose(chatter);
+    }
+    if (!config.keep) {
+        remove(filename);
+        bench_remove_outputs(config.name);
+    }
+    return status;
+}
+
+/*
+ * BENCH_GENERATE - Write the program of a --bench SPEC, without running it
+ *
+ * Used by the golden check (golden.c), which assembles it like a sample.
+ * *name is set to the base name the program was written under.
+ * Returns: 1 if it was written, 0 if not (with a message)
+ */
+int bench_generate(const char *spec, const char **name) {
+    bench_config_t config;
+    char filename[MAX_FILENAME_LENGTH];
+
+    if (!parse_bench_spec(spec, &config)) {
+        return 0;
+    }
+    if (strlen(config.name) + strlen(AS_EXT) >= sizeof(filename)) {
+        fprintf(stderr, "Error: Benchmark name '%s' is too long.\n", config.name);
+        return 0;
+    }
+    sprintf(filename, "%s%s", config.name, AS_EXT);
+    if (!generate_program(&config, filename)) {
+        fprintf(stderr, "Error: Could not write benchmark program '%s'.\n", filename);
+        return 0;
+    }
+    *name = config.name;
+    return 1;
+}
+
+/*
+ * PARSE_BENCH_SPEC - Read "labels=N,macros=N,data=N,runs=N,name=NAME,keep=1"
+ *
+ * Every part is optional and they can come in any order; an empty spec
+ * (plain --bench) gives all the defaults.
+ * Returns: 1 if the spec is fine, 0 if not (with a message)
+ */
+static int parse_bench_spec(const char *spec, bench_config_t *config) {
+    const char *p = spec;
+
+    config->labels = BENCH_DEFAULT_LABELS;
+    config->macros = BENCH_DEFAULT_MACROS;
+    config->data = BENCH_DEFAULT_DATA;
+    config->runs = BENCH_DEFAULT_RUNS;
+    config->name = BENCH_DEFAULT_NAME;
+    config->keep = 0;
+    config->baseline[0] = '\0';
+    config->tolerance = BENCH_DEFAULT_TOLERANCE;
+
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        long *number = NULL;
+        long minimum = 0;
+        char *number_end;
+        long value;
+
+        if (length > 7 && strncmp(p, "labels=", 7) == 0) {
+            number = &config->labels;
+            minimum = 1;
+            p += 7;
+        } else if (length > 7 && strncmp(p, "macros=", 7) == 0) {
+            number = &config->macros;
+            p += 7;
+        } else if (length > 5 && strncmp(p, "data=", 5) == 0) {
+            number = &config->data;
+            p += 5;
+        } else if (length > 5 && strncmp(p, "runs=", 5) == 0) {
+            number = &config->runs;
+            minimum = 1;
+            p += 5;
+        } else if (length > 5 && strncmp(p, "name=", 5) == 0 && !end) {
+            config->name = p + 5;  /* Only allowed last, so it can use the rest of the string */
+            break;
+        } else if (length > 10 && strncmp(p, "tolerance=", 10) == 0) {
+            number = &config->tolerance;
+            p += 10;
+        } else if (length > 9 && strncmp(p, "baseline=", 9) == 0) {
+            if (length - 9 >= sizeof(config->baseline)) {
+                fprintf(stderr, "Error: Baseline file name '%.*s' is too long.\n", (int)length - 9, p + 9);
+                return 0;
+            }
+            memcpy(config->baseline, p + 9, length - 9);  /* Up to the next ',' */
+            config->baseline[length - 9] = '\0';
+            p += length;
+        } else if (length == 6 && strncmp(p, "keep=1", 6) == 0) {
+            config->keep = 1;
+            p += 6;
+        } else {
+            fprintf(stderr, "Error: Unknown benchmark setting '%.*s' (use labels=, macros=, data=, runs=, "
+                            "keep=1, baseline=, tolerance=, name= last).\n", (int)length, p);
+            return 0;
+        }
+
+        if (number) {
+            value = strtol(p, &number_end, 10);
+            if (number_end == p || (*number_end != ',' && *number_end != '\0') || value < minimum) {
+                fprintf(stderr, "Error: Invalid benchmark number in '%s'.\n", spec);
+                return 0;
+            }
+            *number = value;
+            p = number_end;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return 1;
+}
+
+/*
+ * GENERATE_PROGRAM - Write the synthetic program
+ *
+ * Label L<i> is instruction i, D<d> is data line d, MAC<m> is macro m.
+ * Every 4th data line is a 2x4 matrix, so D3, D7, D11... can be used
+ * with [r1][r2] indexes.
+ * Returns: 1 if the file was written, 0 if not
+ */
+static int generate_program(const bench_config_t *config, const char *filename) {
+    FILE *file;
+    long call_every;
+    long i;
+    long m;
+    int ok;
+
+    file = fopen(filename, "w");
+    if (!file) {
+        return 0;
+    }
+
+    fprintf(file, "; Synthetic benchmark program - %ld labels, %ld macros, %ld data lines\n",
+            config->labels, config->macros, config->data);
+    for (i = 0; i < BENCH_EXTERNS; i++) {
+        fprintf(file, ".extern EXT%ld\n", i);
+    }
+
+    /* Macro definitions - short bodies with a forward reference each */
+    for (m = 0; m < config->macros; m++) {
+        fprintf(file, "mcro MAC%ld\n", m);
+        fprintf(file, "    inc r%ld\n", m % 8);
+        fprintf(file, "    add #%ld, r%ld\n", m % 100, (m + 1) % 8);
+        fprintf(file, "    prn L%ld\n", (m * 13 + 5) % config->labels);
+        fprintf(file, "mcroend\n");
+    }
+
+    /* Code: one label per instruction, then a reference of some kind */
+    call_every = config->macros > 0 ? config->labels / (config->macros * BENCH_CALLS_PER_MACRO) : 0;
+    if (config->macros > 0 && call_every < 1) {
+        call_every = 1;
+    }
+    for (i = 0; i < config->labels; i++) {
+        fprintf(file, "L%ld: mov #%ld, r%ld\n", i, i % 500, i % 8);
+        switch (i % 4) {
+            case 0:
+                fprintf(file, "    jmp L%ld\n", (i * 7 + 3) % config->labels);  /* Back or forward */
+                break;
+            case 1:
+                if (config->data > 0) {
+                    fprintf(file, "    lea D%ld, r2\n", i % config->data);     /* Forward, into data */
+                } else {
+                    fprintf(file, "    sub r3, r4\n");
+                }
+                break;
+            case 2:
+                if (config->data >= 4) {
+                    fprintf(file, "    cmp D%ld[r1][r2], #5\n", (i % (config->data / 4)) * 4 + 3);
+                } else {
+                    fprintf(file, "    cmp r1, #5\n");
+                }
+                break;
+            default:
+                fprintf(file, "    bne L%ld\n", (i + 1) % config->labels);       /* Next label */
+                break;
+        }
+        if (call_every > 0 && i % call_every == 0) {
+            fprintf(file, "    MAC%ld\n", (i / call_every) % config->macros);
+        }
+        if (i % 64 == 0) {
+            fprintf(file, "    jsr EXT%ld\n", (i / 64) % BENCH_EXTERNS);
+        }
+    }
+    fprintf(file, "    stop\n");
+
+    /* Data tables after the code */
+    for (i = 0; i < config->data; i++) {
+        if (i % 4 == 3) {
+            fprintf(file, "D%ld: .mat [2][4] %ld, %ld, %ld, %ld, %ld, %ld, %ld, %ld\n", i,
+                    i % 97, -(i % 13), 1L, 2L, 3L, 4L, i % 50, 0L);
+        } else if (i % 16 == 0) {
+            fprintf(file, "D%ld: .string \"benchmark\"\n", i);
+        } else {
+            fprintf(file, "D%ld: .data %ld, %ld, %ld, -%ld, %ld, %ld, %ld, %ld\n", i,
+                    i % 500, (i * 3) % 511, 7L, i % 100, 0L, 1L, 2L, i % 255);
+        }
+    }
+
+    /* A few entry points */
+    for (i = 0; i < config->labels; i += 100) {
+        fprintf(file, ".entry L%ld\n", i);
+    }
+
+    ok = !ferror(file);
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    return ok;
+}
+
+/*
+ * BENCH_REMOVE_OUTPUTS - Delete everything assembling NAME may have written
+ */
+void bench_remove_outputs(const char *name) {
+    static const char *extensions[] = { AM_EXT, OB_EXT, ENT_EXT, EXT_EXT, BIN_EXT };
+    char filename[MAX_FILENAME_LENGTH];
+    size_t i;
+
+    for (i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (strlen(name) + strlen(extensions[i]) < sizeof(filename)) {
+            sprintf(filename, "%s%s", name, extensions[i]);
+            remove(filename);
+        }
+    }
+}
+
+/*
+ * BENCH_DIGEST - Hash every output file of NAME into 16 hex digits
+ *
+ * Like the cache keys (cache.c): FNV-1a and djb2 side by side, with the
+ * length mixed in at the end. The .am file is left out because it depends
+ * on --keep-am. A missing file hashes like an empty one, but its extension
+ * is hashed too, so moving bytes from one file to another still shows up.
+ */
+void bench_digest(const char *name, char *digest) {
+    static const char *extensions[] = { OB_EXT, ENT_EXT, EXT_EXT, BIN_EXT };
+    char filename[MAX_FILENAME_LENGTH];
+    char text[BENCH_DIGEST_LENGTH * 2 + 1];  /* Room for two 16-digit longs, to keep the compiler happy */
+    unsigned long fnv = 2166136261UL;
+    unsigned long djb = 5381UL;
+    unsigned long length = 0;
+    const char *p;
+    FILE *file;
+    size_t i;
+    int c;
+
+    for (i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        for (p = extensions[i]; *p; p++) {
+            fnv = ((fnv ^ (unsigned char)*p) * 16777619UL) & 0xFFFFFFFFUL;
+            djb = ((djb * 33) ^ (unsigned char)*p) & 0xFFFFFFFFUL;
+        }
+        if (strlen(name) + strlen(extensions[i]) >= sizeof(filename)) {
+            continue;
+        }
+        sprintf(filename, "%s%s", name, extensions[i]);
+        file = fopen(filename, "rb");
+        if (!file) {
+            continue;
+        }
+        while ((c = getc(file)) != EOF) {
+            fnv = ((fnv ^ (unsigned char)c) * 16777619UL) & 0xFFFFFFFFUL;
+            djb = ((djb * 33) ^ (unsigned char)c) & 0xFFFFFFFFUL;
+            length++;
+        }
+        fclose(file);
+    }
+    /* Both fit in 8 digits, but the compiler can't tell, so format with room to spare */
+    sprintf(text, "%08lx%08lx", fnv & 0xFFFFFFFFUL, (djb ^ length) & 0xFFFFFFFFUL);
+    memcpy(digest, text, BENCH_DIGEST_LENGTH);
+    digest[BENCH_DIGEST_LENGTH] = '\0';
+}
+
+/*
+ * CHECK_BASELINE - Save the results in config->baseline, or compare them with it
+ *
+ * The file is plain text, one value per line:
+ *   assembler-bench-baseline 1
+ *   program LABELS MACROS DATA
+ *   digest HEX
+ *   throughput LINES_PER_SECOND
+ *   seconds MACROS FIRST_PASS SECOND_PASS OUTPUT
+ * Only the digest and the throughput decide - the stages are printed so
+ * it is easy to see where the time went.
+ * Returns: exit status for main (0 if saved or no worse than the baseline)
+ */
+static int check_baseline(const bench_config_t *config, const bench_run_t *best, const char *digest) {
+    FILE *file;
+    char magic[sizeof(BENCH_BASELINE_MAGIC)];
+    char old_digest[BENCH_DIGEST_LENGTH + 1];
+    long labels;
+    long macros;
+    long data;
+    double old_throughput;
+    double old_seconds[STAGE_COUNT];
+    double throughput = best->total > 0 ? best->lines / best->total : 0;
+    double change;
+    int ok;
+    int s;
+
+    file = fopen(config->baseline, "r");
+    if (!file) {
+        /* No baseline yet - this run is it */
+        file = fopen(config->baseline, "w");
+        if (!file) {
+            fprintf(stderr, "Error: Could not write baseline '%s'.\n", config->baseline);
+            return 1;
+        }
+        fprintf(file, "%s\nprogram %ld %ld %ld\ndigest %s\nthroughput %.0f\nseconds",
+                BENCH_BASELINE_MAGIC, config->labels, config->macros, config->data, digest, throughput);
+        for (s = 0; s < STAGE_COUNT; s++) {
+            fprintf(file, " %.6f", best->stage_seconds[s]);
+        }
+        fprintf(file, "\n");
+        ok = !ferror(file);
+        if (fclose(file) != 0 || !ok) {
+            fprintf(stderr, "Error: Could not write baseline '%s'.\n", config->baseline);
+            return 1;
+        }
+        printf("  Baseline: saved in %s (outputs %s)\n", config->baseline, digest);
+        return 0;
+    }
+
+    ok = fgets(magic, sizeof(magic), file) != NULL && strcmp(magic, BENCH_BASELINE_MAGIC) == 0 &&
+         fscanf(file, " program %ld %ld %ld", &labels, &macros, &data) == 3 &&
+         fscanf(file, " digest %16s", old_digest) == 1 &&
+         fscanf(file, " throughput %lf", &old_throughput) == 1 &&
+         fscanf(file, " seconds") == 0;
+    for (s = 0; ok && s < STAGE_COUNT; s++) {
+        ok = fscanf(file, "%lf", &old_seconds[s]) == 1;
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Error: '%s' is not a benchmark baseline.\n", config->baseline);
+        return 1;
+    }
+    if (labels != config->labels || macros != config->macros || data != config->data) {
+        fprintf(stderr, "Error: Baseline '%s' is for labels=%ld,macros=%ld,data=%ld - not this program.\n",
+                config->baseline, labels, macros, data);
+        return 1;
+    }
+
+    for (s = 0; s < STAGE_COUNT; s++) {
+        printf("  %-16s %10.6f s  (baseline %.6f)\n", stats_stage_name((stage_t)s),
+               best->stage_seconds[s], old_seconds[s]);
+    }
+    change = old_throughput > 0 ? (throughput - old_throughput) * 100.0 / old_throughput : 0;
+    printf("  Baseline: %.0f lines/s against %.0f (%+.1f%%), outputs %s\n",
+           throughput, old_throughput, change, strcmp(digest, old_digest) == 0 ? "the same" : "CHANGED");
+
+    if (strcmp(digest, old_digest) != 0) {
+        fprintf(stderr, "Error: The output files differ from the baseline '%s' (digest %s, was %s).\n",
+                config->baseline, digest, old_digest);
+        return 1;
+    }
+    if (change < -(double)config->tolerance) {
+        fprintf(stderr, "Error: Throughput is %.1f%% below the baseline '%s' (tolerance %ld%%).\n",
+                -change, config->baseline, config->tolerance);
+        return 1;
+    }
+    return 0;
+}
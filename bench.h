@@ -0,0 +1,10 @@
+/* Built-in benchmark (--bench) */
+/* Simple header - no includes needed */
+
+#define BENCH_DIGEST_LENGTH 16   /* Hex digits in an output digest */
+
+/* Function declarations */
+int run_benchmark(const assembler_options_t *options);
+int bench_generate(const char *spec, const char **name);
+void bench_digest(const char *name, char *digest);
+void bench_remove_outputs(const char *name);
@@ -0,0 +1,466 @@
+/*
+ * ASSEMBLY CACHE MODULE (--cache-dir)
+ *
+ * Most builds run the assembler on modules that did not change since the
+ * last build. With --cache-dir DIR we remember the output files of every
+ * successful assembly in DIR, and give them back next time instead of
+ * assembling again.
+ *
+ * There are two ways to hit the cache:
+ *
+ * 1. SOURCE KEY - a hash of the .as file (plus assembler version and
+ *    options). If we saw exactly this file before, the outputs are copied
+ *    back and nothing else runs - no macro expansion, no passes.
+ *
+ * 2. EXPANDED KEY - a hash of the program after macro expansion, with
+ *    comments, empty lines and extra whitespace left out. If somebody only
+ *    changed a comment, the source key misses but this one still hits, and
+ *    we skip both passes. To get this key the macros have to be expanded, so
+ *    while we look, the expanded lines are kept in memory (cache_line is the
+ *    line sink). On a miss they are replayed into the first pass, so the
+ *    .as file is still only expanded once.
+ *
+ * Files in DIR:
+ *   <source key>.src   - the expanded key that this source produced
+ *   <source key>.am    - the .am file (only when --keep-am is used)
+ *   <expanded key>.ob  - the outputs (.ent/.ext only if the program has them),
+ *                        or <expanded key>.bin with --format=bin
+ * The .ob (or .bin) is written last, so if it is there the entry is complete. Every file
+ * is written under a temporary name and renamed into place, so a crash or a
+ * parallel build never leaves half a file in the cache.
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
+#include "source.h"
+#include "cache.h"
+#include "first_pass.h" /* SYMBOL_ENTRY - to know if there is an .ent file */
+#include "memory.h"
+#include "second_pass.h"
+#include "utils.h"
+
+#define CACHE_LINES_INITIAL_SIZE 4096
+#define CACHE_COPY_CHUNK 4096
+
+static void hash_init(cache_hash_t *hash, const char *domain, const assembler_options_t *options);
+static void hash_update(cache_hash_t *hash, const char *data, size_t length);
+static void hash_finish(const cache_hash_t *hash, char *key);
+static char *cache_path(assembler_context_t *ctx, const char *key, const char *extension);
+static int copy_file(const char *from, const char *to);
+static int store_file(assembler_context_t *ctx, const char *from, const char *key, const char *extension);
+static void store_source_key(assembler_context_t *ctx, cache_state_t *state);
+static int restore_outputs(assembler_context_t *ctx, const char *key, const char *base_name);
+
+/*
+ * CACHE_BEGIN - Work out the source key for a file
+ *
+ * The .as file is already in memory (source.c), so this is one pass of the
+ * hash over it.
+ */
+void cache_begin(assembler_context_t *ctx, cache_state_t *state, const source_file_t *source) {
+    cache_hash_t hash;
+
+    memset(state, 0, sizeof(*state));
+    state->dir = ctx->options->cache_dir;
+
+    hash_init(&hash, "source", ctx->options);
+    hash_update(&hash, source->text, source->size);
+    hash_finish(&hash, state->source_key);
+
+    hash_init(&state->expanded_hash, "expanded", ctx->options);
+    ctx->cache = state;
+}
+
+/*
+ * CACHE_RESTORE_SOURCE - Try the source key
+ *
+ * Returns: 1 if the outputs were restored (the file is done), 0 on a miss
+ */
+int cache_restore_source(assembler_context_t *ctx, cache_state_t *state, const char *am_filename, const char *base_name) {
+    FILE *file;
+    char *path;
+    char key[CACHE_KEY_LENGTH + 1];
+    int found;
+
+    path = cache_path(ctx, state->source_key, ".src");
+    if (!path || !(file = fopen(path, "r"))) {
+        return 0;
+    }
+    found = fscanf(file, "%24s", key) == 1 && strlen(key) == CACHE_KEY_LENGTH;
+    fclose(file);
+    if (!found) {
+        return 0;
+    }
+
+    /* With --keep-am the .am file has to come back too (it has the comments) */
+    if (ctx->options->keep_am) {
+        path = cache_path(ctx, state->source_key, AM_EXT);
+        if (!path || !copy_file(path, am_filename)) {
+            return 0;
+        }
+    }
+
+    return restore_outputs(ctx, key, base_name);
+}
+
+/*
+ * CACHE_LINE - Line sink: keep an expanded line and add it to the expanded key
+ *
+ * The line is stored exactly as it is (for replaying into the first pass),
+ * but the hash only sees what matters to the assembler, so that comment and
+ * whitespace edits still give the same key:
+ * - empty lines and comment lines are skipped
+ * - everything up to a label's colon is hashed as it is (extract_label counts
+ *   leading spaces towards the label length, so they are not "just whitespace")
+ * - after that, leading/trailing whitespace is dropped and every run of
+ *   spaces and tabs counts as one space (the tokenizer splits on runs anyway)
+ */
+error_code_t cache_line(assembler_context_t *ctx, const char *text, int length) {
+    cache_state_t *state = ctx->cache;
+    char normalized[CACHE_COPY_CHUNK];
+    line_scan_t scan;
+    int out = 0;
+    int start = 0;
+    int pending_space = 0;
+    int emitted = 0;         /* Anything after the label part yet? */
+    int i;
+
+    /* Keep the raw line for cache_replay */
+    if (state->lines_size + length + 1 > state->lines_capacity) {
+        int new_capacity = state->lines_capacity ? state->lines_capacity : CACHE_LINES_INITIAL_SIZE;
+        char *new_lines;
+
+        while (state->lines_size + length + 1 > new_capacity) {
+            new_capacity *= 2;
+        }
+        new_lines = memory_realloc(ctx, MEMORY_RECORDS, state->lines, state->lines_capacity, new_capacity);
+        if (!new_lines) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+        state->lines = new_lines;
+        state->lines_capacity = new_capacity;
+    }
+    memcpy(state->lines + state->lines_size, text, length);
+    state->lines_size += length;
+    state->lines[state->lines_size++] = '\n';
+
+    /* Skip empty lines and comments - they never change the output */
+    scan_line(text, length, &scan);
+    if (scan.start == scan.end || scan.is_comment) {
+        return SUCCESS;
+    }
+
+    /* A label part (up to the colon) is hashed as it is */
+    start = scan.start;
+    if (scan.colon >= 0) {
+        start = scan.colon + 1;
+        hash_update(&state->expanded_hash, text, start);
+    }
+
+    /* The rest: one space for every run of spaces/tabs, none at the ends */
+    for (i = start; i < length; i++) {
+        if (text[i] == ' ' || text[i] == '\t') {
+            pending_space = emitted;
+            continue;
+        }
+        if (out > (int)sizeof(normalized) - 2) {
+            hash_update(&state->expanded_hash, normalized, out);  /* Very long line - hash what we have */
+            out = 0;
+        }
+        if (pending_space) {
+            normalized[out++] = ' ';
+            pending_space = 0;
+        }
+        normalized[out++] = text[i];
+        emitted = 1;
+    }
+    normalized[out++] = '\n';
+
+    hash_update(&state->expanded_hash, normalized, out);
+    return SUCCESS;
+}
+
+/*
+ * CACHE_RESTORE_EXPANDED - Try the expanded key (after cache_line saw every line)
+ *
+ * On a hit the source key is also recorded, so next time this exact .as
+ * file hits without even expanding the macros.
+ * Returns: 1 if the outputs were restored (the file is done), 0 on a miss
+ */
+int cache_restore_expanded(assembler_context_t *ctx, cache_state_t *state, const char *am_filename, const char *base_name) {
+    hash_finish(&state->expanded_hash, state->expanded_key);
+
+    if (!restore_outputs(ctx, state->expanded_key, base_name)) {
+        return 0;
+    }
+
+    /* Remember this source for next time (without touching the outputs again) */
+    if (!ctx->options->keep_am || store_file(ctx, am_filename, state->source_key, AM_EXT)) {
+        store_source_key(ctx, state);
+    }
+    return 1;
+}
+
+/*
+ * CACHE_REPLAY - Send the kept lines to the real sink (the first pass)
+ */
+error_code_t cache_replay(assembler_context_t *ctx, cache_state_t *state, line_sink_t sink) {
+    int start = 0;
+    int end;
+    error_code_t result = SUCCESS;
+
+    for (end = 0; end < state->lines_size && result == SUCCESS; end++) {
+        if (state->lines[end] == '\n') {
+            result = sink(ctx, state->lines + start, end - start);
+            start = end + 1;
+        }
+    }
+    return result;
+}
+
+/*
+ * CACHE_STORE - Save the outputs of a successful assembly
+ *
+ * Only the files this program really produced are stored. Problems writing
+ * the cache are not errors - the outputs are already there, the next build
+ * just won't hit.
+ */
+void cache_store(assembler_context_t *ctx, cache_state_t *state, const char *am_filename, const char *base_name) {
+    int symbol;
+    char *output;
+    const char *object_ext = ctx->options->format == FORMAT_BINARY ? BIN_EXT : OB_EXT;
+    int has_entries = 0;
+
+    /* A .bin file has the entries and externs inside it, so only .ob needs the others */
+    if (ctx->options->format != FORMAT_BINARY) {
+        for (symbol = 0; symbol < ctx->symbol_count; symbol++) {
+            if (ctx->symbol_flags[symbol] & SYMBOL_ENTRY) {
+                has_entries = 1;
+                break;
+            }
+        }
+
+        if (has_entries) {
+            output = create_filename(&ctx->arena, base_name, ENT_EXT);
+            if (!output || !store_file(ctx, output, state->expanded_key, ENT_EXT)) {
+                return;
+            }
+        }
+        if (ctx->external_reference_count > 0) {
+            output = create_filename(&ctx->arena, base_name, EXT_EXT);
+            if (!output || !store_file(ctx, output, state->expanded_key, EXT_EXT)) {
+                return;
+            }
+        }
+    }
+
+    /* The .ob (or .bin) goes last - it marks the entry as complete */
+    output = create_filename(&ctx->arena, base_name, object_ext);
+    if (!output || !store_file(ctx, output, state->expanded_key, object_ext)) {
+        return;
+    }
+
+    if (ctx->options->keep_am && !store_file(ctx, am_filename, state->source_key, AM_EXT)) {
+        return;
+    }
+
+    /* Finally point the source key at the outputs */
+    store_source_key(ctx, state);
+}
+
+/*
+ * CACHE_END - Free what the cache kept for this file
+ */
+void cache_end(assembler_context_t *ctx, cache_state_t *state) {
+    memory_free(ctx, MEMORY_RECORDS, state->lines, state->lines_capacity);
+    state->lines = NULL;
+    state->lines_size = 0;
+    state->lines_capacity = 0;
+    ctx->cache = NULL;
+}
+
+/*
+ * HASH_INIT - Start a hash for one kind of key
+ *
+ * The domain ("source" or "expanded"), the assembler version and all
+ * options that change the outputs go in first, so a new version or a
+ * different option can never hit an old entry. (--keep-am and -j don't
+ * change the output files, so they are not part of the key - --format does.)
+ */
+static void hash_init(cache_hash_t *hash, const char *domain, const assembler_options_t *options) {
+    char prefix[64];
+
+    hash->fnv = 2166136261UL;  /* FNV offset basis */
+    hash->djb = 5381UL;        /* djb2 starting value */
+    hash->length = 0;
+
+    sprintf(prefix, "%.16s " ASSEMBLER_VERSION " format=%d\n", domain, (int)options->format);
+    hash_update(hash, prefix, strlen(prefix));
+}
+
+/*
+ * HASH_UPDATE - Add some bytes to a hash
+ */
+static void hash_update(cache_hash_t *hash, const char *data, size_t length) {
+    unsigned long fnv = hash->fnv;
+    unsigned long djb = hash->djb;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)data[i];
+
+        fnv = ((fnv ^ c) * 16777619UL) & 0xFFFFFFFFUL;  /* FNV prime */
+        djb = ((djb * 33) ^ c) & 0xFFFFFFFFUL;
+    }
+    hash->fnv = fnv;
+    hash->djb = djb;
+    hash->length = (hash->length + length) & 0xFFFFFFFFUL;
+}
+
+/*
+ * HASH_FINISH - Turn a hash into a CACHE_KEY_LENGTH hex digit key
+ */
+static void hash_finish(const cache_hash_t *hash, char *key) {
+    sprintf(key, "%08lx%08lx%08lx", hash->fnv, hash->djb, hash->length);
+}
+
+/*
+ * CACHE_PATH - Build "<dir>/<key><extension>" (in the arena)
+ */
+static char *cache_path(assembler_context_t *ctx, const char *key, const char *extension) {
+    const char *dir = ctx->cache->dir;
+    char *path = arena_alloc(&ctx->arena, strlen(dir) + 1 + strlen(key) + strlen(extension) + 1);
+
+    if (path) {
+        sprintf(path, "%s/%s%s", dir, key, extension);
+    }
+    return path;
+}
+
+/*
+ * COPY_FILE - Copy a file byte for byte
+ * Returns: 1 if it worked, 0 if not
+ */
+static int copy_file(const char *from, const char *to) {
+    FILE *in;
+    FILE *out;
+    char chunk[CACHE_COPY_CHUNK];
+    size_t count;
+    int ok = 1;
+
+    in = fopen(from, "rb");
+    if (!in) {
+        return 0;
+    }
+    out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return 0;
+    }
+
+    while ((count = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        if (fwrite(chunk, 1, count, out) != count) {
+            ok = 0;
+            break;
+        }
+    }
+    if (ferror(in)) {
+        ok = 0;
+    }
+    fclose(in);
+    if (fclose(out) != 0) {
+        ok = 0;
+    }
+    return ok;
+}
+
+/*
+ * STORE_FILE - Copy a file into the cache as <key><extension>
+ *
+ * It is copied to a temporary name first and then renamed, so nobody
+ * ever sees half of it. The temporary name includes the context address,
+ * so two -j workers never write the same temporary file.
+ * Returns: 1 if it worked, 0 if not
+ */
+static int store_file(assembler_context_t *ctx, const char *from, const char *key, const char *extension) {
+    char *path = cache_path(ctx, key, extension);
+    char suffix[32];
+    char *temp;
+
+    sprintf(suffix, "%s.%lx.tmp", extension, (unsigned long)(size_t)ctx);
+    temp = cache_path(ctx, key, suffix);
+    if (!path || !temp) {
+        return 0;
+    }
+
+    if (!copy_file(from, temp)) {
+        remove(temp);
+        return 0;
+    }
+    remove(path);  /* rename() may not replace an existing file everywhere */
+    if (rename(temp, path) != 0) {
+        remove(temp);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * STORE_SOURCE_KEY - Write <source key>.src naming the expanded key
+ *
+ * Same temporary name + rename trick as store_file.
+ */
+static void store_source_key(assembler_context_t *ctx, cache_state_t *state) {
+    char *path = cache_path(ctx, state->source_key, ".src");
+    char suffix[32];
+    char *temp;
+    FILE *file;
+
+    sprintf(suffix, ".src.%lx.tmp", (unsigned long)(size_t)ctx);
+    temp = cache_path(ctx, state->source_key, suffix);
+    if (!path || !temp || !(file = fopen(temp, "w"))) {
+        return;
+    }
+
+    fprintf(file, "%s\n", state->expanded_key);
+    if (fclose(file) != 0) {
+        remove(temp);
+        return;
+    }
+    remove(path);
+    if (rename(temp, path) != 0) {
+        remove(temp);
+    }
+}
+
+/*
+ * RESTORE_OUTPUTS - Copy <key>.ob (and .ent/.ext if cached) or <key>.bin to base_name.*
+ * Returns: 1 if the .ob/.bin was restored, 0 if there is no such entry
+ */
+static int restore_outputs(assembler_context_t *ctx, const char *key, const char *base_name) {
+    const char *object_ext = ctx->options->format == FORMAT_BINARY ? BIN_EXT : OB_EXT;
+    char *path;
+    char *output;
+
+    path = cache_path(ctx, key, object_ext);
+    output = create_filename(&ctx->arena, base_name, object_ext);
+    if (!path || !output || !copy_file(path, output)) {
+        return 0;
+    }
+    if (ctx->options->format == FORMAT_BINARY) {
+        return 1;  /* Nothing else - the .bin has it all */
+    }
+
+    path = cache_path(ctx, key, ENT_EXT);
+    output = create_filename(&ctx->arena, base_name, ENT_EXT);
+    if (path && output) {
+        copy_file(path, output);  /* Fails quietly when the program has no entries */
+    }
+
+    path = cache_path(ctx, key, EXT_EXT);
+    output = create_filename(&ctx->arena, base_name, EXT_EXT);
+    if (path && output) {
+        copy_file(path, output);
+    }
+    return 1;
+}
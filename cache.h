@@ -0,0 +1,31 @@
+/* Assembly cache (--cache-dir) */
+/* Simple header - no includes needed */
+
+#define CACHE_KEY_LENGTH 24          /* Hex digits in a cache key */
+
+/* Running hash over some bytes - two independent 32-bit hashes plus the length */
+typedef struct {
+    unsigned long fnv;               /* FNV-1a */
+    unsigned long djb;               /* djb2 (xor variant) */
+    unsigned long length;            /* Bytes hashed so far */
+} cache_hash_t;
+
+/* Everything the cache needs while one file is assembled */
+typedef struct cache_state {
+    const char *dir;                            /* The --cache-dir directory */
+    char source_key[CACHE_KEY_LENGTH + 1];      /* Hash of the .as file */
+    char expanded_key[CACHE_KEY_LENGTH + 1];    /* Hash of the expanded program */
+    cache_hash_t expanded_hash;                 /* Built up by cache_line */
+    char *lines;                                /* Expanded lines, '\n' after each */
+    int lines_size;
+    int lines_capacity;
+} cache_state_t;
+
+/* Function declarations */
+void cache_begin(assembler_context_t *ctx, cache_state_t *state, const source_file_t *source);
+int cache_restore_source(assembler_context_t *ctx, cache_state_t *state, const char *am_filename, const char *base_name);
+error_code_t cache_line(assembler_context_t *ctx, const char *text, int length);
+int cache_restore_expanded(assembler_context_t *ctx, cache_state_t *state, const char *am_filename, const char *base_name);
+error_code_t cache_replay(assembler_context_t *ctx, cache_state_t *state, line_sink_t sink);
+void cache_store(assembler_context_t *ctx, cache_state_t *state, const char *am_filename, const char *base_name);
+void cache_end(assembler_context_t *ctx, cache_state_t *state);
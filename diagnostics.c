@@ -0,0 +1,235 @@
+/*
+ * DIAGNOSTICS MODULE - Collect error messages and print them per file
+ *
+ * print_error used to fprintf every error the moment it was found. On a badly
+ * broken file that is thousands of tiny writes, and most of them were noise:
+ * a line that failed was reported once by the code that found the problem and
+ * then again as a generic "Error in first pass" by the loop around it.
+ *
+ * Now every error is recorded in the context (file, line, column, code,
+ * message) and the whole list is written by flush_diagnostics at the end of
+ * the file, in one fwrite. On the way:
+ * - the generic "this line failed" errors (report_line_failed) are dropped
+ *   when the line already has a more specific error
+ * - the same message twice for the same line is only kept once
+ * - with --max-errors N only the first N errors of a file are kept, and one
+ *   line at the end says how many more there were
+ *
+ * Because every file's messages come out in one piece, files assembled at the
+ * same time (-j) can't mix their error lines.
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
+#include "diagnostics.h"
+#include "memory.h"
+
+#define DIAGNOSTIC_INITIAL_CAPACITY 32
+#define DIAGNOSTIC_NUMBER_SPACE 64   /* Room for the numbers and fixed words of one line */
+
+static diagnostic_t *new_diagnostic(assembler_context_t *ctx);
+static int append_text(assembler_context_t *ctx, int size, int needed);
+
+/*
+ * REPORT_ERROR - Record one error for the current file
+ *
+ * line 0 means the error is about the whole file, column 0 means we don't
+ * know where in the line it is. message must stay valid until the file is
+ * flushed (all the callers pass string literals).
+ */
+void report_error(assembler_context_t *ctx, int line, int column, error_code_t code, const char *message) {
+    diagnostic_t *last;
+    diagnostic_t *diagnostic;
+    
+    /* A second copy of the same error for the same line adds nothing */
+    if (ctx->diagnostic_count > 0) {
+        last = &ctx->diagnostics[ctx->diagnostic_count - 1];
+        if (last->file == ctx->current_filename && last->line == line && line > 0 &&
+            strcmp(last->message, message) == 0) {
+            return;
+        }
+    }
+    
+    if (ctx->options->max_errors > 0 && ctx->diagnostic_errors >= ctx->options->max_errors) {
+        ctx->diagnostics_dropped++;  /* Over the limit - only counted */
+        return;
+    }
+    
+    diagnostic = new_diagnostic(ctx);
+    if (!diagnostic) {
+        /* No memory to keep it - better to print it now than to lose it */
+        if (line > 0) {
+            fprintf(ctx->err, "Error in file %s, line %d: %s\n", ctx->current_filename, line, message);
+        } else {
+            fprintf(ctx->err, "Error in file %s: %s\n", ctx->current_filename, message);
+        }
+        return;
+    }
+    diagnostic->file = ctx->current_filename;
+    diagnostic->line = line;
+    diagnostic->column = column;
+    diagnostic->code = code;
+    diagnostic->message = message;
+    ctx->diagnostic_errors++;
+}
+
+/*
+ * REPORT_LINE_FAILED - Record that a line failed, unless we already know why
+ *
+ * The passes call this when a line comes back with an error. Most of the time
+ * the code that found the problem has already reported it (with a better
+ * message), and then this one is left out.
+ */
+void report_line_failed(assembler_context_t *ctx, int line, error_code_t code, const char *message) {
+    int i;
+    
+    /* Errors arrive in line order, so only the newest ones can be for this line */
+    for (i = ctx->diagnostic_count - 1; i >= 0; i--) {
+        if (ctx->diagnostics[i].file != ctx->current_filename || ctx->diagnostics[i].line != line) {
+            break;
+        }
+        if (ctx->diagnostics[i].code != SUCCESS) {
+            return;  /* This line already has an error */
+        }
+    }
+    report_error(ctx, line, 0, code, message);
+}
+
+/*
+ * REPORT_NOTE - Record a message that is printed just as it is
+ *
+ * For the "Error: First pass failed." style messages of process_single_file,
+ * so they still come out after the errors they are about. format may contain
+ * one %s, which is replaced by name. Notes don't count for --max-errors.
+ */
+void report_note(assembler_context_t *ctx, const char *format, const char *name) {
+    diagnostic_t *diagnostic;
+    char *text;
+    
+    if (!name) {
+        name = "";
+    }
+    text = arena_alloc(&ctx->arena, strlen(format) + strlen(name) + 1);
+    diagnostic = text ? new_diagnostic(ctx) : NULL;
+    if (!diagnostic) {
+        fprintf(ctx->err, format, name);
+        fputc('\n', ctx->err);
+        return;
+    }
+    sprintf(text, format, name);
+    diagnostic->file = NULL;
+    diagnostic->line = 0;
+    diagnostic->column = 0;
+    diagnostic->code = SUCCESS;
+    diagnostic->message = text;
+}
+
+/*
+ * FLUSH_DIAGNOSTICS - Write everything that was recorded, in one go
+ *
+ * The lines look exactly like print_error's used to:
+ *   Error in file prog.am, line 7: Undefined symbol
+ *   Error in file prog.am, line 7, column 5: Unknown instruction or directive
+ * The list is emptied afterwards, so this can be called more than once.
+ */
+void flush_diagnostics(assembler_context_t *ctx) {
+    const diagnostic_t *diagnostic;
+    const char *file;
+    int size = 0;
+    int i;
+    
+    for (i = 0; i < ctx->diagnostic_count; i++) {
+        diagnostic = &ctx->diagnostics[i];
+        file = diagnostic->file ? diagnostic->file : "";
+        if (!append_text(ctx, size, (int)(strlen(file) + strlen(diagnostic->message)) + DIAGNOSTIC_NUMBER_SPACE)) {
+            break;  /* Out of memory - print what fits */
+        }
+        
+        if (!diagnostic->file) {
+            size += sprintf(ctx->diagnostic_text + size, "%s\n", diagnostic->message);
+        } else if (diagnostic->line > 0 && diagnostic->column > 0) {
+            size += sprintf(ctx->diagnostic_text + size, "Error in file %s, line %d, column %d: %s\n",
+                            file, diagnostic->line, diagnostic->column, diagnostic->message);
+        } else if (diagnostic->line > 0) {
+            /* Include line number if provided */
+            size += sprintf(ctx->diagnostic_text + size, "Error in file %s, line %d: %s\n",
+                            file, diagnostic->line, diagnostic->message);
+        } else {
+            /* General file error without specific line */
+            size += sprintf(ctx->diagnostic_text + size, "Error in file %s: %s\n", file, diagnostic->message);
+        }
+        
+        /* The --max-errors line goes right after the last error (before the notes) */
+        if (ctx->diagnostics_dropped > 0 && diagnostic->file &&
+            (i + 1 == ctx->diagnostic_count || !ctx->diagnostics[i + 1].file) &&
+            append_text(ctx, size, (int)strlen(file) + DIAGNOSTIC_NUMBER_SPACE)) {
+            size += sprintf(ctx->diagnostic_text + size, "Error in file %s: %d more errors not shown (--max-errors %d)\n",
+                            file, ctx->diagnostics_dropped, ctx->options->max_errors);
+            ctx->diagnostics_dropped = 0;
+        }
+    }
+    
+    if (size > 0) {
+        fwrite(ctx->diagnostic_text, 1, size, ctx->err);
+    }
+    fflush(ctx->err);
+    
+    ctx->diagnostic_count = 0;
+    ctx->diagnostic_errors = 0;
+    ctx->diagnostics_dropped = 0;
+}
+
+/*
+ * FREE_DIAGNOSTICS - Give back the list and the output buffer
+ */
+void free_diagnostics(assembler_context_t *ctx) {
+    memory_free(ctx, MEMORY_OTHER, ctx->diagnostics, ctx->diagnostic_capacity * sizeof(diagnostic_t));
+    memory_free(ctx, MEMORY_OTHER, ctx->diagnostic_text, ctx->diagnostic_text_capacity);
+    ctx->diagnostics = NULL;
+    ctx->diagnostic_capacity = 0;
+    ctx->diagnostic_count = 0;
+    ctx->diagnostic_text = NULL;
+    ctx->diagnostic_text_capacity = 0;
+}
+
+/*
+ * NEW_DIAGNOSTIC - One more entry at the end of the list (the list doubles as needed)
+ * Returns: the new entry, or NULL if there is no memory
+ */
+static diagnostic_t *new_diagnostic(assembler_context_t *ctx) {
+    if (ctx->diagnostic_count == ctx->diagnostic_capacity) {
+        int new_capacity = ctx->diagnostic_capacity ? ctx->diagnostic_capacity * 2 : DIAGNOSTIC_INITIAL_CAPACITY;
+        diagnostic_t *new_list;
+        
+        new_list = memory_realloc(ctx, MEMORY_OTHER, ctx->diagnostics, ctx->diagnostic_capacity * sizeof(diagnostic_t),
+                                  new_capacity * sizeof(diagnostic_t));
+        if (!new_list) {
+            return NULL;
+        }
+        ctx->diagnostics = new_list;
+        ctx->diagnostic_capacity = new_capacity;
+    }
+    return &ctx->diagnostics[ctx->diagnostic_count++];
+}
+
+/*
+ * APPEND_TEXT - Make sure the output buffer has room for needed more bytes
+ * Returns: 1 if it has, 0 if there is no memory
+ */
+static int append_text(assembler_context_t *ctx, int size, int needed) {
+    if (size + needed > ctx->diagnostic_text_capacity) {
+        int new_capacity = ctx->diagnostic_text_capacity ? ctx->diagnostic_text_capacity : 1024;
+        char *new_text;
+        
+        while (new_capacity < size + needed) {
+            new_capacity *= 2;
+        }
+        new_text = memory_realloc(ctx, MEMORY_OTHER, ctx->diagnostic_text, ctx->diagnostic_text_capacity, new_capacity);
+        if (!new_text) {
+            return 0;
+        }
+        ctx->diagnostic_text = new_text;
+        ctx->diagnostic_text_capacity = new_capacity;
+    }
+    return 1;
+}
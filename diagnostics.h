@@ -0,0 +1,18 @@
+/* Diagnostics - error messages collected per file and written out in one go */
+/* Simple header - no includes needed */
+
+/* One error (or note) waiting to be printed */
+typedef struct diagnostic {
+    const char *file;                /* File name (in the arena), NULL for a note */
+    int line;                        /* Line number, 0 if the error is for the whole file */
+    int column;                      /* Column (from 1), 0 if not known */
+    error_code_t code;               /* What kind of error it was */
+    const char *message;             /* A string literal, or a note's text in the arena */
+} diagnostic_t;
+
+/* Function declarations */
+void report_error(assembler_context_t *ctx, int line, int column, error_code_t code, const char *message);
+void report_line_failed(assembler_context_t *ctx, int line, error_code_t code, const char *message);
+void report_note(assembler_context_t *ctx, const char *format, const char *name);
+void flush_diagnostics(assembler_context_t *ctx);
+void free_diagnostics(assembler_context_t *ctx);
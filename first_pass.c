@@ -26,80 +26,156 @@
  */
 
 #include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
+#include "diagnostics.h"
 #include "first_pass.h"
+#include "memory.h"
+#include "one_pass.h"
+#include "source.h"
 #include "utils.h"
 
-/* Global symbol table - our "dictionary" of labels and their addresses */
-symbol_t *symbol_table = NULL;
+/*
+ * SYMBOL TABLE (ctx->symbol_names, symbol_hashes, symbol_offsets, symbol_flags)
+ * 
+ * Our "dictionary" of labels and their addresses. Every symbol has an id
+ * (0, 1, 2, ... in the order they were defined), and each of its fields is
+ * in its own array at that id, so a symbol costs 13 bytes and the loops
+ * that only need one field (like the hashes while probing) read memory
+ * that is packed together. The name is not copied into the symbol - it
+ * goes into the name pool with the other names, and the symbol keeps its
+ * offset there. The .ent file and print_symbol_table walk the ids from the
+ * newest one down (the order the old linked list had).
+ * 
+ * Looking a name up by walking all the symbols made the first pass
+ * quadratic, so there is also an open-addressing hash table of ids
+ * (ctx->symbol_index). Each slot is either 0 (empty) or id + 1 of the
+ * newest symbol with that name. Collisions are resolved with linear
+ * probing: try the next slot. The capacity is always a power of two so
+ * "hash % capacity" is a cheap mask.
+ */
+#define SYMBOL_INDEX_INITIAL_SIZE 64
+#define SYMBOL_INITIAL_CAPACITY 64
+#define SYMBOL_BYTES (2 * sizeof(int) + sizeof(unsigned int) + 1)  /* One symbol in all four arrays */
+
+static int *find_symbol_slot(assembler_context_t *ctx, const char *name, unsigned int hash);
+static int parse_index_registers(const char *index, parsed_operand_t *operand);
+static error_code_t grow_symbol_index(assembler_context_t *ctx);
+static error_code_t grow_symbol_arrays(assembler_context_t *ctx);
 
 /*
- * FIRST_PASS - Main function for the first pass
+ * PARSED PROGRAM (ctx->line_records, ctx->name_pool, ctx->data_values)
+ * 
+ * Every instruction and data directive we accept is stored as a
+ * line_record_t so the second pass can encode it without reading the
+ * file again. The arrays grow by doubling when they fill up.
  */
-error_code_t first_pass(const char *filename) {
-    FILE *file;
-    char line[MAX_LINE_LENGTH];
-    int line_number = 0;
-    error_code_t result = SUCCESS;
-    symbol_t *current;  /* ADD THIS LINE - missing variable declaration */
+static line_record_t *new_line_record(assembler_context_t *ctx, line_kind_t kind, int line_number, line_record_t *scratch);
+static int add_name(assembler_context_t *ctx, const char *name);
+static int add_name_slice(assembler_context_t *ctx, const char *name, int length);
+static error_code_t process_data_first_pass(assembler_context_t *ctx, directive_t directive, const char *text,
+                                            const char *label, int line_number, int column);
+static error_code_t reserve_data_values(assembler_context_t *ctx, int extra);
+
+/*
+ * FIRST_PASS - Run the first pass over an already expanded .am file
+ * 
+ * The normal pipeline does not use this any more - the macro expander feeds
+ * first_pass_line directly. This is kept for running the pass on a file that
+ * is already on disk: it just reads the lines and hands them to the same sink.
+ */
+error_code_t first_pass(assembler_context_t *ctx, const char *filename) {
+    source_file_t source;
+    const char *line;
+    int length;
     
-    /*
-     * FIRST PASS - Symbol Table Building
-     * 
-     * The first pass reads through the entire assembly file and:
-     * 1. Finds all labels and their memory addresses
-     * 2. Builds a symbol table for second pass to use
-     * 3. Calculates how much memory each instruction needs
-     * 
-     * This is the classic "two-pass assembler" design used in most
-     * real assemblers and compilers.
-     */
-    file = fopen(filename, "r");
-    if (!file) {
-        print_error(filename, 0, "Could not open file");
+    if (source_open(&source, filename) != SUCCESS) {
+        report_error(ctx, 0, 0, ERROR_FILE_NOT_FOUND, "Could not open file");
         return ERROR_FILE_NOT_FOUND;
     }
     
+    first_pass_begin(ctx);
+    
     /* Process each line of the assembly source file */
-    while (fgets(line, sizeof(line), file)) {
-        line_number++;
-        
-        /* Remove newline character from end of line */
-        line[strcspn(line, "\n")] = 0;
-        
-        result = process_line_first_pass(line, line_number);
-        if (result != SUCCESS) {
-            print_error(filename, line_number, "Error in first pass");
-            /* Continue processing to find all errors, don't stop at first error */
-        }
+    while (source_next_line(&source, &line, &length)) {
+        first_pass_line(ctx, line, length);
     }
     
-    fclose(file);
+    source_close(&source);
     
-    /*
-     * CRUCIAL STEP: Update data symbol addresses
-     * 
-     * During the pass, we assigned data symbols addresses starting from 0.
-     * But in the final memory layout, data comes AFTER all instructions.
-     * So we need to add the final IC value to all data symbol addresses.
-     * 
-     * Example:
-     * - Instructions occupy addresses 100-150 (IC goes from 100 to 151)
-     * - Data symbol was at address 5, now becomes 151 + 5 = 156
-     */
-    current = symbol_table;  /* NOW this variable is declared */
-    while (current) {
-        if (current->is_data) {
-            current->address += IC;  /* Move data after instructions */
+    return first_pass_end(ctx);
+}
+
+/*
+ * FIRST_PASS_BEGIN - Get ready to receive the lines of a new file
+ */
+void first_pass_begin(assembler_context_t *ctx) {
+    ctx->line_number = 0;
+}
+
+/*
+ * FIRST_PASS_LINE - Line sink: run the first pass on one expanded line
+ * 
+ * The macro expander calls this for every line it produces (including
+ * comments and empty lines, so line numbers match the .am file).
+ * The text may point into the expander's buffers (or the read-only input
+ * file), so I copy it into a local line first - the tokenizer writes null
+ * terminators into the line. Lines too long for the local buffer get a
+ * malloc'd one, so no line is ever cut short.
+ * 
+ * Errors in a line are reported and remembered in error_flag, but we keep
+ * going to find all errors. Returns SUCCESS unless memory runs out.
+ */
+error_code_t first_pass_line(assembler_context_t *ctx, const char *text, int length) {
+    char buffer[MAX_LINE_LENGTH];
+    char *line = buffer;
+    line_scan_t scan;
+    error_code_t result;
+    
+    ctx->line_number++;
+    if (ctx->memory.limit_reached) {
+        return SUCCESS;  /* The file is already over --mem-limit - every line would fail the same way */
+    }
+    scan_line(text, length, &scan);
+    if (scan.start == scan.end || scan.is_comment) {
+        return SUCCESS;  /* Nothing to do - don't even copy it */
+    }
+    
+    if (length > MAX_LINE_LENGTH - 1) {
+        line = memory_alloc(ctx, MEMORY_OTHER, length + 1);  /* Rare - only for very long lines */
+        if (!line) {
+            report_error(ctx, ctx->line_number, 0, ERROR_MEMORY_ALLOCATION, "Not enough memory for the line");
+            return ERROR_MEMORY_ALLOCATION;
         }
-        current = current->next;
     }
+    memcpy(line, text, length);
+    line[length] = '\0';
     
+    result = process_line_first_pass(ctx, line, &scan, ctx->line_number);
+    if (result != SUCCESS) {
+        /* Left out when the line already reported what was wrong with it */
+        report_line_failed(ctx, ctx->line_number, result, "Error in first pass");
+        ctx->error_flag = 1;  /* The line has no record, so the output would be wrong */
+        /* Continue processing to find all errors, don't stop at first error */
+    }
+    
+    if (line != buffer) {
+        memory_free(ctx, MEMORY_OTHER, line, length + 1);
+    }
+    return SUCCESS;
+}
+
+/*
+ * FIRST_PASS_END - Finish the first pass after the last line
+ * 
+ * Returns: SUCCESS if no line had an error, ERROR_INVALID_SYNTAX otherwise
+ */
+error_code_t first_pass_end(assembler_context_t *ctx) {
     /*
-     * Symbol table building completed.
-     * In a production assembler, symbol table printing would be removed or made optional.
+     * Data symbols don't have to be moved after the instructions here any
+     * more: they keep their offset in the data segment, and symbol_address()
+     * adds the final code size whenever an address is needed.
      */
-    
-    return error_flag ? ERROR_INVALID_SYNTAX : SUCCESS;
+    return ctx->error_flag ? ERROR_INVALID_SYNTAX : SUCCESS;
 }
 
 /*
@@ -115,43 +191,65 @@ error_code_t first_pass(const char *filename) {
  * "LOOP: mov r1, r2"  <- LOOP is a label, mov r1, r2 is an instruction
  * "DATA: .data 5, 10" <- DATA is a label, .data 5, 10 is a directive
  */
-error_code_t process_line_first_pass(char *line, int line_number) {
+error_code_t process_line_first_pass(assembler_context_t *ctx, char *line, const line_scan_t *scan, int line_number) {
     char *label;
+    char label_buffer[MAX_LABEL_LENGTH];
     char *line_ptr = NULL;
     char *trimmed;
-    int word_count;
-    char **words;
+    const char *rest;
+    token_list_t words;  /* Slices into line - nothing to free */
+    word_class_t word_class;
+    int index;           /* instruction_table row or directive_t */
     error_code_t result = SUCCESS;
 
-    if (is_empty_line(line) || is_comment_line(line)) {
+    /* scan (from scan_line) already knows the bounds, the comment and the colon */
+    if (scan->start == scan->end || scan->is_comment) {
         return SUCCESS;
     }
+    line[scan->end] = '\0';  /* Drop the trailing whitespace */
 
-    label = extract_label(line, &line_ptr);
+    label = extract_label(line, scan->colon, &line_ptr, label_buffer);
+
+    if (line_ptr == line) {
+        trimmed = line + scan->start;  /* No label - already trimmed at both ends */
+    } else {
+        trimmed = trim_whitespace(line_ptr);
+    }
+
+    /* Data lines can be very long - their values are read without tokenizing */
+    index = data_directive(trimmed, &rest);
+    if (index >= 0) {
+        return process_data_first_pass(ctx, (directive_t)index, rest, label, line_number, (int)(rest - line) + 1);
+    }
 
-    trimmed = trim_whitespace(line_ptr);
-    words = split_line(trimmed, &word_count);
+    ctx->stats.tokens += tokenize_line(trimmed, &words);
+    if (words.truncated) {
+        report_error(ctx, line_number, 0, ERROR_LINE_TOO_LONG, "Too many operands");
+        return ERROR_LINE_TOO_LONG;
+    }
 
-    if (word_count == 0) {
+    if (words.count == 0) {
         if (label) {
-            if (add_symbol(label, IC, 0, 0) != SUCCESS) {
+            result = add_symbol(ctx, label, SEGMENT_CODE, ctx->IC - INITIAL_IC, 0);
+            if (result != SUCCESS && result != ERROR_MEMORY_ALLOCATION) {
                 result = ERROR_DUPLICATE_LABEL;
             }
         }
-        free_split_line(words, word_count);
         return result;
     }
 
-    if (is_instruction(words[0])) {
-        result = process_instruction_first_pass(words, word_count, label);
-    } else if (is_directive(words[0])) {
-        result = process_directive_first_pass(words, word_count, label);
+    /* Classify the first word once and pass the result down */
+    word_class = classify_word(words.tokens[0].text, &index);
+    if (word_class == WORD_INSTRUCTION) {
+        result = process_instruction_first_pass(ctx, &words, &instruction_table[index], label, line_number);
+    } else if (word_class == WORD_DIRECTIVE) {
+        result = process_directive_first_pass(ctx, &words, (directive_t)index, label, line_number);
     } else {
-        print_error(current_filename, line_number, "Unknown instruction or directive");
+        report_error(ctx, line_number, (int)(words.tokens[0].text - line) + 1, ERROR_INVALID_INSTRUCTION,
+                     "Unknown instruction or directive");
         result = ERROR_INVALID_INSTRUCTION;
     }
 
-    free_split_line(words, word_count);
     return result;
 }
 
@@ -167,10 +265,19 @@ error_code_t process_line_first_pass(char *line, int line_number) {
  * We DON'T generate machine code yet - that's for the second pass!
  * We just need to know "this instruction will take X words of memory"
  * so we can assign correct addresses to future labels.
+ * 
+ * inst_info is the instruction_table row the caller already looked up.
  */
-error_code_t process_instruction_first_pass(char **parts, int part_count, const char *label) {
-    instruction_info_t *inst_info;   /* Information about this instruction */
-    int instruction_length;          /* How many memory words this instruction needs */
+error_code_t process_instruction_first_pass(assembler_context_t *ctx, const token_list_t *words, const instruction_info_t *inst_info,
+                                            const char *label, int line_number) {
+    const token_t *parts = words->tokens;  /* parts[0] is the instruction name */
+    int operand_count = words->count - 1;
+    const encoding_t *encoding;      /* First word, length and whether the operands are allowed */
+    parsed_operand_t operands[MAX_OPERANDS];
+    line_record_t *record;
+    line_record_t scratch;           /* The record with --one-pass (encoded at once) */
+    error_code_t result;
+    int i;
     
     /*
      * If there's a label, add it to symbol table
@@ -178,18 +285,27 @@ error_code_t process_instruction_first_pass(char **parts, int part_count, const
      * Example: "LOOP: mov r1, r2" - LOOP points to address where mov instruction is stored
      */
     if (label && strlen(label) > 0) {
-        if (add_symbol(label, IC, 0, 0) != SUCCESS) {  /* not external, not data */
+        result = add_symbol(ctx, label, SEGMENT_CODE, ctx->IC - INITIAL_IC, 0);  /* not external */
+        if (result == ERROR_MEMORY_ALLOCATION) {
+            return result;
+        }
+        if (result != SUCCESS) {
             return ERROR_DUPLICATE_LABEL;
         }
     }
     
-    /*
-     * Look up instruction in the instruction table.
-     * This validates that it's a real instruction and gets its properties.
-     */
-    inst_info = get_instruction_info(parts[0]);
-    if (!inst_info) {
-        return ERROR_INVALID_INSTRUCTION;
+    /* Decode every operand once - the checks and the encoder both use the result */
+    if (operand_count > MAX_OPERANDS) {
+        return ERROR_INVALID_OPERAND;  /* Too many operands */
+    }
+    for (i = 0; i < operand_count; i++) {
+        result = parse_operand(ctx, parts[i + 1].text, &operands[i]);
+        if (result == ERROR_INVALID_OPERAND) {
+            report_error(ctx, line_number, 0, ERROR_INVALID_OPERAND, "Invalid matrix index, expected [rX][rY] with registers r0-r7");
+        }
+        if (result != SUCCESS) {
+            return result;
+        }
     }
     
     /*
@@ -201,78 +317,395 @@ error_code_t process_instruction_first_pass(char **parts, int part_count, const
      * - Word 1: The mov instruction itself
      * - Word 2: The immediate value 5  
      * - Word 3: Register information
+     * 
+     * encoding_table has it precomputed for every opcode and operand types,
+     * together with whether they are allowed (that checks the count too).
+     * With one operand it is the destination, so the source is NO_OPERAND.
      */
-    instruction_length = get_instruction_length(parts[0], &parts[1], part_count - 1);
-    if (instruction_length < 0) {
-        return ERROR_INVALID_OPERAND;
+    encoding = &encoding_table[inst_info->opcode]
+                              [operand_count == 2 ? operands[0].type : NO_OPERAND]
+                              [operand_count > 0 ? operands[operand_count - 1].type : NO_OPERAND];
+    if (!encoding->legal) {
+        return ERROR_INVALID_OPERAND;  /* Wrong number or type of operands */
+    }
+    
+    /* Save the parsed instruction for the second pass */
+    record = new_line_record(ctx, LINE_INSTRUCTION, line_number, &scratch);
+    if (!record) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    record->encoding = encoding;
+    record->operand_count = operand_count;
+    for (i = 0; i < operand_count; i++) {
+        record->operands[i] = operands[i];
+    }
+    
+    /* --one-pass: encode it now, labels are patched at the end (one_pass.c) */
+    if (ctx->options->one_pass) {
+        return one_pass_encode(ctx, record, encoding->length);
     }
     
     /* Advance instruction counter by the instruction length */
-    IC += instruction_length;
+    ctx->IC += encoding->length;
     
     return SUCCESS;
 }
 
 /*
- * PROCESS_DIRECTIVE_FIRST_PASS - Handle a directive line during first pass
+ * PROCESS_DIRECTIVE_FIRST_PASS - Handle an .entry or .extern line during first pass
  * 
  * Directives are assembler commands that don't generate machine instructions.
- * Instead, they:
- * - Reserve memory for data (.data, .string)
+ * These two only name a symbol:
  * - Mark symbols as external (.extern) 
  * - Mark symbols as entry points (.entry)
  * 
- * For data directives, we need to calculate how much memory they'll need
- * and advance DC (Data Counter) accordingly.
+ * The data directives never get here (see process_data_first_pass).
  */
-error_code_t process_directive_first_pass(char **parts, int part_count, const char *label) {
-    error_code_t result = SUCCESS;
-    int i;
+error_code_t process_directive_first_pass(assembler_context_t *ctx, const token_list_t *words, directive_t directive,
+                                          const char *label, int line_number) {
+    const token_t *parts = words->tokens;  /* parts[0] is the directive name */
+    int part_count = words->count;
+    line_record_t *record;
+    error_code_t result;
 
-    if (part_count == 0) {
-        return ERROR_INVALID_SYNTAX;
+    (void)label;  /* A label on .entry/.extern means nothing */
+    switch (directive) {
+        case DIR_ENTRY:
+            /* The symbol may be defined later, so the second pass marks it */
+            if (part_count > 1) {
+                record = new_line_record(ctx, LINE_ENTRY, line_number, NULL);
+                if (!record) {
+                    return ERROR_MEMORY_ALLOCATION;
+                }
+                record->symbol = add_name(ctx, parts[1].text);
+                if (record->symbol < 0) {
+                    return ERROR_MEMORY_ALLOCATION;
+                }
+            }
+            return SUCCESS;
+            
+        case DIR_EXTERN:
+            /*
+             * EXTERNAL SYMBOLS
+             * These are labels defined in other assembly files.
+             * We add them to our symbol table so second pass can reference them.
+             */
+            if (part_count > 1) {
+                result = add_symbol(ctx, parts[1].text, SEGMENT_CODE, 0, 1);  /* IS external */
+                if (result == ERROR_DUPLICATE_LABEL) {
+                    report_error(ctx, line_number, 0, ERROR_DUPLICATE_LABEL, "Label of this file declared .extern");
+                    return result;
+                }
+                if (result == ERROR_MEMORY_ALLOCATION) {
+                    return result;
+                }
+            }
+            return SUCCESS;
+            
+        default:
+            return ERROR_INVALID_DIRECTIVE;
     }
+}
+
+/*
+ * PROCESS_DATA_FIRST_PASS - Handle a .data, .string or .mat line
+ * 
+ * text is everything after the directive name, and column is where it
+ * starts in the line. The label points to the current DC, and the values
+ * are scanned (utils.c) straight into the end of data_values, so the
+ * second pass only has to copy them:
+ * - .data 5, -3, 7         -> every word is one value
+ * - .string "hello"        -> one value per character, then a 0
+ * - .mat [2][2] 1,2,3,4    -> rows x columns values, row-major
+ * 
+ * Room for every value the text could hold is reserved before the scan,
+ * so it is one realloc at most, not one check per value. A .mat with
+ * fewer values than its size gets zeros for the rest (none at all just
+ * reserves it), and one with more is an error.
+ */
+static error_code_t process_data_first_pass(assembler_context_t *ctx, directive_t directive, const char *text,
+                                            const char *label, int line_number, int column) {
+    line_record_t *record;
+    line_record_t scratch;  /* The data record with --one-pass (data_values is the image) */
+    const char *values = text;
+    int *start;
+    int rows = 0;
+    int columns = 0;
+    int room = (int)strlen(text) + 1;  /* Enough for any .data or .string */
+    int count;
+    error_code_t result;
 
-    if (strcmp(parts[0], ".data") == 0) {
-        if (label && strlen(label) > 0) {
-            add_symbol(label, DC, 0, 1); /* not external, IS data */
+    if (label && strlen(label) > 0) {
+        result = add_symbol(ctx, label, SEGMENT_DATA, ctx->DC - INITIAL_DC, 0);  /* not external */
+        if (result == ERROR_MEMORY_ALLOCATION) {
+            return result;
         }
-        for (i = 1; i < part_count; i++) {
-            DC++;
+        if (result != SUCCESS) {
+            return ERROR_DUPLICATE_LABEL;
         }
-    } else if (strcmp(parts[0], ".string") == 0) {
-        if (label && strlen(label) > 0) {
-            add_symbol(label, DC, 0, 1); /* not external, IS data */
+    }
+
+    if (directive == DIR_MAT) {
+        values = scan_matrix_size(text, &rows, &columns);
+        if (!values) {
+            report_error(ctx, line_number, column, ERROR_INVALID_DIRECTIVE, "Invalid matrix size, expected [rows][columns]");
+            return ERROR_INVALID_DIRECTIVE;
         }
-        if (part_count > 1) {
-            DC += strlen(parts[1]) - 1;
+        if (rows * columns > room) {
+            room = rows * columns;
         }
-    } else if (strcmp(parts[0], ".entry") == 0) {
-        /* Entry processing happens in second pass */
-    } else if (strcmp(parts[0], ".extern") == 0) {
-        /*
-         * EXTERNAL SYMBOLS
-         * These are labels defined in other assembly files.
-         * We add them to our symbol table so second pass can reference them.
-         */
-        if (part_count > 1) {
-            add_symbol(parts[1], 0, 1, 0); /* IS external, not data */
+    }
+    if (reserve_data_values(ctx, room) != SUCCESS) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    start = ctx->data_values + ctx->data_value_count;
+    if (directive == DIR_STRING) {
+        count = scan_string_values(values, start);
+        ctx->stats.tokens += count > 0 ? 2 : 1;
+    } else {
+        count = scan_data_values(values, start);
+        ctx->stats.tokens += 1 + (directive == DIR_MAT) + count;
+    }
+    if (directive == DIR_MAT) {
+        if (count > rows * columns) {
+            report_error(ctx, line_number, column, ERROR_INVALID_DIRECTIVE, "More values than the matrix size");
+            return ERROR_INVALID_DIRECTIVE;
         }
-    } else if (strcmp(parts[0], ".mat") == 0) {
-        /* .mat directive: declare a matrix */
-        if (label && strlen(label) > 0) {
-            add_symbol(label, DC, 0, 1); /* not external, IS data */
+        memset(start + count, 0, (rows * columns - count) * sizeof(int));
+        count = rows * columns;
+    }
+
+    record = new_line_record(ctx, LINE_DATA, line_number, &scratch);
+    if (!record) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    record->data_start = ctx->data_value_count;
+    record->data_count = count;
+
+    /* Advance DC by exactly the number of words the record holds */
+    ctx->data_value_count += count;
+    ctx->DC += count;
+    return SUCCESS;
+}
+
+/*
+ * PARSE_OPERAND - Decode one operand and save what the encoder needs
+ * 
+ * Examples:
+ * - "#-5"        -> IMMEDIATE, value -5
+ * - "r3"         -> REGISTER, value 3
+ * - "LOOP"       -> DIRECT, symbol "LOOP"
+ * - "M1[r2][r7]" -> INDIRECT, symbol "M1", index registers 2 and 7
+ * 
+ * This is the only place an operand's text is looked at: one walk finds its
+ * end, the first '[' and whether there is a ']' at all, which is everything
+ * get_operand_type and parse_matrix_operand used to find out in their own
+ * scans. The rules are the same as theirs, except that a matrix index has
+ * to be two registers.
+ * 
+ * Symbol names go into name_pool because their addresses are not known yet
+ * (a label used before it is defined has no symbol id in the first pass).
+ * Returns: SUCCESS, ERROR_INVALID_OPERAND for a bad matrix index, or
+ *          ERROR_MEMORY_ALLOCATION
+ */
+error_code_t parse_operand(assembler_context_t *ctx, const char *text, parsed_operand_t *operand) {
+    const char *end;
+    const char *bracket = NULL;      /* First '[' */
+    int closed = 0;                  /* Saw a ']' */
+    int base_length;
+    
+    operand->value = 0;
+    operand->symbol = -1;
+    operand->label = -1;
+    operand->has_index = 0;
+    operand->row_register = 0;
+    operand->column_register = 0;
+    
+    if (text[0] == '#') {
+        operand->type = IMMEDIATE;
+        operand->value = string_to_int(text + 1);  /* Skip the '#' */
+        return SUCCESS;
+    }
+    if (text[0] == 'r' && isdigit((unsigned char)text[1]) && text[2] == '\0') {
+        operand->type = REGISTER;
+        operand->value = text[1] <= '7' ? text[1] - '0' : -1;  /* r0 - r7 */
+        return SUCCESS;
+    }
+    
+    for (end = text; *end; end++) {
+        if (*end == '[' && !bracket) {
+            bracket = end;
+        } else if (*end == ']') {
+            closed = 1;
         }
-        /* For .mat [rows][cols] values... we need to count the values */
-        /* Skip the dimension specifiers and count actual values */
-        if (part_count > 3) {  /* .mat [2][2] 1,2,3,4 -> skip .mat [2] [2] */
-            DC += part_count - 3;  /* Count data values after dimensions */
+    }
+    
+    /* "*r1" and "M1[r2][r7]" are INDIRECT, everything else is a label */
+    operand->has_index = bracket && closed;
+    operand->type = (text[0] == '*' || operand->has_index) ? INDIRECT : DIRECT;
+    if (operand->has_index && !parse_index_registers(bracket, operand)) {
+        return ERROR_INVALID_OPERAND;
+    }
+    
+    operand->label = add_name_slice(ctx, text, (int)(end - text));
+    if (operand->label < 0) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    
+    /* The symbol is the part before the first '[' - if it fits in a label */
+    base_length = bracket ? (int)(bracket - text) : (int)(end - text);
+    if (base_length < MAX_LABEL_LENGTH) {
+        /* Only store the base name separately when it differs */
+        operand->symbol = bracket ? add_name_slice(ctx, text, base_length) : operand->label;
+        if (operand->symbol < 0) {
+            return ERROR_MEMORY_ALLOCATION;
         }
+    }
+    return SUCCESS;
+}
+
+/*
+ * PARSE_INDEX_REGISTERS - Read the "[rX][rY]" of a matrix operand
+ * 
+ * index points at the first '['. Both registers have to be r0 - r7, and
+ * nothing may follow the second ']'.
+ * Returns: 1 if it is a valid index (the registers are in operand), 0 if not
+ */
+static int parse_index_registers(const char *index, parsed_operand_t *operand) {
+    if (index[0] != '[' || index[1] != 'r' || index[2] < '0' || index[2] > '7' || index[3] != ']' ||
+        index[4] != '[' || index[5] != 'r' || index[6] < '0' || index[6] > '7' || index[7] != ']' ||
+        index[8] != '\0') {
+        return 0;
+    }
+    operand->row_register = index[2] - '0';
+    operand->column_register = index[6] - '0';
+    return 1;
+}
+
+/*
+ * NEW_LINE_RECORD - Append an empty record to line_records
+ * 
+ * Returns a pointer to the new record, or NULL if we ran out of memory.
+ * The pointer is only valid until the next record is added (realloc!).
+ * With --one-pass, instruction and data lines are handled on the spot, so
+ * their record goes into the caller's scratch record and is not kept
+ * (callers that always need a kept record pass NULL).
+ */
+static line_record_t *new_line_record(assembler_context_t *ctx, line_kind_t kind, int line_number, line_record_t *scratch) {
+    line_record_t *record;
+    line_record_t *temp;
+    int new_capacity;
+    
+    if (scratch && ctx->options->one_pass) {
+        record = scratch;  /* Used right away (one_pass.c), nothing to keep */
     } else {
-        result = ERROR_INVALID_DIRECTIVE;
+        if (ctx->line_record_count >= ctx->line_record_capacity) {
+            new_capacity = ctx->line_record_capacity ? ctx->line_record_capacity * 2 : 64;
+            temp = memory_realloc(ctx, MEMORY_RECORDS, ctx->line_records, ctx->line_record_capacity * sizeof(line_record_t),
+                                  new_capacity * sizeof(line_record_t));
+            if (!temp) {
+                return NULL;
+            }
+            ctx->line_records = temp;
+            ctx->line_record_capacity = new_capacity;
+        }
+        record = &ctx->line_records[ctx->line_record_count++];
     }
+    
+    memset(record, 0, sizeof(line_record_t));
+    record->kind = kind;
+    record->line_number = line_number;
+    record->address = kind == LINE_DATA ? ctx->DC : ctx->IC;  /* Counters are not advanced yet */
+    record->symbol = -1;
+    return record;
+}
 
-    return result;
+/*
+ * ADD_NAME - Copy a symbol name into name_pool
+ * 
+ * Returns the offset of the copy, or -1 if we ran out of memory.
+ * We hand out offsets instead of pointers because realloc may move the pool.
+ */
+static int add_name(assembler_context_t *ctx, const char *name) {
+    return add_name_slice(ctx, name, (int)strlen(name));
+}
+
+/*
+ * ADD_NAME_SLICE - add_name for the first length characters of name
+ * 
+ * The copy gets its own '\0', so operands can store just a part of their
+ * text (like "M1" out of "M1[r2][r7]") without a temporary buffer.
+ */
+static int add_name_slice(assembler_context_t *ctx, const char *name, int length) {
+    int len = length + 1;  /* Include the NUL terminator */
+    int offset;
+    int new_capacity;
+    char *temp;
+    
+    if (ctx->name_pool_size + len > ctx->name_pool_capacity) {
+        new_capacity = ctx->name_pool_capacity ? ctx->name_pool_capacity * 2 : 1024;
+        while (new_capacity < ctx->name_pool_size + len) {
+            new_capacity *= 2;
+        }
+        temp = memory_realloc(ctx, MEMORY_RECORDS, ctx->name_pool, ctx->name_pool_capacity, new_capacity);
+        if (!temp) {
+            return -1;
+        }
+        ctx->name_pool = temp;
+        ctx->name_pool_capacity = new_capacity;
+    }
+    
+    offset = ctx->name_pool_size;
+    memcpy(ctx->name_pool + offset, name, length);
+    ctx->name_pool[offset + length] = '\0';
+    ctx->name_pool_size += len;
+    return offset;
+}
+
+/*
+ * RESERVE_DATA_VALUES - Make room for extra more values in data_values
+ * 
+ * The values are written by the caller, which then advances data_value_count.
+ */
+static error_code_t reserve_data_values(assembler_context_t *ctx, int extra) {
+    int *temp;
+    int new_capacity;
+    
+    if (ctx->data_value_count + extra > ctx->data_value_capacity) {
+        new_capacity = ctx->data_value_capacity ? ctx->data_value_capacity * 2 : 256;
+        while (new_capacity < ctx->data_value_count + extra) {
+            new_capacity *= 2;
+        }
+        temp = memory_realloc(ctx, MEMORY_RECORDS, ctx->data_values, ctx->data_value_capacity * sizeof(int),
+                              new_capacity * sizeof(int));
+        if (!temp) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+        ctx->data_values = temp;
+        ctx->data_value_capacity = new_capacity;
+    }
+    return SUCCESS;
+}
+
+/*
+ * FREE_LINE_RECORDS - Clean up the parsed program
+ */
+void free_line_records(assembler_context_t *ctx) {
+    memory_free(ctx, MEMORY_RECORDS, ctx->line_records, ctx->line_record_capacity * sizeof(line_record_t));
+    ctx->line_records = NULL;
+    ctx->line_record_count = 0;
+    ctx->line_record_capacity = 0;
+    
+    memory_free(ctx, MEMORY_RECORDS, ctx->name_pool, ctx->name_pool_capacity);
+    ctx->name_pool = NULL;
+    ctx->name_pool_size = 0;
+    ctx->name_pool_capacity = 0;
+    
+    memory_free(ctx, MEMORY_RECORDS, ctx->data_values, ctx->data_value_capacity * sizeof(int));
+    ctx->data_values = NULL;
+    ctx->data_value_count = 0;
+    ctx->data_value_capacity = 0;
 }
 
 /*
@@ -280,40 +713,66 @@ error_code_t process_directive_first_pass(char **parts, int part_count, const ch
  * 
  * The symbol table is our "phone book" of labels and addresses.
  * Each symbol has:
- * - name: The label name (like "LOOP", "DATA")
- * - address: Where in memory this symbol points
- * - is_external: Is this symbol defined in another file?
- * - is_entry: Should this symbol be visible to other files?
- * - is_data: Does this symbol point to data (vs. instruction)?
+ * - name: The label name (like "LOOP", "DATA"), kept in the name pool
+ * - segment: Does this symbol point to code or to data? (SYMBOL_DATA)
+ * - offset: Where in that segment it points (symbol_address gives the address)
+ * - SYMBOL_EXTERNAL: Is this symbol defined in another file?
+ * - SYMBOL_ENTRY: Should this symbol be visible to other files?
  * 
- * We use a linked list to store symbols - each new symbol goes at the front.
+ * The new symbol gets the next id, and the hash index is updated to point
+ * at it so find_symbol() always returns the newest one.
  */
-error_code_t add_symbol(const char *name, int address, int is_external, int is_data) {
-    symbol_t *existing;
-    symbol_t *new_symbol;  /* C90: Declare all variables at beginning */
+error_code_t add_symbol(assembler_context_t *ctx, const char *name, symbol_segment_t segment, int offset, int is_external) {
+    int *slot;
+    int name_offset;  /* C90: Declare all variables at beginning */
+    int symbol;
+    unsigned int hash;
+    
+    if (strlen(name) >= MAX_LABEL_LENGTH) {
+        return ERROR_INVALID_SYNTAX;  /* Labels are never this long */
+    }
+    
+    /* Make sure there is room for one more entry before probing */
+    if ((ctx->symbol_index_count + 1) * 4 > ctx->symbol_index_capacity * 3) {
+        if (grow_symbol_index(ctx) != SUCCESS) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+    }
     
-    /* Check for duplicate symbols (except externals can be redeclared) */
-    existing = find_symbol(name);
-    if (existing && !is_external) {
+    /*
+     * Check for duplicate symbols. An extern can be declared again, but a
+     * name can't be both a label of this file and an extern, in either
+     * order - otherwise the uses before the .extern would be local in the
+     * one pass mode and external in the second pass.
+     */
+    hash = (unsigned int)hash_string(name);
+    slot = find_symbol_slot(ctx, name, hash);
+    if (*slot && (!is_external || !(ctx->symbol_flags[*slot - 1] & SYMBOL_EXTERNAL))) {
         return ERROR_DUPLICATE_LABEL;
     }
     
-    /* Allocate memory for new symbol */
-    new_symbol = malloc(sizeof(symbol_t));
-    if (!new_symbol) {
+    if (ctx->symbol_count == ctx->symbol_capacity && grow_symbol_arrays(ctx) != SUCCESS) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    /* A redeclared extern already has its name in the pool */
+    name_offset = *slot ? ctx->symbol_names[*slot - 1] : add_name(ctx, name);
+    if (name_offset < 0) {
         return ERROR_MEMORY_ALLOCATION;
     }
     
-    /* Fill in symbol information */
-    strcpy(new_symbol->name, name);
-    new_symbol->address = address;
-    new_symbol->is_external = is_external;
-    new_symbol->is_entry = 0;      /* Entry status set in second pass */
-    new_symbol->is_data = is_data;
+    /* Fill in symbol information - entry status is set in the second pass */
+    symbol = ctx->symbol_count++;
+    ctx->symbol_names[symbol] = name_offset;
+    ctx->symbol_hashes[symbol] = hash;
+    ctx->symbol_offsets[symbol] = offset;
+    ctx->symbol_flags[symbol] = (unsigned char)((segment == SEGMENT_DATA ? SYMBOL_DATA : 0) |
+                                                (is_external ? SYMBOL_EXTERNAL : 0));
     
-    /* Add to front of linked list */
-    new_symbol->next = symbol_table;
-    symbol_table = new_symbol;
+    /* Point the index at the new symbol (a redeclared extern replaces the old one) */
+    if (!*slot) {
+        ctx->symbol_index_count++;
+    }
+    *slot = symbol + 1;
     
     return SUCCESS;
 }
@@ -321,34 +780,158 @@ error_code_t add_symbol(const char *name, int address, int is_external, int is_d
 /*
  * FIND_SYMBOL - Look up a symbol in the symbol table
  * 
- * Simple linear search through our linked list of symbols.
- * Returns pointer to symbol if found, NULL if not found.
+ * Goes through the hash index, so this costs about one comparison no
+ * matter how many symbols there are.
+ * Returns the symbol's id if found, NO_SYMBOL if not found.
  */
-symbol_t *find_symbol(const char *name) {
-    symbol_t *current = symbol_table;
-    while (current) {
-        if (strcmp(current->name, name) == 0) {
-            return current;  /* Found it! */
+int find_symbol(assembler_context_t *ctx, const char *name) {
+    if (ctx->symbol_index_count == 0) {
+        return NO_SYMBOL;  /* Empty table - nothing to find */
+    }
+    return *find_symbol_slot(ctx, name, (unsigned int)hash_string(name)) - 1;
+}
+
+/*
+ * SYMBOL_NAME - The name of symbol id symbol (it lives in the name pool)
+ */
+const char *symbol_name(const assembler_context_t *ctx, int symbol) {
+    return ctx->name_pool + ctx->symbol_names[symbol];
+}
+
+/*
+ * FIND_SYMBOL_SLOT - Find the index slot for a name
+ * 
+ * Starts at hash % capacity and walks forward until it finds either the
+ * symbol with this name or an empty slot (meaning the name is not there).
+ * The full strcmp only runs when the stored hash matches, and the hashes
+ * are in their own array, so a probe that doesn't match never touches the
+ * names at all.
+ * 
+ * The index must have at least one empty slot (add_symbol makes sure of it).
+ */
+static int *find_symbol_slot(assembler_context_t *ctx, const char *name, unsigned int hash) {
+    unsigned int mask = (unsigned int)ctx->symbol_index_capacity - 1;
+    unsigned int i = hash & mask;
+    int symbol;
+    
+    ctx->stats.symbol_lookups++;
+    ctx->stats.symbol_probes++;  /* The first slot */
+    while (ctx->symbol_index[i]) {
+        symbol = ctx->symbol_index[i] - 1;
+        if (ctx->symbol_hashes[symbol] == hash && strcmp(ctx->name_pool + ctx->symbol_names[symbol], name) == 0) {
+            return &ctx->symbol_index[i];  /* Found it! */
         }
-        current = current->next;
+        i = (i + 1) & mask;  /* Linear probing - try the next slot */
+        ctx->stats.symbol_probes++;
     }
-    return NULL;  /* Not found */
+    return &ctx->symbol_index[i];  /* Empty slot where the name would go */
 }
 
 /*
- * FREE_SYMBOL_TABLE - Clean up symbol table memory
+ * GROW_SYMBOL_INDEX - Double the size of the hash index
+ * 
+ * Called when the index gets 3/4 full, since probing gets slow after that.
+ * Every symbol id is re-inserted into a new array using its saved hash,
+ * so we never have to hash the names again.
  */
-void free_symbol_table(void) {
-    symbol_t *current;
-    symbol_t *next;  /* C90: Declare all variables at beginning */
+static error_code_t grow_symbol_index(assembler_context_t *ctx) {
+    int *old_index = ctx->symbol_index;
+    int old_capacity = ctx->symbol_index_capacity;
+    int new_capacity;
+    unsigned int mask;
+    unsigned int j;
+    int i;
+    
+    new_capacity = old_capacity ? old_capacity * 2 : SYMBOL_INDEX_INITIAL_SIZE;
+    ctx->symbol_index = memory_alloc(ctx, MEMORY_SYMBOLS, new_capacity * sizeof(int));
+    if (!ctx->symbol_index) {
+        ctx->symbol_index = old_index;  /* Keep the old index working */
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    memset(ctx->symbol_index, 0, new_capacity * sizeof(int));  /* All slots start empty */
+    ctx->symbol_index_capacity = new_capacity;
+    mask = (unsigned int)new_capacity - 1;
     
-    current = symbol_table;
-    while (current) {
-        next = current->next;
-        free(current);
-        current = next;
+    /* Move every used slot over to its new position */
+    for (i = 0; i < old_capacity; i++) {
+        if (old_index[i]) {
+            j = ctx->symbol_hashes[old_index[i] - 1] & mask;
+            while (ctx->symbol_index[j]) {
+                j = (j + 1) & mask;
+            }
+            ctx->symbol_index[j] = old_index[i];
+        }
     }
-    symbol_table = NULL;
+    
+    memory_free(ctx, MEMORY_SYMBOLS, old_index, old_capacity * sizeof(int));
+    return SUCCESS;
+}
+
+/*
+ * GROW_SYMBOL_ARRAYS - Double the room in every symbol array
+ * 
+ * The arrays that did get bigger keep their new memory even if another one
+ * fails, so nothing is lost - the capacity just stays the old one.
+ */
+static error_code_t grow_symbol_arrays(assembler_context_t *ctx) {
+    int old_capacity = ctx->symbol_capacity;
+    int new_capacity = old_capacity ? old_capacity * 2 : SYMBOL_INITIAL_CAPACITY;
+    int *names;
+    unsigned int *hashes;
+    int *offsets;
+    unsigned char *flags;
+    
+    /* All four or none - a symbol needs a slot in every array */
+    if (!memory_allowed(ctx, MEMORY_SYMBOLS, old_capacity * SYMBOL_BYTES, new_capacity * SYMBOL_BYTES)) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    names = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->symbol_names, old_capacity * sizeof(int), new_capacity * sizeof(int));
+    if (names) {
+        ctx->symbol_names = names;
+    }
+    hashes = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->symbol_hashes, old_capacity * sizeof(unsigned int),
+                            new_capacity * sizeof(unsigned int));
+    if (hashes) {
+        ctx->symbol_hashes = hashes;
+    }
+    offsets = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->symbol_offsets, old_capacity * sizeof(int), new_capacity * sizeof(int));
+    if (offsets) {
+        ctx->symbol_offsets = offsets;
+    }
+    flags = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->symbol_flags, old_capacity, new_capacity);
+    if (flags) {
+        ctx->symbol_flags = flags;
+    }
+    if (!names || !hashes || !offsets || !flags) {
+        return ERROR_MEMORY_ALLOCATION;  /* Out of memory (the memory stats may be a bit off now) */
+    }
+    
+    ctx->symbol_capacity = new_capacity;
+    return SUCCESS;
+}
+
+/*
+ * FREE_SYMBOL_TABLE - Clean up symbol table memory
+ * 
+ * The names are in the name pool (freed with the line records), the rest
+ * is the symbol arrays and the hash index.
+ */
+void free_symbol_table(assembler_context_t *ctx) {
+    memory_free(ctx, MEMORY_SYMBOLS, ctx->symbol_names, ctx->symbol_capacity * sizeof(int));
+    memory_free(ctx, MEMORY_SYMBOLS, ctx->symbol_hashes, ctx->symbol_capacity * sizeof(unsigned int));
+    memory_free(ctx, MEMORY_SYMBOLS, ctx->symbol_offsets, ctx->symbol_capacity * sizeof(int));
+    memory_free(ctx, MEMORY_SYMBOLS, ctx->symbol_flags, ctx->symbol_capacity);
+    ctx->symbol_names = NULL;
+    ctx->symbol_hashes = NULL;
+    ctx->symbol_offsets = NULL;
+    ctx->symbol_flags = NULL;
+    ctx->symbol_count = 0;
+    ctx->symbol_capacity = 0;
+    
+    memory_free(ctx, MEMORY_SYMBOLS, ctx->symbol_index, ctx->symbol_index_capacity * sizeof(int));
+    ctx->symbol_index = NULL;
+    ctx->symbol_index_capacity = 0;
+    ctx->symbol_index_count = 0;
 }
 
 /*
@@ -387,10 +970,10 @@ int is_valid_label(const char *label) {
 /*
  * IS_INSTRUCTION - Check if a word is a valid instruction name
  * 
- * Simply checks if we can find the word in our instruction table.
+ * Simply asks classify_word() whether it is in our instruction table.
  */
 int is_instruction(const char *word) {
-    return get_instruction_info(word) != NULL;
+    return classify_word(word, NULL) == WORD_INSTRUCTION;
 }
 
 /*
@@ -399,11 +982,24 @@ int is_instruction(const char *word) {
  * Directives are the assembler commands that start with dot (.)
  */
 int is_directive(const char *word) {
-    return (strcmp(word, ".data") == 0 ||
-            strcmp(word, ".string") == 0 ||
-            strcmp(word, ".entry") == 0 ||
-            strcmp(word, ".extern") == 0 ||
-            strcmp(word, ".mat") == 0);
+    return classify_word(word, NULL) == WORD_DIRECTIVE;
+}
+
+/*
+ * SYMBOL_ADDRESS - The final address of a symbol
+ * 
+ * Code starts at INITIAL_IC and the data comes right after the last
+ * instruction:
+ * - Instructions occupy addresses 100-150 (code.count is 51)
+ * - Data symbol at offset 5 has address 100 + 51 + 5 = 156
+ * For data symbols this needs the final code.count, which second_pass (or
+ * one_pass_end) sets before the first operand is encoded.
+ */
+int symbol_address(const assembler_context_t *ctx, int symbol) {
+    if (ctx->symbol_flags[symbol] & SYMBOL_DATA) {
+        return INITIAL_IC + ctx->code.count + ctx->symbol_offsets[symbol];
+    }
+    return INITIAL_IC + ctx->symbol_offsets[symbol];
 }
 
 /*
@@ -413,19 +1009,18 @@ int is_directive(const char *word) {
  * Not used in normal assembly process, but helpful for understanding
  * what the assembler is doing.
  */
-void print_symbol_table(void) {
-    symbol_t *current = symbol_table;
-    printf("\nSymbol Table:\n");
-    printf("Name\t\tAddress\tExternal\tEntry\tData\n");
-    printf("----\t\t-------\t--------\t-----\t----\n");
-    while (current) {
-        printf("%-15s\t%d\t%s\t\t%s\t%s\n",
-               current->name,
-               current->address,
-               current->is_external ? "Yes" : "No",
-               current->is_entry ? "Yes" : "No",
-               current->is_data ? "Yes" : "No");
-        current = current->next;
-    }
-    printf("\n");
+void print_symbol_table(assembler_context_t *ctx) {
+    int current;
+    fprintf(ctx->out, "\nSymbol Table:\n");
+    fprintf(ctx->out, "Name\t\tAddress\tExternal\tEntry\tData\n");
+    fprintf(ctx->out, "----\t\t-------\t--------\t-----\t----\n");
+    for (current = ctx->symbol_count - 1; current >= 0; current--) {
+        fprintf(ctx->out, "%-15s\t%d\t%s\t\t%s\t%s\n",
+               symbol_name(ctx, current),
+               symbol_address(ctx, current),
+               (ctx->symbol_flags[current] & SYMBOL_EXTERNAL) ? "Yes" : "No",
+               (ctx->symbol_flags[current] & SYMBOL_ENTRY) ? "Yes" : "No",
+               (ctx->symbol_flags[current] & SYMBOL_DATA) ? "Yes" : "No");
+    }
+    fprintf(ctx->out, "\n");
 }
\ No newline at end of file
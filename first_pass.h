@@ -1,15 +1,25 @@
 /* First pass functions and symbol table */
 /* Demonstrates that not all headers need forward declarations */
 
-/* Symbol table entry */
-typedef struct symbol {
-    char name[MAX_LABEL_LENGTH];
-    int address;
-    int is_external;
-    int is_entry;
-    int is_data;
-    struct symbol *next;
-} symbol_t;
+/*
+ * Which image a symbol points into. The data image is placed after the code,
+ * but where exactly is only known once all the code has been seen, so a
+ * symbol keeps its offset inside its segment and symbol_address() adds the
+ * segment start when the address is actually needed.
+ */
+typedef enum {
+    SEGMENT_CODE,          /* Instruction label (and externals, offset 0) */
+    SEGMENT_DATA           /* .data/.string/.mat label */
+} symbol_segment_t;
+
+/*
+ * Symbols are ids into the symbol arrays of the context (see first_pass.c).
+ * What used to be separate ints is one flags byte per symbol.
+ */
+#define NO_SYMBOL (-1)             /* find_symbol did not find the name */
+#define SYMBOL_DATA 0x01           /* Points into the data segment (SEGMENT_DATA) */
+#define SYMBOL_EXTERNAL 0x02       /* Declared with .extern */
+#define SYMBOL_ENTRY 0x04          /* Named by .entry */
 
 /* Macro table entry */
 typedef struct macro {
@@ -19,18 +29,66 @@ typedef struct macro {
     struct macro *next;
 } macro_t;
 
+/*
+ * PARSED LINE RECORDS
+ * 
+ * The first pass already has to tokenize and validate every line, so it
+ * keeps what it learned in a compact array of records. The second pass
+ * only walks this array - it never reads or splits the source text again.
+ * 
+ * Symbol names are not resolved yet (forward references!), so operands
+ * refer to them by offset into name_pool. Data directive values are
+ * stored one after another in data_values.
+ */
+
+/* A single instruction operand, classified once in the first pass */
+typedef struct {
+    operand_type_t type;   /* IMMEDIATE, DIRECT, INDIRECT or REGISTER */
+    int value;             /* Immediate value or register number */
+    int symbol;            /* name_pool offset of the symbol name, -1 if none */
+    int label;             /* name_pool offset of the operand text (used in .ext) */
+    int has_index;         /* Matrix operand ("M1[r2][r7]") - needs an index word */
+    int row_register;      /* The matrix index registers (2 and 7 above) */
+    int column_register;
+} parsed_operand_t;
+
+/* What a record asks the second pass to do */
+typedef enum {
+    LINE_INSTRUCTION,      /* Encode an instruction into instruction memory */
+    LINE_DATA,             /* Copy values (.data/.string/.mat) into data memory */
+    LINE_ENTRY             /* Mark a symbol as entry (.entry) */
+} line_kind_t;
+
+typedef struct line_record {
+    line_kind_t kind;
+    int line_number;                         /* Source line, for error messages */
+    int address;                             /* IC (instruction) or DC (data) of its first word */
+    const encoding_t *encoding;              /* encoding_table entry: first word, length */
+    int operand_count;
+    parsed_operand_t operands[MAX_OPERANDS];
+    int data_start;                          /* First value in data_values */
+    int data_count;                          /* Number of values */
+    int symbol;                              /* name_pool offset for .entry */
+} line_record_t;
+
 /* Function prototypes */
-error_code_t first_pass(const char *filename);
-error_code_t process_line_first_pass(char *line, int line_number);
-error_code_t add_symbol(const char *name, int address, int is_external, int is_data);
-symbol_t *find_symbol(const char *name);
-void free_symbol_table(void);
+error_code_t first_pass(assembler_context_t *ctx, const char *filename);
+void first_pass_begin(assembler_context_t *ctx);
+error_code_t first_pass_line(assembler_context_t *ctx, const char *text, int length);
+error_code_t first_pass_end(assembler_context_t *ctx);
+error_code_t process_line_first_pass(assembler_context_t *ctx, char *line, const line_scan_t *scan, int line_number);
+error_code_t add_symbol(assembler_context_t *ctx, const char *name, symbol_segment_t segment, int offset, int is_external);
+int symbol_address(const assembler_context_t *ctx, int symbol);
+int find_symbol(assembler_context_t *ctx, const char *name);
+const char *symbol_name(const assembler_context_t *ctx, int symbol);
+void free_symbol_table(assembler_context_t *ctx);
 int is_valid_label(const char *label);
 int is_instruction(const char *word);
 int is_directive(const char *word);
-error_code_t process_instruction_first_pass(char **parts, int part_count, const char *label);
-error_code_t process_directive_first_pass(char **parts, int part_count, const char *label);
-void print_symbol_table(void);
-
-/* Global symbol table */
-extern symbol_t *symbol_table;
\ No newline at end of file
+error_code_t process_instruction_first_pass(assembler_context_t *ctx, const token_list_t *words, const instruction_info_t *inst_info,
+                                            const char *label, int line_number);
+error_code_t process_directive_first_pass(assembler_context_t *ctx, const token_list_t *words, directive_t directive,
+                                          const char *label, int line_number);
+error_code_t parse_operand(assembler_context_t *ctx, const char *text, parsed_operand_t *operand);
+void free_line_records(assembler_context_t *ctx);
+void print_symbol_table(assembler_context_t *ctx);
\ No newline at end of file
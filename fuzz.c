@@ -0,0 +1,412 @@
+/*
+ * FUZZ MODULE (--fuzz)
+ *
+ * The samples only have lines that someone thought of. This makes up
+ * broken ones: it takes the lines of a small built-in program, and mutates
+ * them at random - bytes inserted, deleted and replaced (quotes, brackets,
+ * commas, colons, control and high bytes, '\0'), pieces repeated until the
+ * line is very long, lines cut short or glued to another one:
+ *
+ *   ./assembler --fuzz
+ *   ./assembler --fuzz=lines=1000000,seed=7
+ *
+ * Every line goes through the line parsers on their own, and the checks
+ * below are what they promise their callers:
+ * - scan_line: the bounds are inside the line, the colon is a ':' in them
+ * - extract_label: the label is in the caller's MAX_LABEL_LENGTH buffer and
+ *   nothing after it was written, the rest of the line starts in the line
+ * - tokenize_line: at most MAX_TOKENS tokens, each one inside the line,
+ *   not empty and without a separator in it
+ * - scan_data_values, scan_string_values, scan_matrix_size: no more values
+ *   than the room their comments ask for, sizes at least 1
+ * A canary after every buffer catches a write past its end.
+ *
+ * Then the line goes to first_pass_line like a line of a .am file, which
+ * must take anything without failing (except for memory). After every
+ * FUZZ_BATCH lines the first pass is finished and the second pass (or the
+ * --one-pass patching) runs on what it kept, so encode_directive and
+ * encode_instruction see every line the first pass let through. The
+ * messages are thrown away.
+ *
+ * Lines and seed are printed when a check fails, and the exit status is 1.
+ * The same seed always makes the same lines. Most of what goes wrong in C
+ * does not fail a check but reads or writes where it must not, so the fuzz
+ * is most useful with a sanitizer build (see the README).
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
+#include "diagnostics.h"
+#include "first_pass.h"
+#include "fuzz.h"
+#include "one_pass.h"
+#include "second_pass.h"
+#include "utils.h"
+
+#define FUZZ_DEFAULT_LINES 100000
+#define FUZZ_DEFAULT_SEED 1
+#define FUZZ_BATCH 32              /* Lines per "file" - then the passes are finished */
+#define FUZZ_MAX_LINE 4096         /* Longest line it makes (longer than MAX_LINE_LENGTH on purpose) */
+#define FUZZ_CANARY 0xA5           /* Fills the bytes after every buffer */
+#define FUZZ_CANARY_SIZE 16
+
+/* A line of the built-in program, glued together with the mutations */
+static const char *fuzz_corpus[] = {
+    "MAIN: mov r3, LENGTH",
+    "LOOP: jmp L1",
+    "prn #-5",
+    "mcro m1",
+    "sub r1, r4",
+    "bne END",
+    "L1: inc K",
+    ".entry LOOP",
+    ".extern W",
+    "jsr W",
+    "END: stop",
+    "STR: .string \"abcdef\"",
+    "USTR: .string \xe2\x80\x9c" "abc" "\xe2\x80\x9d",
+    "LENGTH: .data 6, -9, 15",
+    "K: .data 22",
+    "M1: .mat [2][2] 1, 2, 3, 4",
+    "M2: .mat [3][1]",
+    "mov M1[r2][r7], r3",
+    "cmp #5, M1[r1][r1]",
+    "lea STR, r6",
+    "add *r2, r3",
+    "rts",
+    "clr r2",
+    "not r2",
+    "red r1",
+    "; a comment",
+    "   ",
+    ".entry MAIN"
+};
+
+/* Bytes inserted more often than the others - they are what the parsers look for */
+static const char fuzz_special[] = ":,[]\"#-+*;.r0123456789 \t\r\v\f";
+
+/* What --fuzz=SPEC asked for */
+typedef struct {
+    long lines;
+    unsigned long seed;
+} fuzz_config_t;
+
+static int parse_fuzz_spec(const char *spec, fuzz_config_t *config);
+static unsigned long fuzz_random(unsigned long *state, unsigned long range);
+static int make_line(unsigned long *state, char *line);
+static int check_line(const char *text, int length);
+static int check_canary(const unsigned char *guard);
+static void fill_canary(unsigned char *guard);
+static void finish_batch(assembler_context_t *ctx);
+
+/*
+ * RUN_FUZZ - Make config.lines broken lines and check every one of them
+ * Returns: exit status for main (0 if no check failed)
+ */
+int run_fuzz(const assembler_options_t *options) {
+    fuzz_config_t config;
+    assembler_options_t fuzz_options = *options;
+    assembler_context_t *ctx;
+    unsigned long state;
+    char *line;
+    FILE *chatter;
+    long n;
+    long failed = 0;
+    int length;
+    int batch = 0;
+
+    if (!parse_fuzz_spec(options->fuzz, &config)) {
+        return 1;
+    }
+
+    ctx = malloc(sizeof(assembler_context_t));
+    line = malloc(FUZZ_MAX_LINE + 1);
+    chatter = tmpfile();  /* The messages of all the broken lines */
+    if (!ctx || !line || !chatter) {
+        fprintf(stderr, "Error: Memory allocation failed for the fuzz.\n");
+        free(ctx);
+        free(line);
+        if (chatter) {
+            fclose(chatter);
+        }
+        return 1;
+    }
+    fuzz_options.quiet = 1;
+    fuzz_options.max_errors = 0;
+    init_context(ctx, &fuzz_options, chatter, chatter);
+
+    state = config.seed;
+    for (n = 0; n < config.lines; n++) {
+        length = make_line(&state, line);
+        if (!check_line(line, length)) {
+            printf("FAILED line %ld (seed %lu): \"%.*s\"\n", n + 1, config.seed, length, line);
+            failed++;
+        }
+
+        if (batch == 0) {
+            reset_context(ctx);
+            ctx->current_filename = create_filename(&ctx->arena, "fuzz", AM_EXT);
+            first_pass_begin(ctx);
+        }
+        if (first_pass_line(ctx, line, length) != SUCCESS && !ctx->memory.limit_reached) {
+            printf("FAILED line %ld (seed %lu): first_pass_line gave up on \"%.*s\"\n",
+                   n + 1, config.seed, length, line);
+            failed++;
+        }
+        if (++batch == FUZZ_BATCH || n + 1 == config.lines) {
+            finish_batch(ctx);
+            rewind(chatter);  /* Don't let the messages pile up */
+            batch = 0;
+        }
+    }
+
+    free_context(ctx);
+    free(ctx);
+    free(line);
+    fclose(chatter);
+
+    printf("Fuzz: %ld lines (seed %lu), %ld failed checks.\n", config.lines, config.seed, failed);
+    return failed == 0 ? 0 : 1;
+}
+
+/*
+ * PARSE_FUZZ_SPEC - Read "lines=N,seed=S" (both optional, any order)
+ * Returns: 1 if the spec is fine, 0 if not (with a message)
+ */
+static int parse_fuzz_spec(const char *spec, fuzz_config_t *config) {
+    const char *p = spec;
+    char *number_end;
+    long value;
+
+    config->lines = FUZZ_DEFAULT_LINES;
+    config->seed = FUZZ_DEFAULT_SEED;
+
+    while (*p) {
+        if (strncmp(p, "lines=", 6) == 0) {
+            value = strtol(p + 6, &number_end, 10);
+            if (number_end == p + 6 || value < 1) {
+                break;
+            }
+            config->lines = value;
+        } else if (strncmp(p, "seed=", 5) == 0) {
+            value = strtol(p + 5, &number_end, 10);
+            if (number_end == p + 5 || value < 0) {
+                break;
+            }
+            config->seed = (unsigned long)value;
+        } else {
+            break;
+        }
+        p = number_end;
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            break;
+        }
+    }
+    if (*p) {
+        fprintf(stderr, "Error: Invalid fuzz setting '%s' (use lines=N, seed=S).\n", spec);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * FUZZ_RANDOM - Next number from 0 to range - 1
+ *
+ * A plain 32-bit LCG (the one from the C standard's rand example), so a
+ * seed makes the same lines with every C library.
+ */
+static unsigned long fuzz_random(unsigned long *state, unsigned long range) {
+    *state = (*state * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+    return ((*state >> 16) & 0x7FFFUL) % range;
+}
+
+/*
+ * MAKE_LINE - Write the next broken line into line (FUZZ_MAX_LINE + 1 bytes)
+ *
+ * A line of the corpus, then 0 to 7 mutations. The line is '\0'
+ * terminated for the printout, but it may have '\0' bytes in it too.
+ * Returns: its length
+ */
+static int make_line(unsigned long *state, char *line) {
+    const int corpus_size = (int)(sizeof(fuzz_corpus) / sizeof(fuzz_corpus[0]));
+    const char *piece;
+    int length;
+    int mutations;
+    int position;
+    int count;
+    int i;
+
+    strcpy(line, fuzz_corpus[fuzz_random(state, corpus_size)]);
+    length = (int)strlen(line);
+    mutations = (int)fuzz_random(state, 8);
+
+    for (i = 0; i < mutations; i++) {
+        position = (int)fuzz_random(state, length + 1);
+        switch (fuzz_random(state, 8)) {
+            case 0:  /* Insert a byte the parsers care about */
+            case 1:  /* ...or any byte at all */
+                if (length < FUZZ_MAX_LINE) {
+                    memmove(line + position + 1, line + position, length - position);
+                    line[position] = fuzz_random(state, 2) ? fuzz_special[fuzz_random(state, sizeof(fuzz_special) - 1)]
+                                                           : (char)fuzz_random(state, 256);
+                    length++;
+                }
+                break;
+            case 2:  /* Delete a byte */
+                if (position < length) {
+                    memmove(line + position, line + position + 1, length - position - 1);
+                    length--;
+                }
+                break;
+            case 3:  /* Replace a byte */
+                if (position < length) {
+                    line[position] = (char)fuzz_random(state, 256);
+                }
+                break;
+            case 4:  /* Cut the line short */
+                length = position;
+                break;
+            case 5:  /* Glue another line on */
+                piece = fuzz_corpus[fuzz_random(state, corpus_size)];
+                count = (int)strlen(piece);
+                if (length + count <= FUZZ_MAX_LINE) {
+                    memcpy(line + length, piece, count);
+                    length += count;
+                }
+                break;
+            default:  /* Repeat the tail many times - long lines, many values, many tokens */
+                count = (int)fuzz_random(state, 400);
+                while (count-- > 0 && position < length && length + (length - position) <= FUZZ_MAX_LINE) {
+                    memcpy(line + length, line + position, length - position);
+                    length += length - position;
+                }
+                break;
+        }
+    }
+    line[length] = '\0';
+    return length;
+}
+
+/*
+ * CHECK_LINE - Run one line through the parsers and check what they promise
+ * Returns: 1 if every check held (a failure is printed)
+ */
+static int check_line(const char *text, int length) {
+    /* Room for the line (and the values of it), then the canary */
+    static char line[FUZZ_MAX_LINE + 1 + FUZZ_CANARY_SIZE];
+    static int values[FUZZ_MAX_LINE + 2 + FUZZ_CANARY_SIZE];
+    char label_buffer[MAX_LABEL_LENGTH + FUZZ_CANARY_SIZE];
+    token_list_t tokens;
+    line_scan_t scan;
+    char *line_ptr;
+    char *label;
+    const char *rest;
+    int room;
+    int count;
+    int rows;
+    int columns;
+    int i;
+    int j;
+
+    scan_line(text, length, &scan);
+    if (scan.start < 0 || scan.start > scan.end || scan.end > length ||
+        (scan.colon >= 0 && (scan.colon < scan.start || scan.colon >= scan.end || text[scan.colon] != ':'))) {
+        printf("  scan_line: start %d, end %d, colon %d in a line of %d\n", scan.start, scan.end, scan.colon, length);
+        return 0;
+    }
+
+    /* extract_label, on the line cut where process_line_first_pass cuts it */
+    memcpy(line, text, length);
+    line[scan.end] = '\0';
+    fill_canary((unsigned char *)label_buffer + MAX_LABEL_LENGTH);
+    label = extract_label(line, scan.colon, &line_ptr, label_buffer);
+    if ((label && (label < label_buffer || label >= label_buffer + MAX_LABEL_LENGTH ||
+                   strlen(label) >= MAX_LABEL_LENGTH)) ||
+        (line_ptr != line && line_ptr != line + scan.colon + 1) ||
+        !check_canary((unsigned char *)label_buffer + MAX_LABEL_LENGTH)) {
+        printf("  extract_label: label or rest of the line out of place\n");
+        return 0;
+    }
+
+    /* The data scanners take any text (they normally get the part after the name) */
+    line[length] = '\0';
+    room = ((int)strlen(line) + 1) / 2;
+    fill_canary((unsigned char *)(values + room));
+    count = scan_data_values(line, values);
+    if (count > room || !check_canary((unsigned char *)(values + room))) {
+        printf("  scan_data_values: %d values, room for %d\n", count, room);
+        return 0;
+    }
+    room = (int)strlen(line) + 1;
+    fill_canary((unsigned char *)(values + room));
+    count = scan_string_values(line, values);
+    if (count > room || !check_canary((unsigned char *)(values + room))) {
+        printf("  scan_string_values: %d values, room for %d\n", count, room);
+        return 0;
+    }
+    rest = scan_matrix_size(line, &rows, &columns);
+    if (rest && (rest < line || rest > line + strlen(line) || rows < 1 || columns < 1)) {
+        printf("  scan_matrix_size: [%d][%d]\n", rows, columns);
+        return 0;
+    }
+
+    /* tokenize_line writes into the line, so it gets the copy last */
+    fill_canary((unsigned char *)line + length + 1);
+    tokenize_line(line, &tokens);
+    if (tokens.count > MAX_TOKENS || (tokens.truncated && tokens.count != MAX_TOKENS) ||
+        !check_canary((unsigned char *)line + length + 1)) {
+        printf("  tokenize_line: %d tokens%s\n", tokens.count, tokens.truncated ? " (truncated)" : "");
+        return 0;
+    }
+    for (i = 0; i < tokens.count; i++) {
+        if (tokens.tokens[i].text < line || tokens.tokens[i].length < 1 ||
+            tokens.tokens[i].text + tokens.tokens[i].length > line + length) {
+            printf("  tokenize_line: token %d is not in the line\n", i);
+            return 0;
+        }
+        for (j = 0; j < tokens.tokens[i].length; j++) {
+            if (strchr(" \t,", tokens.tokens[i].text[j]) || tokens.tokens[i].text[j] == '\0') {
+                printf("  tokenize_line: token %d has a separator in it\n", i);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * FILL_CANARY / CHECK_CANARY - The FUZZ_CANARY_SIZE bytes after a buffer
+ */
+static void fill_canary(unsigned char *guard) {
+    memset(guard, FUZZ_CANARY, FUZZ_CANARY_SIZE);
+}
+
+static int check_canary(const unsigned char *guard) {
+    int i;
+
+    for (i = 0; i < FUZZ_CANARY_SIZE; i++) {
+        if (guard[i] != FUZZ_CANARY) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * FINISH_BATCH - End the "file" of the last FUZZ_BATCH lines
+ *
+ * Unlike process_single_file, the second pass runs even if some lines had
+ * errors: the records of the lines that were fine are still there, and the
+ * broken lines are what it should see. Nothing is written.
+ */
+static void finish_batch(assembler_context_t *ctx) {
+    first_pass_end(ctx);
+    if (ctx->options->one_pass) {
+        one_pass_end(ctx);
+    } else {
+        second_pass(ctx, NULL);
+    }
+    flush_diagnostics(ctx);
+}
@@ -0,0 +1,5 @@
+/* Fuzz driver for the line parsers (--fuzz) */
+/* Simple header - no includes needed */
+
+/* Function declarations */
+int run_fuzz(const assembler_options_t *options);
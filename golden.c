@@ -0,0 +1,292 @@
+/*
+ * GOLDEN OUTPUT CHECK (--golden DIR)
+ *
+ * The sample .as files have known outputs, and a change that is only meant
+ * to make the assembler faster must not change them. This assembles every
+ * sample and compares what it wrote with the expected files in DIR, byte
+ * for byte:
+ *
+ *   ./assembler --golden golden
+ *   ./assembler --one-pass --file-threads 4 --golden golden
+ *
+ * DIR/samples.txt says what to check, one line each ('#' starts a comment):
+ *
+ *   sample NAME ok|failed     assemble NAME.as (in the current directory)
+ *   bench SPEC DIGEST         generate the --bench program of SPEC (bench.c),
+ *                             assemble it and compare its output digest
+ *
+ * For a sample, DIR has the expected NAME.ob, NAME.ent and NAME.ext, and
+ * NAME.err with the error messages. A file that is not in DIR must not be
+ * written either (and no .err means no messages). The result has to be the
+ * one in samples.txt too, so a sample that used to fail can't start to
+ * "work". The outputs are written next to the samples, so any that are
+ * there already are removed first, and they are removed again after they
+ * are compared. --output-dir is not used, because the messages name
+ * the .am file with its directory.
+ *
+ * The other options are used as they are, so --one-pass, --file-threads,
+ * --cache-dir and --max-errors are all checked against the same files.
+ * --format=bin has no golden files, so it is refused.
+ *
+ * After a change that is meant to change the outputs, assemble the samples
+ * again and copy the new files into DIR (see the README).
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "bench.h"
+#include "golden.h"
+
+#define GOLDEN_MANIFEST "samples.txt"
+#define GOLDEN_ERR_EXT ".err"      /* The messages of a sample, as they go to stderr */
+
+static int check_sample(assembler_context_t *ctx, const char *dir, const char *name, int expect_ok);
+static int check_bench(assembler_context_t *ctx, const char *spec, const char *expected);
+static int compare_output(const char *dir, const char *name, const char *extension, FILE *actual);
+static long compare_streams(FILE *expected, FILE *actual);
+
+/*
+ * RUN_GOLDEN - Check every line of DIR/samples.txt
+ * Returns: exit status for main (0 if everything matched)
+ */
+int run_golden(const assembler_options_t *options) {
+    assembler_options_t golden_options = *options;
+    assembler_context_t *ctx;
+    char filename[MAX_FILENAME_LENGTH];
+    char line[MAX_LINE_LENGTH * 2];
+    char kind[16];
+    char name[MAX_FILENAME_LENGTH];
+    char value[MAX_FILENAME_LENGTH];
+    FILE *manifest;
+    FILE *chatter;
+    int line_number = 0;
+    int checked = 0;
+    int matched = 0;
+    int status = 0;
+
+    if (options->format == FORMAT_BINARY) {
+        fprintf(stderr, "Error: --golden has no golden files for --format=bin.\n");
+        return 1;
+    }
+    if (strlen(options->golden) + 1 + strlen(GOLDEN_MANIFEST) >= sizeof(filename)) {
+        fprintf(stderr, "Error: Golden directory name '%s' is too long.\n", options->golden);
+        return 1;
+    }
+    sprintf(filename, "%s/%s", options->golden, GOLDEN_MANIFEST);
+    manifest = fopen(filename, "r");
+    if (!manifest) {
+        fprintf(stderr, "Error: Could not open '%s'.\n", filename);
+        return 1;
+    }
+
+    ctx = malloc(sizeof(assembler_context_t));
+    chatter = tmpfile();  /* The stage banners are not compared */
+    if (!ctx || !chatter) {
+        fprintf(stderr, "Error: Memory allocation failed for assembler context.\n");
+        free(ctx);
+        if (chatter) {
+            fclose(chatter);
+        }
+        fclose(manifest);
+        return 1;
+    }
+    golden_options.output_dir = NULL;  /* Next to the samples, so the messages name the same .am */
+    golden_options.quiet = 1;
+    init_context(ctx, &golden_options, chatter, NULL);
+
+    /* The words have no spaces in them, and %255s leaves room for the '\0' of MAX_FILENAME_LENGTH */
+    while (fgets(line, sizeof(line), manifest)) {
+        line_number++;
+        if (sscanf(line, "%15s", kind) != 1 || kind[0] == '#') {
+            continue;  /* Empty line or comment */
+        }
+        if (strcmp(kind, "sample") == 0 && sscanf(line, "%*s %255s %255s", name, value) == 2 &&
+            (strcmp(value, "ok") == 0 || strcmp(value, "failed") == 0)) {
+            rewind(chatter);
+            if (check_sample(ctx, options->golden, name, strcmp(value, "ok") == 0)) {
+                matched++;
+            }
+        } else if (strcmp(kind, "bench") == 0 && sscanf(line, "%*s %255s %255s", name, value) == 2) {
+            rewind(chatter);
+            if (check_bench(ctx, name, value)) {
+                matched++;
+            }
+        } else {
+            fprintf(stderr, "Error: %s, line %d: expected 'sample NAME ok|failed' or 'bench SPEC DIGEST'.\n",
+                    filename, line_number);
+            status = 1;
+            continue;
+        }
+        checked++;
+    }
+    fclose(manifest);
+
+    free_context(ctx);
+    free(ctx);
+    fclose(chatter);
+
+    printf("Golden check: %d/%d match.\n", matched, checked);
+    return (status == 0 && matched == checked) ? 0 : 1;
+}
+
+/*
+ * CHECK_SAMPLE - Assemble one sample and compare everything it wrote
+ * A difference is printed, but all the files are still compared.
+ * Returns: 1 if the sample matched its golden files
+ */
+static int check_sample(assembler_context_t *ctx, const char *dir, const char *name, int expect_ok) {
+    static const char *extensions[] = { OB_EXT, ENT_EXT, EXT_EXT };
+    char filename[MAX_FILENAME_LENGTH];
+    FILE *errors;
+    FILE *output;
+    int assembled;
+    int same = 1;
+    size_t i;
+
+    errors = tmpfile();
+    if (!errors) {
+        printf("FAILED %s: no temporary file for its messages\n", name);
+        return 0;
+    }
+    bench_remove_outputs(name);  /* Outputs left from an earlier run must not pass for this one's */
+    ctx->err = errors;
+    assembled = process_single_file(ctx, name) == SUCCESS;
+    ctx->err = NULL;
+
+    if (assembled != expect_ok) {
+        printf("FAILED %s: expected it to %s, but it %s\n", name,
+               expect_ok ? "assemble" : "fail", assembled ? "assembled" : "failed");
+        same = 0;
+    }
+    for (i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        output = NULL;
+        if (strlen(name) + strlen(extensions[i]) < sizeof(filename)) {
+            sprintf(filename, "%s%s", name, extensions[i]);
+            output = fopen(filename, "rb");
+        }
+        if (!compare_output(dir, name, extensions[i], output)) {
+            same = 0;
+        }
+        if (output) {
+            fclose(output);
+        }
+    }
+    rewind(errors);
+    if (!compare_output(dir, name, GOLDEN_ERR_EXT, errors)) {
+        same = 0;
+    }
+    fclose(errors);
+
+    bench_remove_outputs(name);
+    if (same) {
+        printf("ok %s\n", name);
+    }
+    return same;
+}
+
+/*
+ * CHECK_BENCH - Assemble the generated program of a --bench SPEC, compare its digest
+ * The program is too big to keep its outputs in the repo, so only their digest is.
+ * Returns: 1 if the digest matched
+ */
+static int check_bench(assembler_context_t *ctx, const char *spec, const char *expected) {
+    char digest[BENCH_DIGEST_LENGTH + 1];
+    char filename[MAX_FILENAME_LENGTH];
+    const char *name;
+    FILE *errors;
+    int assembled;
+
+    if (!bench_generate(spec, &name)) {
+        printf("FAILED bench %s: could not write the program\n", spec);
+        return 0;
+    }
+    bench_remove_outputs(name);
+    errors = tmpfile();
+    ctx->err = errors ? errors : stderr;
+    assembled = process_single_file(ctx, name) == SUCCESS;
+    ctx->err = NULL;
+    if (errors) {
+        fclose(errors);
+    }
+
+    bench_digest(name, digest);
+    bench_remove_outputs(name);
+    if (strlen(name) + strlen(AS_EXT) < sizeof(filename)) {
+        sprintf(filename, "%s%s", name, AS_EXT);
+        remove(filename);
+    }
+
+    if (!assembled) {
+        printf("FAILED bench %s: the program did not assemble\n", spec);
+        return 0;
+    }
+    if (strcmp(digest, expected) != 0) {
+        printf("FAILED bench %s: output digest %s, golden %s\n", spec, digest, expected);
+        return 0;
+    }
+    printf("ok bench %s\n", spec);
+    return 1;
+}
+
+/*
+ * COMPARE_OUTPUT - Compare one output (NULL if it was not written) with DIR/NAME.EXTENSION
+ *
+ * A golden file that is not there means the output must not be there
+ * either - or for the messages, that there must not be any.
+ * Returns: 1 if they are the same
+ */
+static int compare_output(const char *dir, const char *name, const char *extension, FILE *actual) {
+    char filename[MAX_FILENAME_LENGTH];
+    FILE *expected = NULL;
+    long difference;
+    int empty;
+
+    if (strlen(dir) + 1 + strlen(name) + strlen(extension) < sizeof(filename)) {
+        sprintf(filename, "%s/%s%s", dir, name, extension);
+        expected = fopen(filename, "rb");
+    }
+
+    if (!expected) {
+        if (!actual) {
+            return 1;
+        }
+        empty = getc(actual) == EOF;
+        if (!empty || strcmp(extension, GOLDEN_ERR_EXT) != 0) {
+            printf("FAILED %s: wrote %s%s, which has no golden file\n", name, name, extension);
+            return 0;
+        }
+        return 1;  /* No messages, like the missing .err says */
+    }
+    if (!actual) {
+        printf("FAILED %s: did not write %s%s\n", name, name, extension);
+        fclose(expected);
+        return 0;
+    }
+
+    difference = compare_streams(expected, actual);
+    fclose(expected);
+    if (difference >= 0) {
+        printf("FAILED %s: %s%s differs from %s at byte %ld\n", name, name, extension, filename, difference);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * COMPARE_STREAMS - Read two files to the end, side by side
+ * Returns: offset of the first byte that differs (or where one ends first), -1 if they are the same
+ */
+static long compare_streams(FILE *expected, FILE *actual) {
+    long offset = 0;
+    int a;
+    int b;
+
+    do {
+        a = getc(expected);
+        b = getc(actual);
+        if (a != b) {
+            return offset;
+        }
+        offset++;
+    } while (a != EOF);
+    return -1;
+}
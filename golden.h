@@ -0,0 +1,5 @@
+/* Golden output check (--golden DIR) */
+/* Simple header - no includes needed */
+
+/* Function declarations */
+int run_golden(const assembler_options_t *options);
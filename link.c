@@ -0,0 +1,313 @@
+/*
+ * LINK MODULE (--link OUT)
+ *
+ * Without a linker every module ends up as its own .ob/.ent/.ext files, and
+ * whatever puts the modules together has to read the .ent and .ext text back
+ * in to find out what goes where. With --link the modules are assembled as
+ * usual, but their outputs are not written - each module's context (symbol
+ * table, external references, code and data images) is kept in memory, and
+ * then they are linked into one program:
+ *
+ * 1. LAYOUT: the code of all modules comes first, one module after the
+ *    other from address INITIAL_IC, and then the data of all modules in the
+ *    same order (so the linked program looks like one big module).
+ * 2. ENTRIES: every .entry symbol of every module goes into the image's own
+ *    symbol table, at its linked address. That table has a hash index
+ *    (first_pass.c), so it is the global entry index. The same entry in two
+ *    modules is an error.
+ * 3. COPY: the words are copied into the image. Relocatable words hold an
+ *    address inside their module, which is moved to where that code or data
+ *    word ended up.
+ * 4. EXTERNALS: every external reference is looked up in the entry index and
+ *    its word is patched right in the image with the entry's address (it is
+ *    relocatable now). A name that no module has as .entry is an error.
+ *
+ * The image is written like one module: OUT.ob and OUT.ent (or one OUT.bin
+ * with --format=bin). All the externals are resolved, so there is no .ext.
+ *
+ * Like in the .ob file, a word only holds the low 10 bits of an address.
+ * A relocatable word is matched to its code or data by that value, so each
+ * module has to fit in the 10-bit address space (like it already had to).
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
+#include "diagnostics.h"
+#include "first_pass.h"
+#include "link.h"
+#include "second_pass.h"
+#include "stats.h"
+#include "utils.h"
+#include "writer.h"
+
+static error_code_t link_image(assembler_context_t *image, const assembler_options_t *options,
+                               assembler_context_t *modules, int module_count);
+static error_code_t add_module_entries(assembler_context_t *image, assembler_context_t *module, int code_base, int data_base);
+static void copy_module(assembler_context_t *image, const assembler_context_t *module, int code_base, int data_base);
+static void resolve_externals(assembler_context_t *image, const assembler_context_t *module, int code_base);
+static const char *link_message(assembler_context_t *image, const char *format, const char *name);
+
+/*
+ * LINK_MODULES - Assemble the files and link them into options->link
+ *
+ * The modules are assembled one after another (not on -j threads), each
+ * with its own context, because all of them have to stay in memory until
+ * the link. --cache-dir is not used: a cache hit only has the output files,
+ * not the symbol tables. *linked is set to 1 if the linked program was written.
+ * Returns: number of files that were assembled successfully
+ */
+int link_modules(const assembler_options_t *options, char *files[], int file_count, assembler_stats_t *totals, int *linked) {
+    assembler_options_t module_options = *options;
+    assembler_context_t *modules;       /* One per file, and the image at the end */
+    assembler_stats_t file_stats;
+    int success_count = 0;
+    int i;
+
+    *linked = 0;
+    if (options->cache_dir) {
+        fprintf(stderr, "Warning: --cache-dir is not used with --link.\n");
+        module_options.cache_dir = NULL;
+    }
+    if (options->jobs > 1) {
+        fprintf(stderr, "Warning: --link assembles the modules one at a time, ignoring -j.\n");
+    }
+
+    modules = malloc((file_count + 1) * sizeof(assembler_context_t));
+    if (!modules) {
+        fprintf(stderr, "Error: Memory allocation failed for the modules to link.\n");
+        return 0;
+    }
+
+    for (i = 0; i < file_count; i++) {
+        init_context(&modules[i], &module_options, stdout, stderr);
+        if (process_single_file(&modules[i], files[i]) == SUCCESS) {
+            success_count++;
+        }
+        if (options->stats != STATS_OFF) {
+            stats_collect(&modules[i], &file_stats);
+            stats_print(stdout, files[i], &file_stats, options->stats);
+            stats_add(totals, &file_stats);
+        }
+        if (!options->quiet) {
+            printf("\n");
+        }
+    }
+
+    if (success_count == file_count) {
+        init_context(&modules[file_count], &module_options, stdout, stderr);
+        *linked = link_image(&modules[file_count], &module_options, modules, file_count) == SUCCESS;
+        totals->bytes_written += modules[file_count].stats.bytes_written;
+        free_context(&modules[file_count]);
+    } else {
+        fprintf(stderr, "Error: Not linking '%s' - %d of %d modules had errors.\n",
+                options->link, file_count - success_count, file_count);
+    }
+
+    for (i = 0; i < file_count; i++) {
+        free_context(&modules[i]);
+    }
+    free(modules);
+    return success_count;
+}
+
+/*
+ * LINK_IMAGE - Build the linked program in image and write it
+ *
+ * Each module's code and data start (code_base, data_base) are the sizes of
+ * the modules before it, so they are just added up while walking the list -
+ * once for the entries, and once more for the words and the externals, which
+ * need every entry to be known already.
+ */
+static error_code_t link_image(assembler_context_t *image, const assembler_options_t *options,
+                               assembler_context_t *modules, int module_count) {
+    char *base_name;
+    char *object_name;
+    int code_words = 0;
+    int data_words = 0;
+    int code_base;
+    int data_base;
+    int i;
+    error_code_t result = SUCCESS;
+
+    base_name = create_output_filename(&image->arena, options->output_dir, options->link, "");
+    object_name = create_output_filename(&image->arena, options->output_dir, options->link,
+                                         options->format == FORMAT_BINARY ? BIN_EXT : OB_EXT);
+    if (!base_name || !object_name) {
+        fprintf(stderr, "Error: Memory allocation failed for filenames.\n");
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    print_progress(image, "--- Linking %d modules into '%s' ---\n", module_count, object_name);
+
+    /* LAYOUT: all the code, then all the data */
+    for (i = 0; i < module_count; i++) {
+        code_words += modules[i].code.count;
+        data_words += modules[i].data.count;
+    }
+    image->current_filename = object_name;
+    if (segment_reserve(image, &image->code, code_words) != SUCCESS ||
+        segment_reserve(image, &image->data, data_words) != SUCCESS) {
+        report_error(image, 0, 0, ERROR_MEMORY_ALLOCATION, "Not enough memory for the linked program");
+        flush_diagnostics(image);
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    image->code.count = code_words;
+    image->data.count = data_words;
+    image->IC = INITIAL_IC + code_words;  /* What the output writers expect after a second pass */
+    image->DC = INITIAL_DC + data_words;
+
+    /* ENTRIES: the global entry index */
+    code_base = 0;
+    data_base = 0;
+    for (i = 0; i < module_count && result == SUCCESS; i++) {
+        result = add_module_entries(image, &modules[i], code_base, data_base);
+        code_base += modules[i].code.count;
+        data_base += modules[i].data.count;
+    }
+
+    /* COPY + EXTERNALS */
+    code_base = 0;
+    data_base = 0;
+    for (i = 0; i < module_count && result == SUCCESS; i++) {
+        copy_module(image, &modules[i], code_base, data_base);
+        resolve_externals(image, &modules[i], code_base);
+        code_base += modules[i].code.count;
+        data_base += modules[i].data.count;
+    }
+
+    image->current_filename = object_name;
+    if (result == SUCCESS && image->error_flag == 0) {
+        if (options->writer) {
+            image->writer_file = writer_begin(options->writer, options->link);  /* On the writer's queue */
+        }
+        if (options->format == FORMAT_BINARY) {
+            result = generate_binary_object_file(image, base_name);
+        } else if ((result = generate_object_file(image, base_name)) == SUCCESS) {
+            result = generate_entries_file(image, base_name);  /* No .ext - every external is resolved */
+        }
+        if (result == SUCCESS && image->writer_file >= 0) {
+            result = writer_wait(options->writer, image->writer_file);
+        }
+        if (result != SUCCESS) {
+            report_note(image, "Error: Could not write the linked program '%s'.", object_name);
+        } else {
+            print_progress(image, "--- Successfully linked %s ---\n", object_name);
+        }
+    } else {
+        report_note(image, "Errors were found while linking '%s'. Output files will not be generated.", object_name);
+        if (result == SUCCESS) {
+            result = ERROR_UNDEFINED_LABEL;
+        }
+    }
+    flush_diagnostics(image);
+    return result;
+}
+
+/*
+ * ADD_MODULE_ENTRIES - Put a module's .entry symbols into the global entry index
+ *
+ * The symbol keeps its segment, and its offset is moved by where the module's
+ * code or data starts in the image, so symbol_address(image, ...) gives the
+ * linked address.
+ * Returns: SUCCESS, or ERROR_MEMORY_ALLOCATION (a duplicate is only reported)
+ */
+static error_code_t add_module_entries(assembler_context_t *image, assembler_context_t *module, int code_base, int data_base) {
+    int symbol;
+    int is_data;
+    error_code_t result;
+
+    image->current_filename = module->current_filename;
+    for (symbol = module->symbol_count - 1; symbol >= 0; symbol--) {
+        if (!(module->symbol_flags[symbol] & SYMBOL_ENTRY)) {
+            continue;
+        }
+        is_data = module->symbol_flags[symbol] & SYMBOL_DATA;
+        result = add_symbol(image, symbol_name(module, symbol), is_data ? SEGMENT_DATA : SEGMENT_CODE,
+                            module->symbol_offsets[symbol] + (is_data ? data_base : code_base), 0);
+        if (result == ERROR_DUPLICATE_LABEL) {
+            report_error(image, 0, 0, result,
+                         link_message(image, "Entry '%s' is also an entry of another module", symbol_name(module, symbol)));
+            image->error_flag = 1;
+        } else if (result != SUCCESS) {
+            report_error(image, 0, 0, result, "Not enough memory for the entry index");
+            return result;
+        } else {
+            image->symbol_flags[image->symbol_count - 1] |= SYMBOL_ENTRY;  /* add_symbol gave it the last id */
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * COPY_MODULE - Copy a module's words into the image, relocating addresses
+ *
+ * A relocatable word holds the address the module gave it: under
+ * INITIAL_IC + code.count it is one of the module's code words, from there
+ * on one of its data words.
+ */
+static void copy_module(assembler_context_t *image, const assembler_context_t *module, int code_base, int data_base) {
+    word_t word;
+    int offset;
+    int i;
+
+    for (i = 0; i < module->code.count; i++) {
+        word = module->code.words[i];
+        if (word.are == ARE_RELOCATABLE) {
+            offset = (int)word.value - INITIAL_IC;
+            if (offset < module->code.count) {
+                word.value = INITIAL_IC + code_base + offset;
+            } else {
+                word.value = INITIAL_IC + image->code.count + data_base + offset - module->code.count;
+            }
+        }
+        image->code.words[code_base + i] = word;
+    }
+    if (module->data.count > 0) {
+        memcpy(image->data.words + data_base, module->data.words, module->data.count * sizeof(word_t));
+    }
+}
+
+/*
+ * RESOLVE_EXTERNALS - Patch a module's external words with the entries' addresses
+ *
+ * This is the probe side of the join: one lookup in the entry index per
+ * reference, by the name of the reference's extern symbol.
+ */
+static void resolve_externals(assembler_context_t *image, const assembler_context_t *module, int code_base) {
+    const external_ref_t *ref;
+    const char *name;
+    int symbol;
+    word_t *word;
+    int i;
+
+    image->current_filename = module->current_filename;
+    for (i = module->external_reference_count - 1; i >= 0; i--) {
+        ref = &module->external_references[i];
+        name = symbol_name(module, ref->symbol);
+        symbol = find_symbol(image, name);
+        if (symbol == NO_SYMBOL) {
+            report_error(image, 0, 0, ERROR_UNDEFINED_LABEL,
+                         link_message(image, "External symbol '%s' is not an entry of any module", name));
+            image->error_flag = 1;
+            continue;
+        }
+        word = &image->code.words[code_base + ref->address - INITIAL_IC];
+        word->value = symbol_address(image, symbol);
+        word->are = ARE_RELOCATABLE;
+    }
+}
+
+/*
+ * LINK_MESSAGE - format with its one %s replaced by name, in the image's arena
+ *
+ * report_error keeps the message pointer until the flush, and these
+ * messages have a symbol name in them, so they can't be string literals.
+ */
+static const char *link_message(assembler_context_t *image, const char *format, const char *name) {
+    char *text = arena_alloc(&image->arena, strlen(format) + strlen(name) + 1);
+
+    if (!text) {
+        return "Symbol could not be linked";
+    }
+    sprintf(text, format, name);
+    return text;
+}
@@ -0,0 +1,5 @@
+/* Linker (--link OUT) - several modules into one program, all in memory */
+/* Simple header - no includes needed */
+
+/* Function declarations */
+int link_modules(const assembler_options_t *options, char *files[], int file_count, assembler_stats_t *totals, int *linked);
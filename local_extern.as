@@ -0,0 +1,6 @@
+; A label of this file can't also be .extern (in either order)
+LOOP: stop
+      jmp LOOP
+.extern LOOP
+.extern GONE
+GONE: .data 3
@@ -5,68 +5,153 @@
  * of assembly process and handles multiple input files if given.
  */
 
+/* pthreads needs the POSIX declarations, which -ansi hides by default */
+#ifndef NO_THREADS
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#endif
+
 #include "assembler.h"
+#include "arena.h"
+#include "source.h"
 #include "assembly.h"
+#include "bench.h"
+#include "fuzz.h"
+#include "golden.h"
+#include "cache.h"
+#include "diagnostics.h"
 #include "first_pass.h"
+#include "link.h"
+#include "memory.h"
+#include "one_pass.h"
 #include "second_pass.h"
+#include "server.h"
+#include "stats.h"
 #include "utils.h"
-
-/* Global variables - shared across all modules */
-int IC = INITIAL_IC;    /* Instruction Counter - starts at 100, tracks where next instruction goes in memory */
-int DC = INITIAL_DC;    /* Data Counter - starts at 0, tracks where next data goes in memory */
-int error_flag = 0;     /* Flag to track if errors occurred - when this is 1, we don't generate output files */
-char *current_filename = NULL;  /* Currently processing filename - using pointer so we can change it dynamically */
+#include "writer.h"
 
 /* Function declarations - I put these here so I can define functions in any order I want */
-void reset_global_state(void);
-error_code_t set_current_filename(const char *filename);
-error_code_t process_single_file(const char *base_filename);
+error_code_t set_current_filename(assembler_context_t *ctx, const char *filename);
+int parse_options(int argc, char *argv[], assembler_options_t *options, int *first_file);
+static int set_max_errors(const char *count_text, assembler_options_t *options, FILE *errors);
+static int set_file_threads(const char *count_text, assembler_options_t *options, FILE *errors);
+static int set_mem_limit(const char *size_text, assembler_options_t *options, FILE *errors);
+static double stage_clock(assembler_context_t *ctx);
+static void stage_done(assembler_context_t *ctx, stage_t stage, double *start);
+static error_code_t timed_first_pass_line(assembler_context_t *ctx, const char *text, int length);
+static int outputs_written(const assembler_options_t *options, int file, const char *base_filename);
+int assemble_serial(const assembler_options_t *options, char *files[], int file_count, assembler_stats_t *totals);
+#ifndef NO_THREADS
+int assemble_parallel(const assembler_options_t *options, char *files[], int file_count, assembler_stats_t *totals);
+#endif
+
+/*
+ * INIT_CONTEXT - Prepare a fresh context for assembling files
+ * 
+ * Everything that used to be a global (counters, tables, memory images) lives in
+ * the context now, so I just clear the whole thing and set the starting values.
+ * out and err are where this file's messages go - stdout/stderr when we run one
+ * file at a time, or a private buffer when running with -j.
+ */
+void init_context(assembler_context_t *ctx, const assembler_options_t *options, FILE *out, FILE *err) {
+    memset(ctx, 0, sizeof(*ctx));  /* All pointers NULL, all counts 0 */
+    ctx->options = options;
+    ctx->out = out;
+    ctx->err = err;
+    ctx->IC = INITIAL_IC;    /* Instruction counter starts at 100 */
+    ctx->DC = INITIAL_DC;    /* Data counter starts at 0 */
+    ctx->writer_file = -1;   /* Outputs are written directly until stage 4 says otherwise */
+    arena_init(&ctx->arena);
+}
 
 /*
- * RESET_GLOBAL_STATE - Clean up everything before processing next file
+ * RESET_CONTEXT - Clean up everything before processing next file
  * 
- * This is really important because if we process multiple files, we need to
- * start fresh each time. Otherwise data from previous file will mess up current one.
- * I reset counters back to initial values and free all the memory we allocated.
- */
-void reset_global_state(void) {
-    IC = INITIAL_IC;    /* Reset instruction counter to 100 */
-    DC = INITIAL_DC;    /* Reset data counter to 0 */
-    error_flag = 0;     /* Clear any previous errors */
+ * This is really important because if we process multiple files with the same
+ * context, we need to start fresh each time. Otherwise data from previous file will
+ * mess up current one.
+ * 
+ * Nothing is freed here. Macros and file names live in the arena, so one
+ * arena_reset drops them all. The growing arrays (records, name pool, symbols,
+ * external references, macro text, hash indexes) keep their memory and are just
+ * emptied, so the next file usually does not need malloc at all.
+ */
+void reset_context(assembler_context_t *ctx) {
+    ctx->IC = INITIAL_IC;    /* Reset instruction counter to 100 */
+    ctx->DC = INITIAL_DC;    /* Reset data counter to 0 */
+    ctx->error_flag = 0;     /* Clear any previous errors */
+    ctx->current_filename = NULL;
+    ctx->cache = NULL;
+    ctx->writer_file = -1;
+    
+    /* Macro table (assembly.c) - empty the index, forget the text */
+    ctx->macro_table = NULL;
+    if (ctx->macro_index) {
+        memset(ctx->macro_index, 0, ctx->macro_index_capacity * sizeof(*ctx->macro_index));
+    }
+    ctx->macro_index_count = 0;
+    ctx->macro_text_size = 0;
+    ctx->macro_line_count = 0;
     
-    /* Free the filename string if we allocated one before */
-    if (current_filename) {
-        free(current_filename);
-        current_filename = NULL;
+    /* Symbol table (first_pass.c) - empty the arrays and the index */
+    ctx->symbol_count = 0;
+    if (ctx->symbol_index) {
+        memset(ctx->symbol_index, 0, ctx->symbol_index_capacity * sizeof(*ctx->symbol_index));
     }
+    ctx->symbol_index_count = 0;
+    
+    /* Parsed program (first_pass.c) and external references (second_pass.c) */
+    ctx->line_number = 0;
+    ctx->line_record_count = 0;
+    ctx->name_pool_size = 0;
+    ctx->data_value_count = 0;
+    ctx->external_reference_count = 0;
+    ctx->object_streamed = 0;
+    ctx->fixup_count = 0;          /* --one-pass fixups (one_pass.c) */
+    ctx->code.count = 0;           /* Segments keep their memory for the next file */
+    ctx->data.count = 0;
+    
+    /* Diagnostics (diagnostics.c) - flushed at the end of every file, so normally empty */
+    ctx->diagnostic_count = 0;
+    ctx->diagnostic_errors = 0;
+    ctx->diagnostics_dropped = 0;
     
-    /* Clean up all the tables we built - these functions handle NULL pointers safely */
-    free_macros();              /* Free macro definitions table */
-    free_symbol_table();        /* Free symbol table (labels and their addresses) */
-    free_external_references(); /* Free list of external references */
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->arena.allocations = 0;
+    arena_reset(&ctx->arena);
+    memory_reset_peaks(ctx);  /* The kept memory is where the next file's peaks start */
+}
+
+/*
+ * FREE_CONTEXT - Give back all the memory a context owns
+ * 
+ * Called once when we are done with the context (not between files).
+ */
+void free_context(assembler_context_t *ctx) {
+    /* These handle NULL pointers safely */
+    free_macros(ctx);              /* Free macro text and index */
+    free_symbol_table(ctx);        /* Free symbol index */
+    free_external_references(ctx); /* Free the external reference array */
+    free_line_records(ctx);        /* Free the parsed program from the first pass */
+    free_segments(ctx);            /* Free the instruction and data images */
+    free_diagnostics(ctx);         /* Free the error list and its output buffer */
+    free_fixups(ctx);              /* Free the --one-pass fixup list */
+    arena_free(&ctx->arena);       /* And everything that was in the arena */
+    ctx->current_filename = NULL;
 }
 
 /*
  * SET_CURRENT_FILENAME - Safely store filename for error messages
  * 
  * I need this because when errors happen, I want to show which file caused the problem.
- * I allocate new memory for the string because the original might get freed or changed.
- * Returns: SUCCESS if everything ok, ERROR_MEMORY_ALLOCATION if malloc fails
+ * I copy the string into the arena because the original might get freed or changed.
+ * Returns: SUCCESS if everything ok, ERROR_MEMORY_ALLOCATION if there is no memory
  */
-error_code_t set_current_filename(const char *filename) {
-    /* Free old filename if we had one */
-    if (current_filename) {
-        free(current_filename);
-    }
-    
-    /* Allocate memory for new filename (+1 for null terminator) */
-    current_filename = malloc(strlen(filename) + 1);
-    if (!current_filename) {
-        return ERROR_MEMORY_ALLOCATION;  /* malloc failed - not enough memory */
+error_code_t set_current_filename(assembler_context_t *ctx, const char *filename) {
+    ctx->current_filename = arena_strdup(&ctx->arena, filename);
+    if (!ctx->current_filename) {
+        return ERROR_MEMORY_ALLOCATION;
     }
-    
-    /* Copy the string into our allocated memory */
-    strcpy(current_filename, filename);
     return SUCCESS;
 }
 
@@ -74,128 +159,853 @@ error_code_t set_current_filename(const char *filename) {
  * PROCESS_SINGLE_FILE - Handle all 4 stages of assembly for one file
  * 
  * This is the main logic that does the actual work. Assembly happens in stages:
- * 1. Macro expansion (.as -> .am) - replace macro calls with actual code
- * 2. First pass (.am file) - build symbol table, count memory needed
- * 3. Second pass (.am file) - generate actual machine code
- * 4. Output generation - create .ob, .ent, .ext files
+ * 1. Macro expansion (.as) - replace macro calls with actual code
+ * 2. First pass (expanded lines) - build symbol table, count memory needed
+ * 3. Second pass (line records) - generate actual machine code
+ * 4. Output generation - create .ob, .ent, .ext files (with --link
+ *    nothing is written, the linker needs the tables in the context)
+ * 
+ * With timing on (--bench or --stats), each stage's time is added to ctx->stats. Stages 1
+ * and 2 run together, so the time spent inside the first pass sink is taken
+ * out of the macro stage and counted for the first pass.
+ * 
+ * With --cache-dir the cache gets two chances to skip work: before anything runs
+ * (same .as file as before) and after macro expansion (same program, maybe with
+ * different comments or spacing). See cache.c.
  * 
- * I use goto cleanup because if any stage fails, I need to free memory before returning.
+ * Errors are collected while the file is assembled and printed together at
+ * cleanup (see diagnostics.c), so one file's errors always come out in one piece.
+ * 
+ * With --async-write stage 4 only queues the outputs and leaves their writer id
+ * in ctx->writer_file, so the caller can start on the next file while they are
+ * written. It settles the file later with outputs_written - a SUCCESS here only
+ * means the file assembled. With --cache-dir stage 4 waits itself, because the
+ * cache copies the files from the disk.
+ * 
+ * I use goto cleanup so every stage that fails leaves the same way. The file names
+ * are in the arena, so there is nothing to free - the next reset takes care of them.
  * Returns: SUCCESS if everything worked, error code if something failed
  */
-error_code_t process_single_file(const char *base_filename) {
+error_code_t process_single_file(assembler_context_t *ctx, const char *base_filename) {
     char *input_as_filename = NULL;   /* Will hold "filename.as" */
     char *output_am_filename = NULL;  /* Will hold "filename.am" */
     char *base_name = NULL;           /* Will hold just "filename" for output files */
+    source_file_t source;             /* The whole .as file, in memory */
+    error_code_t source_result;
+    cache_state_t cache;              /* Only used with --cache-dir */
+    int use_cache = 0;
+    double stage_start = 0.0;         /* When the current stage started (with timing) */
+    double first_pass_before;
+    line_sink_t first_pass_sink = ctx->options->timing ? timed_first_pass_line : first_pass_line;
     error_code_t result = SUCCESS;
 
-    printf("--- Processing file: %s ---\n", base_filename);
+    print_progress(ctx, "--- Processing file: %s ---\n", base_filename);
+    
+    /* Start fresh - clean up everything from previous file */
+    reset_context(ctx);
+    source_result = ERROR_FILE_NOT_FOUND;  /* Nothing to close yet */
     
     /* Create all the filenames we need - adding extensions to base name */
-    input_as_filename = create_filename(base_filename, AS_EXT);    /* "name" + ".as" */
-    output_am_filename = create_filename(base_filename, AM_EXT);   /* "name" + ".am" */
-    base_name = create_filename(base_filename, "");               /* just "name" for .ob/.ent/.ext */
+    input_as_filename = create_filename(&ctx->arena, base_filename, AS_EXT);    /* "name" + ".as" */
+    /* The outputs go next to the .as file, or into --output-dir */
+    output_am_filename = create_output_filename(&ctx->arena, ctx->options->output_dir, base_filename, AM_EXT);
+    base_name = create_output_filename(&ctx->arena, ctx->options->output_dir, base_filename, "");  /* for .ob/.ent/.ext */
 
     /* Check if memory allocation worked for all filenames */
     if (!input_as_filename || !output_am_filename || !base_name) {
-        fprintf(stderr, "Error: Memory allocation failed for filenames.\n");
+        report_note(ctx, "Error: Memory allocation failed for filenames.", NULL);
         result = ERROR_MEMORY_ALLOCATION;
-        goto cleanup;  /* Jump to cleanup section to free whatever we did allocate */
+        goto cleanup;
     }
 
-    /* Start fresh - clean up everything from previous file */
-    reset_global_state();
-    
     /* Set current filename for error messages */
-    result = set_current_filename(input_as_filename);
+    result = set_current_filename(ctx, input_as_filename);
     if (result != SUCCESS) {
-        fprintf(stderr, "Error: Failed to set filename.\n");
+        report_note(ctx, "Error: Failed to set filename.", NULL);
         goto cleanup;
     }
 
-    /* STAGE 1: MACRO EXPANSION (.as -> .am) */
-    /* This stage reads the original .as file and expands any macro calls */
-    printf("Stage 1: Expanding macros to '%s'\n", output_am_filename);
-    result = process_macros(input_as_filename, output_am_filename);
+    /* Bring the whole .as file into memory once (source.c) - everything reads it from there */
+    stage_start = stage_clock(ctx);
+    source_result = source_open(&source, input_as_filename);
+
+    /* CACHE: exactly this .as file was assembled before - just copy the outputs back */
+    if (ctx->options->cache_dir && source_result == SUCCESS) {
+        cache_begin(ctx, &cache, &source);
+        use_cache = 1;
+        if (cache_restore_source(ctx, &cache, output_am_filename, base_name)) {
+            print_progress(ctx, "Cache hit: restored output files for base '%s'\n", base_name);
+            print_progress(ctx, "--- Successfully processed %s ---\n", base_filename);
+            goto cleanup;
+        }
+    }
+
+    /*
+     * STAGES 1 + 2: MACRO EXPANSION STREAMED INTO THE FIRST PASS
+     * The expander goes through the .as file (already in memory) and hands each expanded line straight to
+     * the first pass, which builds the symbol table as the lines arrive.
+     * The .am file is only written when --keep-am asked for it.
+     * Error messages use the .am name because line numbers count expanded lines.
+     */
+    if (ctx->options->keep_am) {
+        print_progress(ctx, "Stage 1: Expanding macros to '%s'\n", output_am_filename);
+    } else {
+        print_progress(ctx, "Stage 1: Expanding macros in '%s'\n", input_as_filename);
+    }
+    print_progress(ctx, "Stage 2: Running first pass on '%s'\n", output_am_filename);
+    result = set_current_filename(ctx, output_am_filename);  /* Update filename for error messages */
     if (result != SUCCESS) {
-        fprintf(stderr, "Error: Macro expansion failed.\n");
+        report_note(ctx, "Error: Failed to update filename.", NULL);
         goto cleanup;
     }
-
-    /* STAGE 2: FIRST PASS (on .am file) */
-    /* Now work on the .am file (after macro expansion) */
-    /* First pass builds symbol table - finds all labels and calculates their addresses */
-    printf("Stage 2: Running first pass on '%s'\n", output_am_filename);
-    result = set_current_filename(output_am_filename);  /* Update filename for error messages */
+    
+    first_pass_begin(ctx);
+    first_pass_before = ctx->stats.stage_seconds[STAGE_FIRST_PASS];
+    result = source_result;
+    if (result == SUCCESS) {
+        result = process_macros(ctx, &source,
+                                ctx->options->keep_am ? output_am_filename : NULL,
+                                use_cache ? cache_line : first_pass_sink);
+    }
+    stage_done(ctx, STAGE_MACROS, &stage_start);
+    ctx->stats.stage_seconds[STAGE_MACROS] -= ctx->stats.stage_seconds[STAGE_FIRST_PASS] - first_pass_before;
     if (result != SUCCESS) {
-        fprintf(stderr, "Error: Failed to update filename.\n");
+        report_note(ctx, "Error: Macro expansion failed.", NULL);
         goto cleanup;
     }
     
-    result = first_pass(output_am_filename);
+    /* CACHE: the expanded program is one we have seen (only comments/spacing changed) */
+    if (use_cache) {
+        if (cache_restore_expanded(ctx, &cache, output_am_filename, base_name)) {
+            print_progress(ctx, "Cache hit: restored output files for base '%s'\n", base_name);
+            print_progress(ctx, "--- Successfully processed %s ---\n", base_filename);
+            goto cleanup;
+        }
+        result = cache_replay(ctx, &cache, first_pass_line);  /* Miss - the first pass gets the lines now */
+        stage_done(ctx, STAGE_FIRST_PASS, &stage_start);
+        if (result != SUCCESS) {
+            report_note(ctx, "Error: First pass failed.", NULL);
+            goto cleanup;
+        }
+    }
+    
+    result = first_pass_end(ctx);
+    stage_done(ctx, STAGE_FIRST_PASS, &stage_start);
     if (result != SUCCESS) {
-        fprintf(stderr, "Error: First pass failed.\n");
+        report_note(ctx, "Error: First pass failed.", NULL);
         goto cleanup;
     }
 
-    /* STAGE 3: SECOND PASS (on .am file) */
+    /* STAGE 3: SECOND PASS (on the line records from the first pass) */
     /* Second pass generates the actual machine code using symbol table from first pass */
-    printf("Stage 3: Running second pass on '%s'\n", output_am_filename);
-    result = second_pass(output_am_filename);
+    if (ctx->options->one_pass) {
+        /* --one-pass: the code is already encoded, only the labels are left to patch */
+        print_progress(ctx, "Stage 3: Patching label references in '%s'\n", output_am_filename);
+        result = one_pass_end(ctx);
+    } else {
+        /* The .ob is written while the second pass runs, unless the image is needed whole (or the writer thread writes it) */
+        print_progress(ctx, "Stage 3: Running second pass on '%s'\n", output_am_filename);
+        result = second_pass(ctx, ctx->options->format == FORMAT_LETTERS && !ctx->options->link &&
+                                  !ctx->options->writer ? base_name : NULL);
+    }
+    stage_done(ctx, STAGE_SECOND_PASS, &stage_start);
     if (result != SUCCESS) {
-        fprintf(stderr, "Error: Second pass failed.\n");
+        report_note(ctx, "Error: Second pass failed.", NULL);
         goto cleanup;
     }
 
     /* STAGE 4: GENERATE OUTPUT FILES */
     /* Only generate output if no errors occurred during assembly */
-    if (error_flag == 0) {
-        printf("Stage 4: Generating output files for base '%s'\n", base_name);
-        generate_object_file(base_name);    /* Creates filename.ob with machine code */
-        generate_entries_file(base_name);   /* Creates filename.ent with entry points */
-        generate_externals_file(base_name); /* Creates filename.ext with external references */
-        printf("--- Successfully processed %s ---\n", base_filename);
+    if (ctx->error_flag == 0 && ctx->options->link) {
+        /* --link: the module stays in the context until all of them are linked (link.c) */
+        print_progress(ctx, "Stage 4: Keeping '%s' in memory for linking\n", base_name);
+        print_progress(ctx, "--- Successfully processed %s ---\n", base_filename);
+    } else if (ctx->error_flag == 0) {
+        print_progress(ctx, "Stage 4: Generating output files for base '%s'\n", base_name);
+        if (ctx->options->writer) {
+            ctx->writer_file = writer_begin(ctx->options->writer, base_filename);  /* The files go on its queue */
+        }
+        if (ctx->options->format == FORMAT_BINARY) {
+            result = generate_binary_object_file(ctx, base_name);  /* Creates filename.bin with everything */
+        } else if ((ctx->object_streamed ||  /* filename.ob was written by the second pass */
+                    (result = generate_object_file(ctx, base_name)) == SUCCESS) &&  /* filename.ob with machine code */
+                   (result = generate_entries_file(ctx, base_name)) == SUCCESS) { /* filename.ent with entry points */
+            result = generate_externals_file(ctx, base_name);                    /* filename.ext with external references */
+        }
+        if (result == SUCCESS && use_cache && ctx->writer_file >= 0) {
+            result = writer_wait(ctx->options->writer, ctx->writer_file);  /* The cache copies them from the disk */
+        }
+        if (result == SUCCESS && use_cache) {
+            cache_store(ctx, &cache, output_am_filename, base_name);  /* Remember them for next time */
+        }
+        stage_done(ctx, STAGE_OUTPUT, &stage_start);
+        if (ctx->memory.limit_reached) {
+            /* The error is out already - the files before the refused buffer are written, the rest are missing */
+            report_note(ctx, "Output files for '%s' are incomplete (--mem-limit).", base_filename);
+            result = ERROR_MEMORY_ALLOCATION;
+            goto cleanup;
+        }
+        if (result != SUCCESS) {
+            report_note(ctx, "Error: Could not write the output files of '%s'.", base_filename);
+            goto cleanup;
+        }
+        print_progress(ctx, "--- Successfully processed %s ---\n", base_filename);
     } else {
         /* If there were errors, don't create output files - they would be wrong */
-        fprintf(stderr, "Errors were found in '%s'. Output files will not be generated.\n", base_filename);
+        report_note(ctx, "Errors were found in '%s'. Output files will not be generated.", base_filename);
         result = ERROR_INVALID_SYNTAX;
     }
 
 cleanup:
-    /* Always free memory we allocated - even if errors happened */
-    free(input_as_filename);
-    free(output_am_filename);
-    free(base_name);
+    flush_diagnostics(ctx);  /* All of this file's errors, in one write */
+    if (use_cache) {
+        cache_end(ctx, &cache);
+    }
+    if (source_result == SUCCESS) {
+        source_close(&source);
+    }
     return result;
 }
 
-int main(int argc, char *argv[]) {
+/*
+ * OUTPUTS_WRITTEN - Wait for the outputs stage 4 left on the writer's queue
+ *
+ * file is the ctx->writer_file of a file that process_single_file assembled
+ * (-1 when its outputs were written directly). The callers wait as late as they
+ * can - serial mode after the next file is assembled, -j when the file's
+ * messages are printed - so the writes overlap with the assembling.
+ * Returns: 1 if the outputs were written, 0 (after saying so) if not
+ */
+static int outputs_written(const assembler_options_t *options, int file, const char *base_filename) {
+    if (file < 0 || writer_wait(options->writer, file) == SUCCESS) {
+        return 1;
+    }
+    fprintf(stderr, "Error: Could not write the output files of '%s'.\n", base_filename);
+    return 0;
+}
+
+/*
+ * STAGE_CLOCK / STAGE_DONE - Time the stages of process_single_file
+ * 
+ * Without timing these just return, so a normal run never reads the clock.
+ * stage_done adds the time since *start to the stage and restarts the clock.
+ */
+static double stage_clock(assembler_context_t *ctx) {
+    return ctx->options->timing ? stats_now() : 0.0;
+}
+
+static void stage_done(assembler_context_t *ctx, stage_t stage, double *start) {
+    double now;
+    
+    if (ctx->options->timing) {
+        now = stats_now();
+        ctx->stats.stage_seconds[stage] += now - *start;
+        *start = now;
+    }
+}
+
+/*
+ * TIMED_FIRST_PASS_LINE - first_pass_line, but the time goes to the first pass stage
+ */
+static error_code_t timed_first_pass_line(assembler_context_t *ctx, const char *text, int length) {
+    double start = stats_now();
+    error_code_t result = first_pass_line(ctx, text, length);
+    
+    ctx->stats.stage_seconds[STAGE_FIRST_PASS] += stats_now() - start;
+    return result;
+}
+
+/*
+ * PARSE_FILE_OPTION - The options that only change how each file is assembled
+ *
+ * These are the one-word options that the command line and every --server
+ * request (server.c) both understand:
+ * --keep-am also writes the expanded .am file (normally it stays in memory),
+ * --one-pass encodes while reading and patches label addresses at the end,
+ * --format=bin writes one binary .bin object instead of .ob/.ent/.ext,
+ * --output-dir=DIR writes the outputs into DIR instead of next to the .as file,
+ * --max-errors=N prints at most N errors for each file,
+ * --file-threads=N splits each file's second pass over up to N threads,
+ * --mem-limit=N fails a file whose tables would need more than N bytes (see memory.c), and
+ * --quiet (or -q) leaves out the progress messages.
+ * Returns: 1 if arg was one of them, 0 if it is some other option,
+ *          -1 if its value was wrong (the message goes to errors)
+ */
+int parse_file_option(const char *arg, assembler_options_t *options, FILE *errors) {
+    if (strcmp(arg, "--keep-am") == 0) {
+        options->keep_am = 1;
+    } else if (strcmp(arg, "--one-pass") == 0) {
+        options->one_pass = 1;
+    } else if (strncmp(arg, "--format=", 9) == 0) {
+        if (strcmp(arg + 9, "letters") == 0) {
+            options->format = FORMAT_LETTERS;
+        } else if (strcmp(arg + 9, "bin") == 0) {
+            options->format = FORMAT_BINARY;
+        } else {
+            fprintf(errors, "Error: Unknown object format '%s' (use letters or bin).\n", arg + 9);
+            return -1;
+        }
+    } else if (strncmp(arg, "--output-dir=", 13) == 0 && arg[13] != '\0') {
+        options->output_dir = arg + 13;
+    } else if (strncmp(arg, "--max-errors=", 13) == 0) {
+        return set_max_errors(arg + 13, options, errors) ? 1 : -1;
+    } else if (strncmp(arg, "--file-threads=", 15) == 0) {
+        return set_file_threads(arg + 15, options, errors) ? 1 : -1;
+    } else if (strncmp(arg, "--mem-limit=", 12) == 0) {
+        return set_mem_limit(arg + 12, options, errors) ? 1 : -1;
+    } else if (strcmp(arg, "--quiet") == 0 || strcmp(arg, "-q") == 0) {
+        options->quiet = 1;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * SET_MAX_ERRORS - Check and store the N of --max-errors
+ * Returns: 1 if it is a number in range, 0 if not (the message goes to errors)
+ */
+static int set_max_errors(const char *count_text, assembler_options_t *options, FILE *errors) {
+    char *end;
+    long count;
+
+    count = strtol(count_text, &end, 10);
+    if (*count_text == '\0' || *end != '\0' || count < 1 || count > MAX_ERRORS_LIMIT) {
+        fprintf(errors, "Error: Invalid error limit '%s' (must be 1-%d).\n", count_text, MAX_ERRORS_LIMIT);
+        return 0;
+    }
+    options->max_errors = (int)count;
+    return 1;
+}
+
+/*
+ * SET_FILE_THREADS - Check and store the N of --file-threads
+ * Returns: 1 if it is a number in range, 0 if not (the message goes to errors)
+ */
+static int set_file_threads(const char *count_text, assembler_options_t *options, FILE *errors) {
+    char *end;
+    long count;
+
+    count = strtol(count_text, &end, 10);
+    if (*count_text == '\0' || *end != '\0' || count < 1 || count > MAX_JOBS) {
+        fprintf(errors, "Error: Invalid thread count '%s' (must be 1-%d).\n", count_text, MAX_JOBS);
+        return 0;
+    }
+    options->file_threads = (int)count;
+    return 1;
+}
+
+/*
+ * SET_MEM_LIMIT - Check and store the N of --mem-limit
+ * Returns: 1 if it is a size parse_memory_size understands, 0 if not (the message goes to errors)
+ */
+static int set_mem_limit(const char *size_text, assembler_options_t *options, FILE *errors) {
+    if (!parse_memory_size(size_text, &options->mem_limit)) {
+        fprintf(errors, "Error: Invalid memory limit '%s' (bytes, or a number with K, M or G).\n", size_text);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * PARSE_OPTIONS - Read the command line flags that come before the file names
+ *
+ * Everything parse_file_option knows, plus:
+ * -j N (or -jN) sets how many files we assemble at the same time,
+ * --cache-dir DIR (or --cache-dir=DIR) keeps the outputs of every file in DIR so
+ * unchanged files don't have to be assembled again,
+ * --output-dir DIR, --max-errors N, --file-threads N and --mem-limit N with the value as the next argument,
+ * --stats (or --stats=text / --stats=json) prints times and counters for every file,
+ * --async-write writes the output files on a background thread (see writer.c), and
+ * --fsync also fsyncs them before the run ends (it turns on --async-write),
+ * --server reads the files to assemble from stdin instead (see server.c),
+ * --link OUT (or --link=OUT) links all the files into one program OUT (see link.c),
+ * --bench (or --bench=SPEC) runs the built-in benchmark instead (see bench.c),
+ * --golden DIR (or --golden=DIR) checks the samples' outputs against DIR instead (see golden.c), and
+ * --fuzz (or --fuzz=SPEC) feeds broken lines to the parsers instead (see fuzz.c).
+ * Everything from the first non-flag argument on is a file name.
+ * Returns: 1 if the options are fine, 0 if something was wrong (usage gets printed)
+ */
+int parse_options(int argc, char *argv[], assembler_options_t *options, int *first_file) {
+    int i = 1;
+    int handled;
+
+    options->jobs = 1;  /* Default: one file at a time, like before */
+    options->file_threads = 1;  /* Default: each file's second pass on one thread */
+    options->keep_am = 0;  /* Default: expand in memory, no .am file */
+    options->format = FORMAT_LETTERS;  /* Default: the base-4 letter .ob file */
+    options->cache_dir = NULL;  /* Default: no cache */
+    options->output_dir = NULL; /* Default: outputs next to the .as file */
+    options->server = 0;        /* Default: the files are on the command line */
+    options->link = NULL;       /* Default: every file gets its own outputs */
+    options->bench = NULL;      /* Default: assemble the files */
+    options->golden = NULL;
+    options->fuzz = NULL;
+    options->timing = 0;
+    options->stats = STATS_OFF;  /* Default: no stats */
+    options->quiet = 0;
+    options->max_errors = 0;     /* Default: print every error */
+    options->mem_limit = 0;      /* Default: no memory budget */
+    options->one_pass = 0;       /* Default: the classic two passes */
+    options->async_write = 0;    /* Default: stage 4 writes the files itself */
+    options->sync_outputs = 0;
+    options->writer = NULL;      /* Started by main if async_write is set */
+
+    while (i < argc && argv[i][0] == '-') {
+        handled = parse_file_option(argv[i], options, stderr);
+        if (handled < 0) {
+            return 0;
+        }
+        if (handled) {
+            i++;  /* --keep-am, --format=... and the other per-file options */
+            continue;
+        }
+
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            options->stats = STATS_TEXT;
+            options->timing = 1;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            options->stats = STATS_JSON;
+            options->timing = 1;
+        } else if (strcmp(argv[i], "--max-errors") == 0) {
+            /* --max-errors N form - the count is the next argument */
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --max-errors needs a number.\n");
+                return 0;
+            }
+            if (!set_max_errors(argv[++i], options, stderr)) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--file-threads") == 0) {
+            /* --file-threads N form - the count is the next argument */
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --file-threads needs a number of threads.\n");
+                return 0;
+            }
+            if (!set_file_threads(argv[++i], options, stderr)) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--mem-limit") == 0) {
+            /* --mem-limit N form - the size is the next argument */
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --mem-limit needs a size.\n");
+                return 0;
+            }
+            if (!set_mem_limit(argv[++i], options, stderr)) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--output-dir") == 0) {
+            /* --output-dir DIR form - the directory is the next argument */
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --output-dir needs a directory.\n");
+                return 0;
+            }
+            options->output_dir = argv[++i];
+        } else if (strcmp(argv[i], "--async-write") == 0) {
+            options->async_write = 1;
+        } else if (strcmp(argv[i], "--fsync") == 0) {
+            options->sync_outputs = 1;
+            options->async_write = 1;  /* The writer thread is what syncs them */
+        } else if (strcmp(argv[i], "--server") == 0) {
+            options->server = 1;
+        } else if (strcmp(argv[i], "--link") == 0) {
+            /* --link OUT form - the linked program's name is the next argument */
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --link needs a name for the linked program.\n");
+                return 0;
+            }
+            options->link = argv[++i];
+        } else if (strncmp(argv[i], "--link=", 7) == 0 && argv[i][7] != '\0') {
+            options->link = argv[i] + 7;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            options->bench = "";  /* All the default sizes */
+        } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+            options->bench = argv[i] + 8;
+        } else if (strcmp(argv[i], "--golden") == 0) {
+            /* --golden DIR form - the directory is the next argument */
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --golden needs a directory.\n");
+                return 0;
+            }
+            options->golden = argv[++i];
+        } else if (strncmp(argv[i], "--golden=", 9) == 0 && argv[i][9] != '\0') {
+            options->golden = argv[i] + 9;
+        } else if (strcmp(argv[i], "--fuzz") == 0) {
+            options->fuzz = "";  /* All the default settings */
+        } else if (strncmp(argv[i], "--fuzz=", 7) == 0) {
+            options->fuzz = argv[i] + 7;
+        } else if (strcmp(argv[i], "--cache-dir") == 0) {
+            /* --cache-dir DIR form - the directory is the next argument */
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --cache-dir needs a directory.\n");
+                return 0;
+            }
+            options->cache_dir = argv[++i];
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0 && argv[i][12] != '\0') {
+            options->cache_dir = argv[i] + 12;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *count_text = argv[i] + 2;  /* -jN form */
+            char *end;
+            long jobs;
+
+            if (*count_text == '\0') {
+                /* -j N form - the count is the next argument */
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Error: -j needs a number of jobs.\n");
+                    return 0;
+                }
+                count_text = argv[++i];
+            }
+
+            jobs = strtol(count_text, &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+                fprintf(stderr, "Error: Invalid job count '%s' (must be 1-%d).\n", count_text, MAX_JOBS);
+                return 0;
+            }
+            options->jobs = (int)jobs;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[i]);
+            return 0;
+        }
+        i++;
+    }
+
+    if (options->link && options->server) {
+        fprintf(stderr, "Error: --link can't be used with --server.\n");
+        return 0;
+    }
+
+    *first_file = i;
+    return 1;
+}
+
+/*
+ * ASSEMBLE_SERIAL - Process the files one after another
+ *
+ * This is the original behaviour: one context, messages go straight to
+ * stdout/stderr, and the context is reset between files.
+ * With --stats each file's numbers are printed after it and added to totals.
+ * With --async-write a file's outputs are written while the next file is
+ * assembled, and it only counts once they are (see outputs_written).
+ * Returns: number of files that were assembled successfully
+ */
+int assemble_serial(const assembler_options_t *options, char *files[], int file_count, assembler_stats_t *totals) {
+    assembler_context_t *ctx;
+    assembler_stats_t file_stats;
+    int success_count = 0;
+    int queued = -1;               /* Writer id of the previous file's outputs (-1: none waiting) */
+    const char *queued_name = NULL;
+    error_code_t result;
     int i;
-    int success_count = 0;    /* Counter for how many files processed successfully */
-    int total_files = argc - 1;  /* Total files to process (argv[0] is program name) */
+
+    /* One context, reused for every file (reset_context keeps its buffers) */
+    ctx = malloc(sizeof(assembler_context_t));
+    if (!ctx) {
+        fprintf(stderr, "Error: Memory allocation failed for assembler context.\n");
+        return 0;
+    }
+    init_context(ctx, options, stdout, stderr);
+
+    for (i = 0; i < file_count; i++) {
+        result = process_single_file(ctx, files[i]);
+        if (result == SUCCESS) {
+            success_count++;  /* Count successful files */
+        }
+        if (!outputs_written(options, queued, queued_name)) {
+            success_count--;  /* The previous file was counted, but its outputs are not there */
+        }
+        queued = result == SUCCESS ? ctx->writer_file : -1;
+        queued_name = files[i];
+        if (options->stats != STATS_OFF) {
+            stats_collect(ctx, &file_stats);
+            stats_print(stdout, files[i], &file_stats, options->stats);
+            stats_add(totals, &file_stats);
+        }
+        if (!options->quiet) {
+            printf("\n"); /* Add blank line between files for cleaner output */
+        }
+    }
+    if (!outputs_written(options, queued, queued_name)) {
+        success_count--;
+    }
+
+    /* Clean up whatever the last file left behind */
+    free_context(ctx);
+    free(ctx);
+    return success_count;
+}
+
+#ifndef NO_THREADS
+
+/* One file waiting to be assembled (or already assembled) by the worker pool */
+typedef struct {
+    const char *filename;  /* Base name from the command line */
+    FILE *out;             /* Buffered stdout messages for this file */
+    FILE *err;             /* Buffered stderr messages for this file */
+    error_code_t result;   /* What process_single_file returned */
+    int writer_file;       /* Its outputs' writer id, still to be waited for (--async-write) */
+    assembler_stats_t stats; /* What the file cost (with --stats) */
+    int done;              /* Set by the worker when out/err are complete */
+} assembly_job_t;
+
+/* State shared between the main thread and all the workers */
+typedef struct {
+    const assembler_options_t *options;
+    assembly_job_t *jobs;
+    int job_count;
+    int next_job;            /* Index of the next job nobody has taken yet */
+    pthread_mutex_t lock;    /* Protects next_job and every job's done flag */
+    pthread_cond_t job_done; /* Signalled each time a worker finishes a job */
+} job_queue_t;
+
+/*
+ * COPY_BUFFERED_OUTPUT - Send a job's buffered messages to the real stream
+ *
+ * The worker wrote into a temporary file, so now I rewind it and copy it over
+ * in one piece. This is what keeps messages from two files from mixing.
+ */
+static void copy_buffered_output(FILE *buffer, FILE *destination) {
+    char chunk[4096];
+    size_t count;
+
+    if (!buffer) {
+        return;
+    }
+
+    rewind(buffer);
+    while ((count = fread(chunk, 1, sizeof(chunk), buffer)) > 0) {
+        fwrite(chunk, 1, count, destination);
+    }
+    fclose(buffer);
+}
+
+/*
+ * ASSEMBLY_WORKER - Thread function: keep taking jobs until the queue is empty
+ *
+ * Each worker has its own context (reused for all its jobs, like serial mode), so
+ * the workers never share any assembler state. The only shared things are the
+ * queue counter and the done flags, both under the lock.
+ */
+static void *assembly_worker(void *arg) {
+    job_queue_t *queue = (job_queue_t *)arg;
+    assembler_context_t *ctx;
+
+    ctx = malloc(sizeof(assembler_context_t));
+    if (ctx) {
+        init_context(ctx, queue->options, NULL, NULL);
+    }
+
+    for (;;) {
+        assembly_job_t *job;
+        int index;
+
+        pthread_mutex_lock(&queue->lock);
+        index = queue->next_job++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->job_count) {
+            break;  /* Nothing left to do */
+        }
+        job = &queue->jobs[index];
+
+        /* Messages go into temporary files until the main thread prints them in order */
+        job->out = tmpfile();
+        job->err = tmpfile();
+        if (!ctx || !job->out || !job->err) {
+            job->result = ERROR_MEMORY_ALLOCATION;
+        } else {
+            ctx->out = job->out;
+            ctx->err = job->err;
+            job->result = process_single_file(ctx, job->filename);
+            job->writer_file = ctx->writer_file;
+            if (queue->options->stats != STATS_OFF) {
+                stats_collect(ctx, &job->stats);
+                stats_print(job->out, job->filename, &job->stats, queue->options->stats);
+            }
+            if (!queue->options->quiet) {
+                fprintf(job->out, "\n"); /* Same blank line the serial mode prints */
+            }
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&queue->job_done);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (ctx) {
+        free_context(ctx);
+        free(ctx);
+    }
+    return NULL;
+}
+
+/*
+ * ASSEMBLE_PARALLEL - Process the files on a pool of worker threads (-j N)
+ *
+ * Workers finish in any order, but the main thread prints each file's buffered
+ * messages in command line order, so the output looks the same as serial mode.
+ * The stage times in the --stats totals are added up over all the workers, so
+ * they can be more than the time the whole run took.
+ * Returns: number of files that were assembled successfully
+ */
+int assemble_parallel(const assembler_options_t *options, char *files[], int file_count, assembler_stats_t *totals) {
+    job_queue_t queue;
+    pthread_t *threads;
+    int thread_count = options->jobs;
+    int started = 0;
+    int success_count = 0;
+    int i;
+
+    if (thread_count > file_count) {
+        thread_count = file_count;  /* No point starting threads with nothing to do */
+    }
+
+    queue.options = options;
+    queue.job_count = file_count;
+    queue.next_job = 0;
+    queue.jobs = calloc(file_count, sizeof(assembly_job_t));
+    threads = malloc(thread_count * sizeof(pthread_t));
+    if (!queue.jobs || !threads) {
+        fprintf(stderr, "Error: Memory allocation failed for job queue.\n");
+        free(queue.jobs);
+        free(threads);
+        return 0;
+    }
+    for (i = 0; i < file_count; i++) {
+        queue.jobs[i].filename = files[i];
+    }
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.job_done, NULL);
+
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, assembly_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        /* Could not start any thread - just do the work on this one */
+        assembly_worker(&queue);
+    }
+
+    /* Print every file's messages in order, waiting for each one to finish */
+    for (i = 0; i < file_count; i++) {
+        assembly_job_t *job = &queue.jobs[i];
+
+        pthread_mutex_lock(&queue.lock);
+        while (!job->done) {
+            pthread_cond_wait(&queue.job_done, &queue.lock);
+        }
+        pthread_mutex_unlock(&queue.lock);
+
+        copy_buffered_output(job->out, stdout);
+        copy_buffered_output(job->err, stderr);
+        stats_add(totals, &job->stats);  /* All zeros without --stats */
+        if (job->result == SUCCESS && outputs_written(options, job->writer_file, job->filename)) {
+            success_count++;  /* The worker is on to its next file while we wait */
+        } else if (!job->out || !job->err) {
+            fprintf(stderr, "Error: Could not buffer output for '%s'.\n", job->filename);
+        }
+        fflush(stdout);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&queue.job_done);
+    pthread_mutex_destroy(&queue.lock);
+    free(threads);
+    free(queue.jobs);
+    return success_count;
+}
+
+#endif /* NO_THREADS */
+
+int main(int argc, char *argv[]) {
+    assembler_options_t options;
+    int first_file;
+    int success_count;
+    int total_files;
+    assembler_stats_t totals;  /* --stats for all the files together */
+    int linked = 1;            /* Stays 1 without --link */
+    int write_failures;        /* Files whose outputs failed to sync after they were counted (--fsync) */
+
+    /* Read -j and friends before the file names */
+    if (!parse_options(argc, argv, &options, &first_file)) {
+        fprintf(stderr, "Usage: %s [-j N] [--file-threads N] [--keep-am] [--one-pass] [--format=letters|bin] [--cache-dir DIR] [--stats[=text|json]] [--async-write] [--fsync] [--quiet] [--max-errors N] [--mem-limit N] [--output-dir DIR] [--server] [--link OUT] [--bench[=SPEC]] [--golden DIR] [--fuzz[=SPEC]] <file1> [file2] ... (without .as extension)\n", argv[0]);
+        return 1;
+    }
+    total_files = argc - first_file;
+
+    /* --bench makes its own input, and --golden and --fuzz have theirs, so they need no file names */
+    if (options.bench) {
+        return run_benchmark(&options);
+    }
+    if (options.golden) {
+        return run_golden(&options);
+    }
+    if (options.fuzz) {
+        return run_fuzz(&options);
+    }
+    
+    /* --server gets the file names from stdin instead */
+    if (options.server) {
+        return run_server(&options);
+    }
 
     /* Check if user gave us at least one filename */
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file1> [file2] ... (without .as extension)\n", argv[0]);
+    if (total_files < 1) {
+        fprintf(stderr, "Usage: %s [-j N] [--file-threads N] [--keep-am] [--one-pass] [--format=letters|bin] [--cache-dir DIR] [--stats[=text|json]] [--async-write] [--fsync] [--quiet] [--max-errors N] [--mem-limit N] [--output-dir DIR] [--server] [--link OUT] [--bench[=SPEC]] [--golden DIR] [--fuzz[=SPEC]] <file1> [file2] ... (without .as extension)\n", argv[0]);
         return 1;
     }
 
-    /* Process each file the user gave us */
-    for (i = 1; i < argc; i++) {
-        if (process_single_file(argv[i]) == SUCCESS) {
-            success_count++;  /* Count successful files */
+    memset(&totals, 0, sizeof(totals));
+    
+    /* --async-write: stage 4 only queues the outputs, this thread writes them */
+    if (options.async_write) {
+#ifndef NO_THREADS
+        options.writer = writer_start(options.sync_outputs);
+        if (!options.writer) {
+            fprintf(stderr, "Warning: Could not start the writer thread, writing the output files directly.\n");
         }
-        printf("\n"); /* Add blank line between files for cleaner output */
+#else
+        fprintf(stderr, "Warning: Built without thread support, ignoring --async-write and --fsync.\n");
+#endif
     }
     
-    /* Clean up the last filename we stored */
-    if (current_filename) {
-        free(current_filename);
-        current_filename = NULL;
+    /* Process the files - on worker threads if -j asked for more than one job */
+    if (options.link) {
+        /* --link: the files are modules of one program (link.c) */
+        success_count = link_modules(&options, argv + first_file, total_files, &totals, &linked);
+    } else {
+#ifndef NO_THREADS
+        if (options.jobs > 1 && total_files > 1) {
+            success_count = assemble_parallel(&options, argv + first_file, total_files, &totals);
+        } else {
+            success_count = assemble_serial(&options, argv + first_file, total_files, &totals);
+        }
+#else
+        if (options.jobs > 1) {
+            fprintf(stderr, "Warning: Built without thread support, ignoring -j.\n");
+        }
+        if (options.file_threads > 1) {
+            fprintf(stderr, "Warning: Built without thread support, ignoring --file-threads.\n");
+        }
+        success_count = assemble_serial(&options, argv + first_file, total_files, &totals);
+#endif
     }
 
+    /* Everything queued is on disk (and synced with --fsync) before the summary */
+    write_failures = writer_finish(options.writer, stderr);
+
     /* Show summary of what happened */
     printf("Processing complete: %d/%d files successful.\n", success_count, total_files);
-    
+    if (options.stats != STATS_OFF) {
+        stats_print(stdout, NULL, &totals, options.stats);
+    }
+
     /* Return 0 if all files succeeded, 1 if any failed - this is standard Unix convention */
-    return (success_count == total_files) ? 0 : 1;
-}
\ No newline at end of file
+    return (success_count == total_files && linked && write_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+/*
+ * MEMORY MODULE - Tracked allocation for the context's tables
+ *
+ * Every table that grows while a file is assembled (macros, symbols, line
+ * records, images...) is allocated through here instead of calling
+ * malloc/realloc directly. Each allocation says what kind of table it is
+ * for, and the context keeps how many bytes each kind holds right now and
+ * the most it held since the last reset_context:
+ *
+ *   temp = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->external_references,
+ *                         old_capacity * sizeof(external_ref_t),
+ *                         new_capacity * sizeof(external_ref_t));
+ *
+ * The tables already know their capacity, so the caller passes the old size
+ * and nothing has to be stored next to the memory. The arena counts its own
+ * blocks (arena.bytes), and they are added to MEMORY_OTHER.
+ *
+ * With --mem-limit N a request that would take the context over N bytes is
+ * refused like a failed malloc, so every caller already handles it. The
+ * first refusal is reported as an error for the file, the passes stop at
+ * that line (limit_reached) and the file fails. MEMORY_OTHER (the arena,
+ * messages, long lines) is counted but never refused, so that error can
+ * always be reported.
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "diagnostics.h"
+#include "memory.h"
+
+/* Names for the kinds, in the order of memory_kind_t */
+static const char *kind_names[MEMORY_KINDS] = {
+    "macros", "symbols", "records", "images", "other"
+};
+
+/* The error for each kind - report_error keeps the pointer, so these are literals */
+static const char *limit_messages[MEMORY_KINDS] = {
+    "Over the --mem-limit budget while storing the macros",
+    "Over the --mem-limit budget while growing the symbol table",
+    "Over the --mem-limit budget while storing the parsed lines",
+    "Over the --mem-limit budget while building the code and data images",
+    "Over the --mem-limit budget"
+};
+
+static void memory_add(assembler_context_t *ctx, memory_kind_t kind, long bytes);
+
+/*
+ * MEMORY_ALLOC - malloc size bytes for a table of the given kind
+ * Returns: the memory, or NULL if there is none (or it is over --mem-limit)
+ */
+void *memory_alloc(assembler_context_t *ctx, memory_kind_t kind, size_t size) {
+    void *memory;
+
+    if (!memory_allowed(ctx, kind, 0, size)) {
+        return NULL;
+    }
+    COUNT_ALLOCATION(ctx);
+    memory = malloc(size);
+    if (memory) {
+        memory_add(ctx, kind, (long)size);
+    }
+    return memory;
+}
+
+/*
+ * MEMORY_REALLOC - realloc a table from old_size to new_size bytes
+ * Returns: the moved memory, or NULL (then pointer is still valid, like realloc)
+ */
+void *memory_realloc(assembler_context_t *ctx, memory_kind_t kind, void *pointer, size_t old_size, size_t new_size) {
+    void *memory;
+
+    if (!memory_allowed(ctx, kind, old_size, new_size)) {
+        return NULL;
+    }
+    COUNT_ALLOCATION(ctx);
+    memory = realloc(pointer, new_size);
+    if (memory) {
+        memory_add(ctx, kind, (long)new_size - (long)old_size);
+    }
+    return memory;
+}
+
+/*
+ * MEMORY_FREE - free a table that was size bytes (NULL is fine)
+ */
+void memory_free(assembler_context_t *ctx, memory_kind_t kind, void *pointer, size_t size) {
+    if (pointer) {
+        free(pointer);
+        memory_add(ctx, kind, -(long)size);
+    }
+}
+
+/*
+ * MEMORY_RELEASE - Stop counting size bytes that somebody else frees
+ * (an output buffer handed to the writer thread)
+ */
+void memory_release(assembler_context_t *ctx, memory_kind_t kind, size_t size) {
+    memory_add(ctx, kind, -(long)size);
+}
+
+/*
+ * MEMORY_RESET_PEAKS - Start the peaks of a new file at what is held now
+ * (reset_context keeps the tables' memory for the next file)
+ */
+void memory_reset_peaks(assembler_context_t *ctx) {
+    memory_usage_t *memory = &ctx->memory;
+    int kind;
+
+    for (kind = 0; kind < MEMORY_KINDS; kind++) {
+        memory->peak[kind] = memory->used[kind];
+    }
+    memory->peak[MEMORY_OTHER] += ctx->arena.bytes;
+    memory->peak_total = memory->total + ctx->arena.bytes;
+    memory->limit_reached = 0;
+}
+
+/*
+ * MEMORY_PEAKS - The peaks of the file so far, with the arena as it is now
+ *
+ * The arena doesn't tell us when it grows, so its blocks are only picked up
+ * here and on the next tracked allocation.
+ */
+void memory_peaks(const assembler_context_t *ctx, long peaks[], long *peak_total) {
+    const memory_usage_t *memory = &ctx->memory;
+    int kind;
+
+    for (kind = 0; kind < MEMORY_KINDS; kind++) {
+        peaks[kind] = memory->peak[kind];
+    }
+    if (peaks[MEMORY_OTHER] < memory->used[MEMORY_OTHER] + ctx->arena.bytes) {
+        peaks[MEMORY_OTHER] = memory->used[MEMORY_OTHER] + ctx->arena.bytes;
+    }
+    *peak_total = memory->peak_total;
+    if (*peak_total < memory->total + ctx->arena.bytes) {
+        *peak_total = memory->total + ctx->arena.bytes;
+    }
+}
+
+/*
+ * MEMORY_KIND_NAME - Printable name of a kind ("symbols")
+ */
+const char *memory_kind_name(memory_kind_t kind) {
+    return kind_names[kind];
+}
+
+/*
+ * PARSE_MEMORY_SIZE - Read a byte count like "500000", "64K", "512M" or "2G"
+ * Returns: 1 if it is a positive size that fits in a long, 0 if not
+ */
+int parse_memory_size(const char *text, long *bytes) {
+    long unit = 1;
+    long value = 0;
+    const char *p = text;
+
+    if (*p < '0' || *p > '9') {
+        return 0;
+    }
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (value > (0x7FFFFFFFL - (*p - '0')) / 10) {
+            return 0;  /* Too big for any long */
+        }
+        value = value * 10 + (*p - '0');
+    }
+    if (*p == 'K' || *p == 'k') {
+        unit = 1024L;
+    } else if (*p == 'M' || *p == 'm') {
+        unit = 1024L * 1024;
+    } else if (*p == 'G' || *p == 'g') {
+        unit = 1024L * 1024 * 1024;
+    }
+    if (unit > 1) {
+        p++;
+    }
+    if (*p != '\0' || value == 0 || value > 0x7FFFFFFFL / unit) {
+        return 0;
+    }
+    *bytes = value * unit;
+    return 1;
+}
+
+/*
+ * MEMORY_ALLOWED - Check a growth from old_size to new_size against --mem-limit
+ *
+ * The arena counts too, so a file with huge macros can't get around the
+ * limit by keeping them there. The first refusal of a file is reported and
+ * marks the file as failed. memory_alloc and memory_realloc call this, so it
+ * is only needed to check several allocations at once, before the first one.
+ * Returns: 1 if it may go ahead, 0 if not
+ */
+int memory_allowed(assembler_context_t *ctx, memory_kind_t kind, size_t old_size, size_t new_size) {
+    long limit = ctx->options->mem_limit;
+
+    if (limit == 0 || kind == MEMORY_OTHER || new_size <= old_size ||
+        ctx->memory.total + ctx->arena.bytes + (long)(new_size - old_size) <= limit) {
+        return 1;
+    }
+    if (!ctx->memory.limit_reached) {
+        ctx->memory.limit_reached = 1;
+        report_error(ctx, 0, 0, ERROR_MEMORY_ALLOCATION, limit_messages[kind]);
+    }
+    ctx->error_flag = 1;  /* Whatever needed the memory is missing, so no output */
+    return 0;
+}
+
+/*
+ * MEMORY_ADD - Count bytes (negative when freed) for a kind and update the peaks
+ */
+static void memory_add(assembler_context_t *ctx, memory_kind_t kind, long bytes) {
+    memory_usage_t *memory = &ctx->memory;
+    long other = memory->used[MEMORY_OTHER] + ctx->arena.bytes;
+
+    memory->used[kind] += bytes;
+    memory->total += bytes;
+    if (memory->used[kind] + (kind == MEMORY_OTHER ? ctx->arena.bytes : 0) > memory->peak[kind]) {
+        memory->peak[kind] = memory->used[kind] + (kind == MEMORY_OTHER ? ctx->arena.bytes : 0);
+    }
+    if (other > memory->peak[MEMORY_OTHER]) {
+        memory->peak[MEMORY_OTHER] = other;  /* The arena may have grown since the last call */
+    }
+    if (memory->total + ctx->arena.bytes > memory->peak_total) {
+        memory->peak_total = memory->total + ctx->arena.bytes;
+    }
+}
@@ -0,0 +1,13 @@
+/* Tracked memory - bytes per kind of table, and the --mem-limit budget */
+/* Simple header - no includes needed */
+
+/* Function declarations */
+void *memory_alloc(assembler_context_t *ctx, memory_kind_t kind, size_t size);
+void *memory_realloc(assembler_context_t *ctx, memory_kind_t kind, void *pointer, size_t old_size, size_t new_size);
+void memory_free(assembler_context_t *ctx, memory_kind_t kind, void *pointer, size_t size);
+void memory_release(assembler_context_t *ctx, memory_kind_t kind, size_t size);
+int memory_allowed(assembler_context_t *ctx, memory_kind_t kind, size_t old_size, size_t new_size);
+void memory_reset_peaks(assembler_context_t *ctx);
+void memory_peaks(const assembler_context_t *ctx, long peaks[], long *peak_total);
+const char *memory_kind_name(memory_kind_t kind);
+int parse_memory_size(const char *text, long *bytes);
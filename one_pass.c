@@ -0,0 +1,153 @@
+/*
+ * ONE PASS MODULE - Assemble with a single pass and backpatching (--one-pass)
+ *
+ * Normally the first pass only works out sizes and addresses, and the second
+ * pass walks the saved line records again to write the words. In one pass
+ * mode every instruction is encoded the moment the first pass has parsed it:
+ * - operands that don't use a label (immediates, registers) are final at once
+ * - a label that is already defined as a code label is final too (its
+ *   address will never change, and add_symbol refuses a later .extern of it)
+ * - everything else gets a placeholder word and a fixup: forward references,
+ *   data labels (their address depends on the final code size) and externals
+ *
+ * When the last line is in, the code size is final and with it the address of
+ * every data label, so one_pass_end just walks the fixups once and fills in
+ * the addresses. The fixups are in code order, so the externals are recorded in
+ * exactly the same order as the second pass would record them, and the output
+ * files are byte for byte the same.
+ *
+ * Example: "jmp END" on line 3, "END: stop" on line 9
+ *   line 3: words "jmp" + 0, fixup {address 101, "END"}
+ *   line 9: END = 120
+ *   end:    word 101 = 120, relocatable
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "diagnostics.h"
+#include "first_pass.h"
+#include "memory.h"
+#include "one_pass.h"
+#include "second_pass.h"
+
+#define FIXUP_INITIAL_CAPACITY 64
+#define CODE_INITIAL_CAPACITY 256    /* Words - the code segment doubles from here */
+
+/*
+ * ONE_PASS_ENCODE - Encode one parsed instruction right now
+ *
+ * Called by the first pass instead of saving a line record. The code image
+ * grows as we go (it doubles, so the copying stays linear), and IC moves on
+ * by instruction_length just like in the normal first pass.
+ */
+error_code_t one_pass_encode(assembler_context_t *ctx, const line_record_t *record, int instruction_length) {
+    int needed = ctx->IC - INITIAL_IC + instruction_length;
+    int start = ctx->IC;
+    int capacity;
+    error_code_t result;
+    
+    if (needed > ctx->code.capacity) {
+        capacity = ctx->code.capacity ? ctx->code.capacity * 2 : CODE_INITIAL_CAPACITY;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        if (segment_reserve(ctx, &ctx->code, capacity) != SUCCESS) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+    }
+    ctx->code.count = needed;
+    
+    result = encode_instruction(ctx, record);  /* Writes the words and moves IC */
+    ctx->IC = start + instruction_length;      /* Same IC as the normal first pass, even on errors */
+    return result;
+}
+
+/*
+ * ADD_FIXUP - Remember an operand word whose address is not known yet
+ */
+error_code_t add_fixup(assembler_context_t *ctx, const parsed_operand_t *operand, int address, int line_number) {
+    fixup_t *fixup;
+    fixup_t *temp;
+    int new_capacity;
+    
+    if (ctx->fixup_count >= ctx->fixup_capacity) {
+        new_capacity = ctx->fixup_capacity ? ctx->fixup_capacity * 2 : FIXUP_INITIAL_CAPACITY;
+        temp = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->fixups, ctx->fixup_capacity * sizeof(fixup_t),
+                              new_capacity * sizeof(fixup_t));
+        if (!temp) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+        ctx->fixups = temp;
+        ctx->fixup_capacity = new_capacity;
+    }
+    
+    fixup = &ctx->fixups[ctx->fixup_count++];
+    fixup->address = address;
+    fixup->symbol = operand->symbol;
+    fixup->label = operand->label;
+    fixup->line_number = line_number;
+    return SUCCESS;
+}
+
+/*
+ * ONE_PASS_END - Patch the fixups and finish the images (instead of second_pass)
+ *
+ * Runs after first_pass_end. Setting code.count to the final size first makes
+ * symbol_address() give every label its final address.
+ * The data image is just data_values (the first pass stored them in DC order).
+ * The only records the first pass kept in this mode are the .entry lines.
+ * Returns: SUCCESS, or ERROR_INVALID_SYNTAX if a label was never defined
+ */
+error_code_t one_pass_end(assembler_context_t *ctx) {
+    const fixup_t *fixup;
+    int symbol;
+    int data_words = ctx->DC - INITIAL_DC;
+    int i;
+    
+    if (segment_reserve(ctx, &ctx->data, data_words) != SUCCESS) {
+        report_error(ctx, 0, 0, ERROR_MEMORY_ALLOCATION, "Not enough memory for the program");
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    ctx->code.count = ctx->IC - INITIAL_IC;
+    ctx->data.count = data_words;
+    for (i = 0; i < data_words; i++) {
+        ctx->data.words[i].value = ctx->data_values[i];
+        ctx->data.words[i].are = ARE_ABSOLUTE;
+    }
+    
+    /* The one linear patch loop */
+    for (i = 0; i < ctx->fixup_count; i++) {
+        fixup = &ctx->fixups[i];
+        symbol = fixup->symbol >= 0 ? find_symbol(ctx, ctx->name_pool + fixup->symbol) : NO_SYMBOL;
+        if (symbol == NO_SYMBOL) {
+            report_error(ctx, fixup->line_number, 0, ERROR_UNDEFINED_LABEL, "Undefined symbol");
+            ctx->error_flag = 1;
+        } else if (ctx->symbol_flags[symbol] & SYMBOL_EXTERNAL) {
+            /* External symbol - linker will resolve this */
+            encode_word(ctx, fixup->address, 0, ARE_EXTERNAL);
+            if (add_external_reference(ctx, symbol, fixup->label, fixup->address) != SUCCESS) {
+                return ERROR_MEMORY_ALLOCATION;
+            }
+        } else {
+            encode_word(ctx, fixup->address, symbol_address(ctx, symbol), ARE_RELOCATABLE);
+        }
+    }
+    
+    /* .entry lines - the only records this mode keeps */
+    for (i = 0; i < ctx->line_record_count; i++) {
+        if (encode_directive(ctx, &ctx->line_records[i]) != SUCCESS) {
+            ctx->error_flag = 1;
+        }
+    }
+    
+    return ctx->error_flag ? ERROR_INVALID_SYNTAX : SUCCESS;
+}
+
+/*
+ * FREE_FIXUPS - Give back the fixup list
+ */
+void free_fixups(assembler_context_t *ctx) {
+    memory_free(ctx, MEMORY_SYMBOLS, ctx->fixups, ctx->fixup_capacity * sizeof(fixup_t));
+    ctx->fixups = NULL;
+    ctx->fixup_count = 0;
+    ctx->fixup_capacity = 0;
+}
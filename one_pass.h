@@ -0,0 +1,16 @@
+/* One pass assembly (--one-pass) - encode right away, patch labels at the end */
+/* Simple header - no includes needed */
+
+/* An operand word that still needs a symbol's address */
+typedef struct fixup {
+    int address;                     /* Instruction address of the word (IC) */
+    int symbol;                      /* name_pool offset of the symbol name, -1 if none */
+    int label;                       /* name_pool offset of the operand text (for .ext) */
+    int line_number;                 /* Source line, for error messages */
+} fixup_t;
+
+/* Function declarations */
+error_code_t one_pass_encode(assembler_context_t *ctx, const line_record_t *record, int instruction_length);
+error_code_t add_fixup(assembler_context_t *ctx, const parsed_operand_t *operand, int address, int line_number);
+error_code_t one_pass_end(assembler_context_t *ctx);
+void free_fixups(assembler_context_t *ctx);
@@ -24,238 +24,363 @@
  * Addresses 151-200: Data (.data and .string values)
  */
 
+/* pthreads needs the POSIX declarations, which -ansi hides by default */
+#ifndef NO_THREADS
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#endif
+
 #include "assembler.h"  /* Must include this first for basic types */
-#include "first_pass.h" /* Need symbol_t and symbol table functions */
+#include "arena.h"
+#include "diagnostics.h"
+#include "first_pass.h" /* Need the symbol table functions */
+#include "memory.h"
+#include "one_pass.h"
 #include "second_pass.h"
 #include "utils.h"
+#include "writer.h"
+
+#define OB_STREAM_BUFFER 65536       /* Bytes of .ob text collected before each fwrite */
+
+/* The .ob file while the second pass writes it (see OBJECT STREAM below) */
+typedef struct {
+    FILE *file;                      /* The .part file, NULL when not streaming */
+    char *filename;                  /* The .ob name it gets at the end */
+    char *part_filename;             /* Where it is written until then */
+    char *buffer;                    /* OB_STREAM_BUFFER bytes */
+    char *out;                       /* Next free byte in buffer */
+    int emitted;                     /* Code words already in the buffer (or the file) */
+    int failed;                      /* A write went wrong - the .part file is dropped */
+} object_stream_t;
+
+static int stream_open(assembler_context_t *ctx, object_stream_t *stream, const char *base_name);
+static void stream_code(assembler_context_t *ctx, object_stream_t *stream);
+static int stream_close(assembler_context_t *ctx, object_stream_t *stream, int keep);
+
+#ifndef NO_THREADS
+#define PARALLEL_MIN_RECORDS 4096    /* Fewer records per thread are not worth a thread */
+
+/* One slice of the line records and the thread that encodes it (see PARALLEL SECOND PASS) */
+typedef struct {
+    assembler_context_t worker;      /* Copy of the file's context, with its own externals */
+    int first;                       /* First record of the slice */
+    int end;                         /* One past its last record */
+    int failed;                      /* Some line of the slice had an error */
+    int started;                     /* Runs on its own thread (else on the caller's) */
+    pthread_t thread;
+} pass_chunk_t;
 
-/* Global memory arrays - these store the final machine code */
-word_t instruction_memory[MEMORY_SIZE];  /* Stores encoded instructions */
-word_t data_memory[MEMORY_SIZE];         /* Stores data values */
-external_ref_t *external_references = NULL; /* List of external symbol uses */
+static int parallel_second_pass(assembler_context_t *ctx, int threads);
+static void *encode_chunk(void *arg);
+static int merge_chunk(assembler_context_t *ctx, pass_chunk_t *chunk, memory_usage_t *held);
+#endif
 
 /*
  * SECOND_PASS - Main function for the second pass
  * 
  * Similar structure to first pass, but now we actually generate machine code.
- * We reset IC and DC to their starting values and process the file again,
- * this time encoding everything into our memory arrays.
+ * We reset IC and DC to their starting values and walk the line records the
+ * first pass saved, this time encoding everything into our memory arrays.
+ * The source file is not read again.
+ * 
+ * The final IC and DC of the first pass are exactly how many words each
+ * image needs, so both segments are sized once here, before any word is written.
+ * 
+ * With an object_base, the .ob file is written while we go: after each
+ * instruction its words are final, so they are formatted right away and go
+ * out whenever the buffer is full. The data words follow at the end.
+ * ctx->object_streamed says if that worked (then stage 4 skips the .ob).
+ * 
+ * With --file-threads N a big file is encoded on up to N threads instead
+ * (see PARALLEL SECOND PASS below), and the .ob is streamed once they are done.
  */
-error_code_t second_pass(const char *filename) {
-    FILE *file;
-    char line[MAX_LINE_LENGTH];
-    int line_number = 0;
+error_code_t second_pass(assembler_context_t *ctx, const char *object_base) {
+    int i;
     error_code_t result;
+    int code_words = ctx->IC - INITIAL_IC;
+    int data_words = ctx->DC - INITIAL_DC;
+    object_stream_t stream;
+    int streaming;
+#ifndef NO_THREADS
+    int threads = ctx->options->file_threads;
+#endif
     
-    /* Reset counters to starting values (same as first pass) */
-    IC = INITIAL_IC;  /* Start at 100 */
-    DC = INITIAL_DC;  /* Start at 0 */
+    if (segment_reserve(ctx, &ctx->code, code_words) != SUCCESS ||
+        segment_reserve(ctx, &ctx->data, data_words) != SUCCESS) {
+        report_error(ctx, 0, 0, ERROR_MEMORY_ALLOCATION, "Not enough memory for the program");
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    ctx->code.count = code_words;
+    ctx->data.count = data_words;
     
-    file = fopen(filename, "r");
-    if (!file) {
-        return ERROR_FILE_NOT_FOUND;
+    /* Words an erroneous line does not write stay 0 */
+    if (code_words > 0) {
+        memset(ctx->code.words, 0, code_words * sizeof(word_t));
+    }
+    if (data_words > 0) {
+        memset(ctx->data.words, 0, data_words * sizeof(word_t));
     }
     
-    /* Process each line again, but this time generate machine code */
-    while (fgets(line, sizeof(line), file)) {
-        line_number++;
-        
-        /* Remove newline character */
-        line[strcspn(line, "\n")] = 0;
-        
-        /* Process this line */
-        result = process_line_second_pass(line, line_number);
-        if (result != SUCCESS) {
-            print_error(current_filename, line_number, "Error in second pass");
-            error_flag = 1;
+    /* The header needs the counts, and the first pass already has them */
+    ctx->object_streamed = 0;
+    streaming = object_base && stream_open(ctx, &stream, object_base);
+    
+#ifndef NO_THREADS
+    if (threads > ctx->line_record_count / PARALLEL_MIN_RECORDS) {
+        threads = ctx->line_record_count / PARALLEL_MIN_RECORDS;
+    }
+    if (threads > 1 && parallel_second_pass(ctx, threads)) {
+        ctx->IC = INITIAL_IC + code_words;  /* Where the serial loop would have left them */
+        ctx->DC = INITIAL_DC + data_words;
+        if (streaming) {
+            stream_code(ctx, &stream);
+            ctx->object_streamed = stream_close(ctx, &stream, ctx->error_flag == 0);
+        }
+        return ctx->error_flag ? ERROR_INVALID_SYNTAX : SUCCESS;
+    }
+    if (threads > 1) {
+        /* The threads found an error (or could not run) - start over, one line at a time */
+        if (code_words > 0) {
+            memset(ctx->code.words, 0, code_words * sizeof(word_t));
+        }
+        if (data_words > 0) {
+            memset(ctx->data.words, 0, data_words * sizeof(word_t));
         }
     }
+#endif
+    
+    /* Reset counters to starting values (same as first pass) */
+    ctx->IC = INITIAL_IC;  /* Start at 100 */
+    ctx->DC = INITIAL_DC;  /* Start at 0 */
     
-    fclose(file);
+    /* Process each record, and this time generate machine code */
+    for (i = 0; i < ctx->line_record_count; i++) {
+        result = process_line_second_pass(ctx, &ctx->line_records[i]);
+        if (result != SUCCESS) {
+            report_line_failed(ctx, ctx->line_records[i].line_number, result, "Error in second pass");
+            ctx->error_flag = 1;
+            if (ctx->memory.limit_reached) {
+                break;  /* Over --mem-limit - the rest of the lines would fail the same way */
+            }
+        }
+        if (streaming && ctx->line_records[i].kind == LINE_INSTRUCTION) {
+            stream_code(ctx, &stream);
+        }
+    }
     
-    return error_flag ? ERROR_INVALID_SYNTAX : SUCCESS;
+    if (streaming) {
+        ctx->object_streamed = stream_close(ctx, &stream, ctx->error_flag == 0);
+    }
+    return ctx->error_flag ? ERROR_INVALID_SYNTAX : SUCCESS;
 }
 
+#ifndef NO_THREADS
 /*
- * PROCESS_LINE_SECOND_PASS - Process a single line during second pass
+ * PARALLEL SECOND PASS (--file-threads N)
+ * 
+ * After the first pass every label has its address and every record knows
+ * where its words go (record->address), so the records don't depend on each
+ * other any more: they are cut into one slice per thread, and each thread
+ * encodes its slice into its own part of the code and data images.
+ * 
+ * The rest of the context is only read - except the counters, the stats,
+ * the external references and the errors. So each thread works on a copy
+ * of the context with its own copies of those, and they are put back
+ * together in slice order at the end. That is the order the serial loop
+ * finds the external references in, so the .ext file comes out the same.
  * 
- * Very similar to first pass, but now we encode instead of just validating.
- * We skip the label extraction since labels are already in our symbol table.
+ * .entry records only change symbol flags, which the other threads read,
+ * so they are done here afterwards, in order. If any line has an error,
+ * the threads' work is thrown away and the caller runs the whole pass
+ * again one line at a time - that is the only way to get exactly the same
+ * messages as without threads, and a file with errors is written anyway.
+ * Returns: 1 if the program is encoded, 0 if the caller has to do it
  */
-error_code_t process_line_second_pass(char *line, int line_number) {
-    char *line_ptr;
-    char *trimmed;
-    char *line_copy = NULL;
-    int word_count;
-    char **words;
-    error_code_t result = SUCCESS;
+static int parallel_second_pass(assembler_context_t *ctx, int threads) {
+    pass_chunk_t *chunks;
+    pass_chunk_t *chunk;
+    memory_usage_t held;  /* What the threads held together at most (see merge_chunk) */
+    error_code_t result;
+    int encoded = 1;
+    int i;
+    int kind;
     
-    /* Skip empty lines and comments - nothing to encode */
-    if (is_empty_line(line) || is_comment_line(line)) {
-        return SUCCESS;
+    chunks = memory_alloc(ctx, MEMORY_OTHER, threads * sizeof(pass_chunk_t));
+    if (!chunks) {
+        return 0;  /* Not enough memory for threads - the serial loop does it */
     }
-    
-    /*
-     * EXTRACT LABEL (but don't process it)
-     * Labels were already added to symbol table in first pass.
-     * We extract them here just to clean the line for instruction processing.
-     * Example: "MAIN: mov r1, r2" → extract "MAIN", process "mov r1, r2"
-     */
-    extract_label(line, &line_ptr);  /* We don't need to store the label */
-    /*
-     * CLEAN UP THE LINE
-     * After removing the label, we need to trim whitespace and split into words.
-     * This gives us an array of words like ["mov", "r1", "r2"] that we can process.
-     */
-    
-    /* Make a copy since trim_whitespace modifies the string */
-    {
-        int len = strlen(line_ptr);
-        line_copy = malloc(len + 1);
-        strcpy(line_copy, line_ptr);
-        trimmed = trim_whitespace(line_copy);
+    held = ctx->memory;
+    for (kind = 0; kind < MEMORY_KINDS; kind++) {
+        held.peak[kind] = held.used[kind];
     }
+    held.peak_total = held.total;
     
-    /* Split the line into individual words (tokens) */
-    {
-        char *trimmed_copy = malloc(strlen(trimmed) + 1);
-        strcpy(trimmed_copy, trimmed);
-        words = split_line(trimmed_copy, &word_count);
-        free(trimmed_copy);
+    for (i = 0; i < threads; i++) {
+        chunk = &chunks[i];
+        chunk->worker = *ctx;
+        chunk->first = (int)((long)ctx->line_record_count * i / threads);
+        chunk->end = (int)((long)ctx->line_record_count * (i + 1) / threads);
+        chunk->failed = 0;
+        memset(&chunk->worker.stats, 0, sizeof(assembler_stats_t));
+        chunk->worker.external_references = NULL;
+        chunk->worker.external_reference_count = 0;
+        chunk->worker.external_reference_capacity = 0;
+        chunk->worker.diagnostics = NULL;
+        chunk->worker.diagnostic_count = 0;
+        chunk->worker.diagnostic_capacity = 0;
+        chunk->worker.diagnostic_errors = 0;
+        chunk->worker.diagnostics_dropped = 0;
+        chunk->worker.diagnostic_text = NULL;
+        chunk->worker.diagnostic_text_capacity = 0;
+        chunk->worker.memory = held;  /* Its peaks start at what is held now */
+        
+        /* The first slice runs on this thread, and so does any slice that got no thread */
+        chunk->started = i > 0 && pthread_create(&chunk->thread, NULL, encode_chunk, chunk) == 0;
+    }
+    for (i = 0; i < threads; i++) {
+        if (!chunks[i].started) {
+            encode_chunk(&chunks[i]);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        if (chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
+        }
+        if (chunks[i].failed) {
+            encoded = 0;
+        }
     }
     
-    /* Nothing to process if line is empty after cleanup */
-    if (word_count == 0) {
-        free_split_line(words, word_count);
-        return SUCCESS;
+    /* Put the slices back together, in order */
+    for (i = 0; i < threads; i++) {
+        if (encoded && !merge_chunk(ctx, &chunks[i], &held)) {
+            encoded = 0;
+        }
+        free(chunks[i].worker.external_references);
+        free_diagnostics(&chunks[i].worker);
     }
+    memory_free(ctx, MEMORY_OTHER, chunks, threads * sizeof(pass_chunk_t));
     
-    /*
-     * DETERMINE LINE TYPE AND ENCODE APPROPRIATELY
-     * 
-     * Instructions: Convert to machine code (mov, add, jmp, etc.)
-     * Directives: Process data storage (.data, .string, .entry, etc.)
-     * 
-     * At this point we know exactly what each line contains and can
-     * generate the appropriate machine code or data values.
-     */
-    if (is_instruction(words[0])) {
-        /* Convert assembly instruction to binary machine code */
-        result = encode_instruction_from_parts(words, word_count);
-    } else if (is_directive(words[0])) {
-        /* Process assembler directives (.data, .string, etc.) */
-        result = encode_directive(trimmed);
+    if (!encoded) {
+        ctx->external_reference_count = 0;  /* The serial loop finds them again */
+        return 0;
     }
-    /* If it's neither instruction nor directive, it's probably an error or comment */
     
-    free_split_line(words, word_count);
-    if (line_copy) {
-        free(line_copy);
+    for (i = 0; i < ctx->line_record_count; i++) {
+        if (ctx->line_records[i].kind != LINE_ENTRY) {
+            continue;
+        }
+        result = encode_directive(ctx, &ctx->line_records[i]);
+        if (result != SUCCESS) {
+            report_line_failed(ctx, ctx->line_records[i].line_number, result, "Error in second pass");
+            ctx->error_flag = 1;
+        }
     }
-    return result;
+    return 1;
 }
 
 /*
- * ENCODE_INSTRUCTION - Convert an assembly instruction to machine code
- * 
- * This is the heart of the assembler! It takes an instruction like "mov r1, r2"
- * and converts it to the binary format that the CPU understands.
+ * ENCODE_CHUNK - Thread function: encode the instructions and data of one slice
  * 
- * Instruction encoding format (12 bits):
- * Bits 11-8: Opcode (which instruction: mov=0, add=2, etc.)
- * Bits 7-6:  Source operand type (immediate=0, direct=1, indirect=2, register=3)
- * Bits 5-4:   Destination operand type
- * Bits 3-2:   Source register (if source is register)
- * Bits 1-0:   Destination register (if dest is register)
- * 
- * Additional words may follow for:
- * - Immediate values (#5)
- * - Label addresses (LOOP)
- * - Register numbers (when not both registers)
+ * The counters are set from each record, so the slice can start anywhere.
+ * It stops at the first line with an error (the pass is redone anyway).
  */
-error_code_t encode_instruction(char *line) {
-    char *trimmed = trim_whitespace(line);
-    char **parts;
-    int part_count;
-    instruction_info_t *inst_info;
-    opcode_t opcode;
-    /* C90: Declare all variables at beginning */
-    unsigned int first_word;
-    operand_type_t src_type, dest_type;
-    
-    /*
-     * Parse the instruction line into its components.
-     * Expected format: [label:] opcode [operand1] [operand2]
-     * 
-     * For C programming students: This demonstrates string parsing,
-     * where we break apart a complex input into manageable pieces.
-     */
-    parts = split_line(trimmed, &part_count);
+static void *encode_chunk(void *arg) {
+    pass_chunk_t *chunk = arg;
+    assembler_context_t *worker = &chunk->worker;
+    const line_record_t *record;
+    int i;
     
-    if (part_count == 0) {
-        free_split_line(parts, part_count);
-        return ERROR_INVALID_SYNTAX;
+    for (i = chunk->first; i < chunk->end; i++) {
+        record = &worker->line_records[i];
+        if (record->kind == LINE_INSTRUCTION) {
+            worker->IC = record->address;
+        } else if (record->kind == LINE_DATA) {
+            worker->DC = record->address;
+        } else {
+            continue;  /* .entry - done after all the slices */
+        }
+        if (process_line_second_pass(worker, record) != SUCCESS) {
+            chunk->failed = 1;
+            break;
+        }
     }
+    return NULL;
+}
+
+/*
+ * MERGE_CHUNK - Add one slice's external references, counters and memory to the context
+ *
+ * The threads ran at the same time, so their peaks add up: held starts at
+ * what the context held before they started, every worker adds what it
+ * held on top of that at its peak, and the context's peaks are raised to
+ * the sum (its own allocations during the pass were the workers').
+ * Returns: 1 if it worked, 0 if there was no memory for the references
+ */
+static int merge_chunk(assembler_context_t *ctx, pass_chunk_t *chunk, memory_usage_t *held) {
+    const assembler_context_t *worker = &chunk->worker;
+    int needed = ctx->external_reference_count + worker->external_reference_count;
+    int new_capacity;
+    external_ref_t *temp;
+    int kind;
     
-    /* Get instruction information */
-    inst_info = get_instruction_info(parts[0]);
-    if (!inst_info) {
-        free_split_line(parts, part_count);
-        return ERROR_INVALID_INSTRUCTION;
+    for (kind = 0; kind < MEMORY_KINDS; kind++) {
+        held->peak[kind] += worker->memory.peak[kind] - held->used[kind];
+        if (ctx->memory.peak[kind] < held->peak[kind]) {
+            ctx->memory.peak[kind] = held->peak[kind];
+        }
+    }
+    held->peak_total += worker->memory.peak_total - held->total;
+    if (ctx->memory.peak_total < held->peak_total) {
+        ctx->memory.peak_total = held->peak_total;
     }
     
-    opcode = inst_info->opcode;
-    
-    /*
-     * ENCODE FIRST WORD (Instruction Word)
-     * This word contains the opcode and operand type information
-     * 10-bit format: opcode(4) | src(2) | dst(2) | ARE(2)
-     */
-    first_word = 0;  /* Now assign after declaration */
-    first_word |= (opcode << 6);  /* Bits 9-6: opcode (4 bits) */
+    if (needed > ctx->external_reference_capacity) {
+        new_capacity = ctx->external_reference_capacity ? ctx->external_reference_capacity : 64;
+        while (new_capacity < needed) {
+            new_capacity *= 2;
+        }
+        temp = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->external_references,
+                              ctx->external_reference_capacity * sizeof(external_ref_t),
+                              new_capacity * sizeof(external_ref_t));
+        if (!temp) {
+            return 0;
+        }
+        ctx->external_references = temp;
+        ctx->external_reference_capacity = new_capacity;
+    }
+    if (worker->external_reference_count > 0) {
+        memcpy(ctx->external_references + ctx->external_reference_count, worker->external_references,
+               worker->external_reference_count * sizeof(external_ref_t));
+    }
+    ctx->external_reference_count = needed;
     
-    /* Handle operands based on instruction type */
-    if (inst_info->operand_count == 2) {
-        /*
-         * TWO OPERAND INSTRUCTION (like "mov r1, r2")
-         * Need to encode both source and destination operand types
-         */
-        src_type = get_operand_type(parts[1]);
-        dest_type = get_operand_type(parts[2]);
-        
-        first_word |= (src_type << 4);   /* Bits 5-4: source operand type */
-        first_word |= (dest_type << 2);  /* Bits 3-2: destination operand type */
-        
-        /* Store the first word */
-        encode_word(IC++, first_word, ARE_ABSOLUTE);
-        
-        /* Encode additional words for source and destination operands */
-        encode_operand_word(parts[1], src_type);
-        encode_operand_word(parts[2], dest_type);
-    } else if (inst_info->operand_count == 1) {
-        /*
-         * ONE OPERAND INSTRUCTION (like "inc r1")
-         * Only need to encode destination operand type
-         */
-        dest_type = get_operand_type(parts[1]);
-        first_word |= (dest_type << 2);  /* Bits 3-2: destination operand type */
-        
-        /* Store the first word */
-        encode_word(IC++, first_word, ARE_ABSOLUTE);
+    ctx->stats.symbol_lookups += worker->stats.symbol_lookups;
+    ctx->stats.symbol_probes += worker->stats.symbol_probes;
+    ctx->stats.allocations += worker->stats.allocations;
+    return 1;
+}
+#endif
 
-        /* Encode the operand's additional word if needed */
-        encode_operand_word(parts[1], dest_type);
-    } else if (inst_info->operand_count == 0) {
-        /* Zero operand instructions (rts, hlt) need no additional encoding */
-        encode_word(IC++, first_word, ARE_ABSOLUTE);
+/*
+ * PROCESS_LINE_SECOND_PASS - Process a single line record during second pass
+ * 
+ * The first pass already split the line and worked out what it is, so here
+ * we just hand the record to the right encoder:
+ * - Instructions: Convert to machine code (mov, add, jmp, etc.)
+ * - Directives: Store data values or mark entries
+ */
+error_code_t process_line_second_pass(assembler_context_t *ctx, const line_record_t *record) {
+    if (record->kind == LINE_INSTRUCTION) {
+        /* Convert assembly instruction to binary machine code */
+        return encode_instruction(ctx, record);
     }
-    
-    free_split_line(parts, part_count);
-    return SUCCESS;
+    /* Process assembler directives (.data, .string, .entry, etc.) */
+    return encode_directive(ctx, record);
 }
 
 /*
- * ENCODE_INSTRUCTION_FROM_PARTS - Convert assembly instruction to machine code
+ * ENCODE_INSTRUCTION - Convert assembly instruction to machine code
  * 
  * This is the heart of the assembler! Here we convert human-readable
  * assembly instructions like "mov r1, r2" into binary machine code.
@@ -272,71 +397,53 @@ error_code_t encode_instruction(char *line) {
  * 2 (INDIRECT): M1[r2][r7] - matrix with register indexing
  * 3 (REGISTER): r1 - CPU register
  * 
+ * The first pass already looked the instruction word up in encoding_table
+ * (utils.c), so here it is just copied out of the record.
+ * 
  * WORD GENERATION EXAMPLES:
  * - "stop" → 1 word (just instruction)
  * - "mov r1, r2" → 2 words (instruction + packed registers)
  * - "mov M1[r2][r7], LENGTH" → 4 words (instruction + matrix base + matrix index + destination)
  */
-error_code_t encode_instruction_from_parts(char **parts, int part_count) {
-    instruction_info_t *inst_info;
-    opcode_t opcode;
+error_code_t encode_instruction(assembler_context_t *ctx, const line_record_t *record) {
     /* C90: Declare all variables at beginning of function */
     unsigned int first_word;
-    operand_type_t src_type, dest_type;
-    int operand_index;
+    const parsed_operand_t *src;
+    const parsed_operand_t *dest;
     int value; /* For register-register optimization */
-    
-    /* Basic validation */
-    if (part_count == 0) {
-        return ERROR_INVALID_SYNTAX;
-    }
-    
-    /* Look up instruction info (opcode, operand count, etc.) */
-    inst_info = get_instruction_info(parts[0]);
-    if (!inst_info) {
-        return ERROR_INVALID_INSTRUCTION;
-    }
-    
-    opcode = inst_info->opcode;
+    error_code_t result = SUCCESS;
     
     /*
-     * BUILD THE FIRST WORD (Main Instruction Word)
+     * THE FIRST WORD (Main Instruction Word)
      * This word contains the opcode and operand type information.
      * It's always generated, regardless of operand count.
      */
-    first_word = 0;
-    first_word |= (opcode << 6);  /* Put opcode in bits 9-6 */
+    first_word = record->encoding->first_word;
     
     /*
      * HANDLE DIFFERENT OPERAND CONFIGURATIONS
      * Each configuration requires different word generation patterns.
      */
-    if (inst_info->operand_count == 0) {
+    if (record->operand_count == 0) {
         /* No operands (like "stop") - just encode the instruction word */
-        encode_word(IC++, first_word, ARE_ABSOLUTE);
-    } else if (inst_info->operand_count == 1) {
+        encode_word(ctx, ctx->IC++, first_word, ARE_ABSOLUTE);
+    } else if (record->operand_count == 1) {
         /* Single operand instruction (like "jmp LABEL" or "inc r1") */
-        operand_index = 1;
-        dest_type = get_operand_type(parts[operand_index]);
-        first_word |= (dest_type << 2);  /* Put operand type in bits 3-2 */
+        dest = &record->operands[0];
         
         /* Generate the instruction word */
-        encode_word(IC++, first_word, ARE_ABSOLUTE);
+        encode_word(ctx, ctx->IC++, first_word, ARE_ABSOLUTE);
         
         /* Generate additional word for the operand */
-        encode_operand_word(parts[operand_index], dest_type);
+        result = encode_operand_word(ctx, dest, record->line_number);
         
-    } else if (inst_info->operand_count == 2) {
+    } else if (record->operand_count == 2) {
         /* Two operand instructions (like "mov r1, r2" or "add M1[r2][r7], LENGTH") */
-        src_type = get_operand_type(parts[1]);
-        dest_type = get_operand_type(parts[2]);
-        
-        /* Put both operand types in the instruction word */
-        first_word |= (src_type << 4);   /* Source type in bits 5-4 */
-        first_word |= (dest_type << 2);  /* Destination type in bits 3-2 */
+        src = &record->operands[0];
+        dest = &record->operands[1];
         
         /* Generate the main instruction word */
-        encode_word(IC++, first_word, ARE_ABSOLUTE);
+        encode_word(ctx, ctx->IC++, first_word, ARE_ABSOLUTE);
         
         /*
          * REGISTER-REGISTER OPTIMIZATION
@@ -344,17 +451,14 @@ error_code_t encode_instruction_from_parts(char **parts, int part_count) {
          * instead of generating two separate operand words.
          * This saves memory space: "mov r1, r2" → 2 words instead of 3
          */
-        if (src_type == REGISTER && dest_type == REGISTER) {
-            int src_reg = get_register_number(parts[1]);
-            int dest_reg = get_register_number(parts[2]);
-            
-            if (src_reg == -1 || dest_reg == -1) {
+        if (src->type == REGISTER && dest->type == REGISTER) {
+            if (src->value == -1 || dest->value == -1) {
                 return ERROR_INVALID_OPERAND;
             }
             
             /* Pack both register numbers into one word */
-            value = (src_reg << 6) | (dest_reg << 3);
-            encode_word(IC++, value, ARE_ABSOLUTE);
+            value = (src->value << 6) | (dest->value << 3);
+            encode_word(ctx, ctx->IC++, value, ARE_ABSOLUTE);
             
         } else {
             /*
@@ -364,12 +468,14 @@ error_code_t encode_instruction_from_parts(char **parts, int part_count) {
              * - "mov LABEL, r2" → address + register  
              * - "mov M1[r2][r7], LENGTH" → matrix addressing + address
              */
-            encode_operand_word(parts[1], src_type);
-            encode_operand_word(parts[2], dest_type);
+            result = encode_operand_word(ctx, src, record->line_number);
+            if (encode_operand_word(ctx, dest, record->line_number) != SUCCESS) {
+                result = ERROR_UNDEFINED_LABEL;
+            }
         }
     }
     
-    return SUCCESS;
+    return result;
 }
 
 /*
@@ -387,89 +493,58 @@ error_code_t encode_instruction_from_parts(char **parts, int part_count) {
  * - RELOCATABLE: Add program base address (for internal symbols)
  * - EXTERNAL: Resolve from other files (for external symbols)
  */
-error_code_t encode_operand_word(char *operand_str, operand_type_t type) {
-    int value;
-    symbol_t *symbol;
+error_code_t encode_operand_word(assembler_context_t *ctx, const parsed_operand_t *operand, int line_number) {
+    int symbol = NO_SYMBOL;
 
-    switch (type) {
+    switch (operand->type) {
         case IMMEDIATE:
-            /* IMMEDIATE VALUES: #5, #-10, etc.
-             * Skip the '#' character and convert to integer.
+        case REGISTER:
+            /* IMMEDIATE VALUES (#5, #-10) and REGISTERS (r0-r7).
+             * The first pass already converted them to a number.
              * These are absolute values that don't need relocation.
              */
-            value = string_to_int(operand_str + 1);
-            encode_word(IC++, value, ARE_ABSOLUTE);
+            encode_word(ctx, ctx->IC++, operand->value, ARE_ABSOLUTE);
             break;
             
         case DIRECT:
+        case INDIRECT:
             /* DIRECT ADDRESSING: LABEL, VARIABLE, etc.
+             * MATRIX ADDRESSING: M1[r2][r7], ARRAY[r1][r3], etc.
              * Look up the symbol in our symbol table and use its address.
              * May be external (resolved by linker) or internal (add base address).
              */
-            {
-                char *symbol_name = parse_matrix_operand(operand_str);
-                symbol = find_symbol(symbol_name);
+            if (operand->symbol >= 0) {
+                symbol = find_symbol(ctx, ctx->name_pool + operand->symbol);
             }
-            if (symbol) {
-                if (symbol->is_external) {
-                    /* External symbol - linker will resolve this */
-                    encode_word(IC, 0, ARE_EXTERNAL);
-                    add_external_reference(operand_str, IC);
-                } else {
-                    /* Internal symbol - loader will add base address */
-                    encode_word(IC, symbol->address, ARE_RELOCATABLE);
+            if (ctx->options->one_pass && (symbol == NO_SYMBOL || (ctx->symbol_flags[symbol] & (SYMBOL_EXTERNAL | SYMBOL_DATA)))) {
+                /* One pass (one_pass.c): the address is not final yet - patched at the end */
+                if (add_fixup(ctx, operand, ctx->IC, line_number) != SUCCESS) {
+                    return ERROR_MEMORY_ALLOCATION;
                 }
-                IC++;
-            } else {
-                print_error(current_filename, 0, "Undefined symbol");
+                encode_word(ctx, ctx->IC, 0, ARE_ABSOLUTE);
+            } else if (symbol == NO_SYMBOL) {
+                report_error(ctx, line_number, 0, ERROR_UNDEFINED_LABEL, "Undefined symbol");
                 return ERROR_UNDEFINED_LABEL;
-            }
-            break;
-            
-        case INDIRECT:
-            /* MATRIX ADDRESSING: M1[r2][r7], ARRAY[r1][r3], etc.
-             * This is complex addressing that requires TWO additional words:
-             * 1. Base address of the matrix/array
-             * 2. Index calculation information
-             * This is why matrix instructions generate more words!
-             */
-            {
-                char *symbol_name = parse_matrix_operand(operand_str);
-                symbol = find_symbol(symbol_name);
-            }
-            if (symbol) {
-                /* First word: base address of the matrix */
-                if (symbol->is_external) {
-                    encode_word(IC, 0, ARE_EXTERNAL);
-                    add_external_reference(operand_str, IC);
-                } else {
-                    encode_word(IC, symbol->address, ARE_RELOCATABLE);
-                }
-                IC++;
-                
-                /*
-                 * Second word: Index register information
-                 * Matrix addressing like M1[r2][r7] needs additional computation
-                 * at runtime to calculate the final memory address.
-                 * This placeholder word would contain index calculation data.
-                 */
-                if (strstr(operand_str, "[") && strstr(operand_str, "]")) {
-                    /* Generate the additional word for matrix indexing */
-                    encode_word(IC++, 0, ARE_ABSOLUTE);
+            } else if (ctx->symbol_flags[symbol] & SYMBOL_EXTERNAL) {
+                /* External symbol - linker will resolve this */
+                encode_word(ctx, ctx->IC, 0, ARE_EXTERNAL);
+                if (add_external_reference(ctx, symbol, operand->label, ctx->IC) != SUCCESS) {
+                    return ERROR_MEMORY_ALLOCATION;
                 }
             } else {
-                print_error(current_filename, 0, "Undefined symbol");
-                return ERROR_UNDEFINED_LABEL;
+                /* Internal symbol - loader will add base address */
+                encode_word(ctx, ctx->IC, symbol_address(ctx, symbol), ARE_RELOCATABLE);
             }
-            break;
+            ctx->IC++;
             
-        case REGISTER:
-            /* REGISTER ADDRESSING: r0, r1, r2, ..., r7
-             * Simply store the register number (0-7).
-             * These are absolute values that don't need relocation.
+            /*
+             * Matrix addressing like M1[r2][r7] needs a second word with the
+             * index registers, packed like a register pair: row register
+             * where the source goes, column register where the destination goes.
              */
-            value = get_register_number(operand_str);
-            encode_word(IC++, value, ARE_ABSOLUTE);
+            if (operand->has_index) {
+                encode_word(ctx, ctx->IC++, (operand->row_register << 6) | (operand->column_register << 3), ARE_ABSOLUTE);
+            }
             break;
             
         default:
@@ -483,143 +558,36 @@ error_code_t encode_operand_word(char *operand_str, operand_type_t type) {
  * ENCODE_DIRECTIVE - Process assembler directives during second pass
  * 
  * Directives don't generate instructions, but some generate data.
- * - .data: Store integer values in data memory
- * - .string: Store string characters in data memory  
+ * - .data/.string/.mat: Copy the values the first pass saved into data memory
  * - .entry: Mark symbols as entry points
- * - .extern: Already handled in first pass
+ * - .extern: Already handled in first pass (no record)
  */
-error_code_t encode_directive(char *line) {
-    char *trimmed = trim_whitespace(line);
-    char **parts;
-    int part_count;
-    error_code_t result = SUCCESS;
+error_code_t encode_directive(assembler_context_t *ctx, const line_record_t *record) {
+    int symbol;
     int i;
-    char *str;
-    int len;
 
-    /*
-     * Parse the directive line.
-     * Directives are assembly commands that tell the assembler to do something
-     * special, like allocate data storage or define strings.
-     * 
-     * Common directives:
-     * .data - Store numeric values
-     * .string - Store text strings  
-     * .matrix - Store 2D arrays
-     */
-    parts = split_line(trimmed, &part_count);
-    if (part_count == 0) {
-        free_split_line(parts, part_count);
-        return SUCCESS;
-    }
-
-    if (strcmp(parts[0], ".data") == 0) {
-        /* Process each data value - parts[1], parts[2], etc. are the values */
-        for (i = 1; i < part_count; i++) {
-            /* Each part might contain comma-separated values */
-            char *temp_str = malloc(strlen(parts[i]) + 1);
-            char *token;
-            strcpy(temp_str, parts[i]);
-            token = strtok(temp_str, ",");
-            while (token) {
-                /* Trim whitespace from token */
-                while (*token == ' ' || *token == '\t') token++;
-                if (strlen(token) > 0) {
-                    /*
-                     * Convert string representation of number to integer.
-                     * Store in data memory with absolute addressing mode.
-                     * This is how we convert assembly ".data 5,10,15" 
-                     * into actual memory values.
-                     */
-                    int value = string_to_int(token);
-                    data_memory[DC].value = value;
-                    data_memory[DC].are = ARE_ABSOLUTE;
-                    DC++;  /* Move to next data memory location */
-                }
-                token = strtok(NULL, ",");
-            }
-            free(temp_str);
-        }
-    } else if (strcmp(parts[0], ".string") == 0) {
-        if (part_count > 1) {
-            /*
-             * STRING PROCESSING
-             * 
-             * Strings in assembly are enclosed in quotes: .string "hello"
-             * We need to:
-             * 1. Remove the quote marks  
-             * 2. Store each character as a separate memory word
-             * 3. Add a null terminator (ASCII 0) at the end
-             * 
-             * This is how C strings work in memory!
-             */
-            str = parts[1];
-            len = strlen(str);
-            
-            /* Accept both regular quotes (") and Unicode quotes */
-            if ((str[0] == '"' && str[len - 1] == '"') || 
-                ((unsigned char)str[0] >= 128 && (unsigned char)str[len-1] >= 128)) {
-                
-                /* Skip the opening and closing quote marks */
-                int start_offset = (str[0] == '"') ? 1 : 3;
-                int end_offset = (str[len-1] == '"') ? 1 : 3;
-                
-                /* Store each character in data memory */
-                for (i = start_offset; i < len - end_offset; i++) {
-                    data_memory[DC].value = str[i];      /* ASCII value of character */
-                    data_memory[DC].are = ARE_ABSOLUTE;  /* Direct memory addressing */
-                    DC++;
-                }
-                
-                /* Add null terminator (this is how C knows where string ends) */
-                data_memory[DC].value = 0; 
-                data_memory[DC].are = ARE_ABSOLUTE;
-                DC++;
-            }
-        }
-    } else if (strcmp(parts[0], ".entry") == 0) {
-        if (part_count > 1) {
-            symbol_t *symbol = find_symbol(parts[1]);
-            if (symbol) {
-                symbol->is_entry = 1;
-            } else {
-                print_error(current_filename, 0, "Entry symbol not found");
-                result = ERROR_UNDEFINED_LABEL;
-            }
+    if (record->kind == LINE_DATA) {
+        /*
+         * Store each value in data memory with absolute addressing mode.
+         * This is how we convert assembly ".data 5,10,15" into actual
+         * memory values. Strings are already one value per character
+         * plus the 0 terminator, and matrices are in row-major order.
+         */
+        for (i = 0; i < record->data_count; i++) {
+            ctx->data.words[ctx->DC].value = ctx->data_values[record->data_start + i];
+            ctx->data.words[ctx->DC].are = ARE_ABSOLUTE;
+            ctx->DC++;  /* Move to next data memory location */
         }
-    } else if (strcmp(parts[0], ".extern") == 0) {
-        /* Handled in first pass */
-    } else if (strcmp(parts[0], ".mat") == 0) {
-        /* Skip the dimensions part [2][2] and process the data values */
-        for (i = 2; i < part_count; i++) { /* Data starts after .mat [dims] */
-            char *temp_str = malloc(strlen(parts[i]) + 1);
-            char *token;
-            strcpy(temp_str, parts[i]);
-            token = strtok(temp_str, ",");
-            while (token) {
-                /* Trim whitespace from token */
-                while (*token == ' ' || *token == '\t') token++;
-                if (strlen(token) > 0) {
-                    /*
-                     * MATRIX DATA STORAGE
-                     * 
-                     * Matrices are stored in row-major order in memory.
-                     * For a 2x2 matrix: [1,2][3,4] becomes: 1,2,3,4 in memory
-                     * This is the standard way C stores 2D arrays.
-                     */
-                    int value = string_to_int(token);
-                    data_memory[DC].value = value;
-                    data_memory[DC].are = ARE_ABSOLUTE;
-                    DC++;
-                }
-                token = strtok(NULL, ",");
-            }
-            free(temp_str);
+    } else if (record->kind == LINE_ENTRY) {
+        symbol = find_symbol(ctx, ctx->name_pool + record->symbol);
+        if (symbol == NO_SYMBOL) {
+            report_error(ctx, record->line_number, 0, ERROR_UNDEFINED_LABEL, "Entry symbol not found");
+            return ERROR_UNDEFINED_LABEL;
         }
+        ctx->symbol_flags[symbol] |= SYMBOL_ENTRY;
     }
 
-    free_split_line(parts, part_count);
-    return result;
+    return SUCCESS;
 }
 
 /*
@@ -627,18 +595,32 @@ error_code_t encode_directive(char *line) {
  * 
  * When we reference an external symbol, we need to remember where
  * we used it so the linker can fix it up later.
- * This creates a list of "fixup" locations.
+ * This creates a list of "fixup" locations: which symbol, the operand text
+ * for the .ext line (an offset into ctx->name_pool, so nothing is copied)
+ * and the address. The array doubles when it is full and keeps its memory
+ * for the next file.
  */
-error_code_t add_external_reference(const char *label, int address) {
-    external_ref_t *new_ref = malloc(sizeof(external_ref_t));
-    if (!new_ref) {
-        return ERROR_MEMORY_ALLOCATION;
+error_code_t add_external_reference(assembler_context_t *ctx, int symbol, int label, int address) {
+    external_ref_t *new_refs;
+    external_ref_t *ref;
+    int new_capacity;
+    
+    if (ctx->external_reference_count == ctx->external_reference_capacity) {
+        new_capacity = ctx->external_reference_capacity ? ctx->external_reference_capacity * 2 : 64;
+        new_refs = memory_realloc(ctx, MEMORY_SYMBOLS, ctx->external_references,
+                                  ctx->external_reference_capacity * sizeof(external_ref_t),
+                                  new_capacity * sizeof(external_ref_t));
+        if (!new_refs) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+        ctx->external_references = new_refs;
+        ctx->external_reference_capacity = new_capacity;
     }
     
-    strcpy(new_ref->label, label);
-    new_ref->address = address;
-    new_ref->next = external_references;
-    external_references = new_ref;
+    ref = &ctx->external_references[ctx->external_reference_count++];
+    ref->symbol = symbol;
+    ref->label = label;
+    ref->address = address;
     
     return SUCCESS;
 }
@@ -646,34 +628,93 @@ error_code_t add_external_reference(const char *label, int address) {
 /*
  * FREE_EXTERNAL_REFERENCES - Clean up external reference list
  */
-void free_external_references(void) {
-    external_ref_t *current = external_references;
-    while (current) {
-        external_ref_t *next = current->next;
-        free(current);
-        current = next;
-    }
-    external_references = NULL;
+void free_external_references(assembler_context_t *ctx) {
+    memory_free(ctx, MEMORY_SYMBOLS, ctx->external_references, ctx->external_reference_capacity * sizeof(external_ref_t));
+    ctx->external_references = NULL;
+    ctx->external_reference_count = 0;
+    ctx->external_reference_capacity = 0;
 }
 
 /*
  * ENCODE_WORD - Store a word in instruction memory
  * 
- * Each word has 12 bits of data plus 3 ARE bits.
+ * Each word has 10 bits of data plus 2 ARE bits.
  * The ARE bits tell the loader how to handle this word.
+ * 
+ * No bounds check: second_pass() sized the segment from the first pass
+ * counts, and every record encodes at most the words it was counted for.
  */
-error_code_t encode_word(int address, unsigned int value, int are) {
-    if (address >= MEMORY_SIZE) {
-        return ERROR_MEMORY_ALLOCATION;
-    }
+error_code_t encode_word(assembler_context_t *ctx, int address, unsigned int value, int are) {
+    /* Store in instruction memory (offset by INITIAL_IC) */
+    ctx->code.words[address - INITIAL_IC].value = value;
+    ctx->code.words[address - INITIAL_IC].are = are;
     
-    /* Store in instruction memory array (offset by INITIAL_IC) */
-    instruction_memory[address - INITIAL_IC].value = value;
-    instruction_memory[address - INITIAL_IC].are = are;
+    return SUCCESS;
+}
+
+/*
+ * SEGMENT_RESERVE - Make sure a segment has room for at least words words
+ * 
+ * Grows to exactly the size asked for. The memory is kept when the context
+ * is reset, so the next file only reallocates if it is bigger.
+ */
+error_code_t segment_reserve(assembler_context_t *ctx, segment_t *segment, int words) {
+    word_t *new_words;
     
+    if (words <= segment->capacity) {
+        return SUCCESS;
+    }
+    
+    new_words = memory_realloc(ctx, MEMORY_IMAGES, segment->words, segment->capacity * sizeof(word_t), words * sizeof(word_t));
+    if (!new_words) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    segment->words = new_words;
+    segment->capacity = words;
     return SUCCESS;
 }
 
+/*
+ * FREE_SEGMENTS - Give back the instruction and data images
+ */
+void free_segments(assembler_context_t *ctx) {
+    memory_free(ctx, MEMORY_IMAGES, ctx->code.words, ctx->code.capacity * sizeof(word_t));
+    memory_free(ctx, MEMORY_IMAGES, ctx->data.words, ctx->data.capacity * sizeof(word_t));
+    memset(&ctx->code, 0, sizeof(ctx->code));
+    memset(&ctx->data, 0, sizeof(ctx->data));
+}
+
+/*
+ * BASE-4 LETTER TABLE
+ * 
+ * Every 10-bit value (0-1023) written as 5 base-4 digits with a=0 b=1 c=2 d=3,
+ * most significant digit first: word_letters[36] is "aacba".
+ * The macros below just spell out all 1024 strings at compile time
+ * (W1 adds the last letter, W2 the one before it, and so on), so nothing has
+ * to be converted while writing the file - each word is one table lookup.
+ * The table is read only, so any number of threads can use it.
+ */
+#define W1(p) p "a", p "b", p "c", p "d"
+#define W2(p) W1(p "a"), W1(p "b"), W1(p "c"), W1(p "d")
+#define W3(p) W2(p "a"), W2(p "b"), W2(p "c"), W2(p "d")
+#define W4(p) W3(p "a"), W3(p "b"), W3(p "c"), W3(p "d")
+#define W5(p) W4(p "a"), W4(p "b"), W4(p "c"), W4(p "d")
+
+static const char word_letters[WORD_VALUES][LETTER_WORD_LENGTH + 1] = { W5("") };
+
+#define OB_LINE_LENGTH (LETTER_WORD_LENGTH + 2 + LETTER_WORD_LENGTH + 1)  /* "aaaaa  aaaaa\n" */
+#define OB_HEADER_MAX (LETTER_WORD_LENGTH + 1 + LETTER_WORD_LENGTH + 1)   /* "aaaaa aaaaa\n" */
+#define DECIMAL_MAX 12                                                    /* Longest int in decimal */
+
+static char *append_word(char *out, int value);
+static char *append_ob_line(char *out, int address, int value);
+static char *append_count(char *out, int value);
+static char *append_decimal(char *out, int value);
+static unsigned char *append_u16(unsigned char *out, unsigned long value);
+static unsigned char *append_u32(unsigned char *out, unsigned long value);
+static error_code_t write_output_file(assembler_context_t *ctx, const char *filename, const char *extension,
+                                      char *buffer, size_t size, size_t length, int binary);
+
 /*
  * GENERATE_OBJECT_FILE - Create the .ob output file
  * 
@@ -681,66 +722,49 @@ error_code_t encode_word(int address, unsigned int value, int are) {
  * can be loaded and executed. Format:
  * 
  * Line 1: <instruction_count> <data_count>
- * Following lines: <address> <machine_code_in_octal>
+ * Following lines: <address>  <machine_code>
+ * Everything is in our base-4 letters (see word_letters above).
  * 
  * Example:
- * 5 3
- * 0100 01234
- * 0101 05432
+ * bc c
+ * bcbba  aacba
  * ...
+ * 
+ * Every line has the same length, so I know the file size up front. The whole
+ * file is built in one buffer and written with a single fwrite.
  */
-error_code_t generate_object_file(const char *filename) {
-    FILE *file;
-    char *output_filename;
+error_code_t generate_object_file(assembler_context_t *ctx, const char *filename) {
+    char *buffer;
+    char *out;
     int i;  /* C90: Declare loop variable at beginning */
-    int final_IC = IC;
-    int final_DC = DC;
-
-    /* Create output filename */
-    output_filename = create_filename(filename, OB_EXT);
-    if (!output_filename) {
-        return ERROR_MEMORY_ALLOCATION;
-    }
+    int final_IC = ctx->IC;
+    int final_DC = ctx->DC;
+    int instruction_count = final_IC - INITIAL_IC;
+    size_t size = OB_HEADER_MAX + (size_t)(instruction_count + final_DC) * OB_LINE_LENGTH;
     
-    file = fopen(output_filename, "w");
-    if (!file) {
-        free(output_filename);
-        return ERROR_FILE_NOT_FOUND;
+    buffer = memory_alloc(ctx, MEMORY_IMAGES, size);
+    if (!buffer) {
+        return ERROR_MEMORY_ALLOCATION;
     }
+    out = buffer;
     
     /*
      * WRITE HEADER LINE
      * First line contains instruction count and data count.
      * This tells the loader how much memory to allocate for each section.
-     * Both numbers are encoded in our special base-4 format using letters a-d.
      */
-    print_specialbase(file, final_IC - INITIAL_IC);  /* Number of instruction words */
-    fprintf(file, " ");
-    print_specialbase(file, final_DC);               /* Number of data words */
-    fprintf(file, "\n");
+    out = append_count(out, instruction_count);   /* Number of instruction words */
+    *out++ = ' ';
+    out = append_count(out, final_DC);            /* Number of data words */
+    *out++ = '\n';
     
     /*
      * Write instruction memory
      * Each line: 5-letter address and 5-letter machine code word
-     * The word value: 10-bit instruction + 2-bit ARE = 12-bit total
-     * But we encode only the 10-bit instruction part as per requirements
+     * We encode only the 10-bit value part of the word (not the ARE bits)
      */
-    for (i = 0; i < final_IC - INITIAL_IC; i++) {
-        int address = INITIAL_IC + i;
-        int instruction_10bit = instruction_memory[i].value; /* 10-bit instruction word */
-        char binary_str[11]; /* 10 bits + null terminator */
-        int bit;
-        
-        /* Convert 10-bit instruction to binary string */
-        for (bit = 9; bit >= 0; bit--) {
-            binary_str[9-bit] = (instruction_10bit & (1 << bit)) ? '1' : '0';
-        }
-        binary_str[10] = '\0';
-        
-        /* Print: <5-letter address>  <5-letter machine code> */
-        fprintf(file, "%s  %s\n", 
-                encode_decimal_address_to_letters(address),
-                encode_binary10_to_letters(binary_str));
+    for (i = 0; i < instruction_count; i++) {
+        out = append_ob_line(out, INITIAL_IC + i, ctx->code.words[i].value);
     }
     
     /*
@@ -748,107 +772,260 @@ error_code_t generate_object_file(const char *filename) {
      * Data starts immediately after instructions in memory
      */
     for (i = 0; i < final_DC; i++) {
-        int address = final_IC + i;
-        int data_10bit = data_memory[i].value; /* 10-bit data word */
-        char binary_str[11]; /* 10 bits + null terminator */
-        int bit;
-        
-        /* Convert 10-bit data to binary string */
-        for (bit = 9; bit >= 0; bit--) {
-            binary_str[9-bit] = (data_10bit & (1 << bit)) ? '1' : '0';
-        }
-        binary_str[10] = '\0';
-        
-        /* Print: <5-letter address>  <5-letter data value> */
-        fprintf(file, "%s  %s\n", 
-                encode_decimal_address_to_letters(address),
-                encode_binary10_to_letters(binary_str));
+        out = append_ob_line(out, final_IC + i, ctx->data.words[i].value);
     }
     
-    fclose(file);
-    free(output_filename);
-    
-    return SUCCESS;
+    return write_output_file(ctx, filename, OB_EXT, buffer, size, out - buffer, 0);
 }
 
 /*
- * ENCODE_BINARY10_TO_LETTERS - Convert 10-bit binary string to 5-letter code
+ * OBJECT STREAM - The .ob file written during the second pass
  * 
- * Input: 10-bit binary string (e.g., "0000100100")
- * Output: 5-letter encoded string (e.g., "aacba")
+ * generate_object_file waits until the whole image is encoded and then
+ * formats all of it at once. The stream formats the code words as soon as
+ * their instruction is encoded, into a OB_STREAM_BUFFER sized buffer that is
+ * written out every time it fills up, so for a big program most of the file
+ * is already written by the time the second pass ends. The text is exactly
+ * the same as generate_object_file's.
  * 
- * Steps:
- * 1. Break into 5 pairs: 00 00 10 01 00
- * 2. Convert pairs to base-4: 0 0 2 1 0
- * 3. Map to letters: a a c b a
+ * The file is written as NAME.ob.part and only renamed to NAME.ob when the
+ * pass had no errors - otherwise it is removed, so (like before) a file with
+ * errors doesn't touch an older .ob.
  */
-char* encode_binary10_to_letters(const char* binary10) {
-    static char result[6]; /* 5 letters + null terminator */
-    char base4_chars[] = "abcd";
-    int i, j;
+
+/*
+ * STREAM_OPEN - Create the .part file and write the header
+ * Returns: 1 if we are streaming, 0 if not (then stage 4 writes the .ob as usual)
+ */
+static int stream_open(assembler_context_t *ctx, object_stream_t *stream, const char *base_name) {
+    stream->filename = create_filename(&ctx->arena, base_name, OB_EXT);
+    stream->part_filename = stream->filename ? create_filename(&ctx->arena, stream->filename, ".part") : NULL;
+    if (!stream->part_filename) {
+        return 0;
+    }
     
-    if (!binary10 || strlen(binary10) != 10) {
-        strcpy(result, "aaaaa"); /* Default fallback */
-        return result;
+    stream->buffer = memory_alloc(ctx, MEMORY_IMAGES, OB_STREAM_BUFFER);
+    if (!stream->buffer) {
+        return 0;
+    }
+    stream->file = fopen(stream->part_filename, "w");
+    if (!stream->file) {
+        memory_free(ctx, MEMORY_IMAGES, stream->buffer, OB_STREAM_BUFFER);
+        return 0;
     }
     
-    /* Process 5 pairs of bits */
-    for (i = 0; i < 5; i++) {
-        int bit_pair = 0;
-        /* Extract 2 bits starting at position i*2 */
-        for (j = 0; j < 2; j++) {
-            if (binary10[i*2 + j] == '1') {
-                bit_pair |= (1 << (1-j)); /* MSB first */
-            }
-        }
-        result[i] = base4_chars[bit_pair];
+    /* Header line - the counts are the first pass totals (IC and DC are not reset yet) */
+    stream->out = append_count(stream->buffer, ctx->IC - INITIAL_IC);
+    *stream->out++ = ' ';
+    stream->out = append_count(stream->out, ctx->DC - INITIAL_DC);
+    *stream->out++ = '\n';
+    stream->emitted = 0;
+    stream->failed = 0;
+    return 1;
+}
+
+/*
+ * STREAM_FLUSH - Write out what is in the buffer
+ */
+static void stream_flush(assembler_context_t *ctx, object_stream_t *stream) {
+    size_t length = stream->out - stream->buffer;
+    
+    if (length > 0 && fwrite(stream->buffer, 1, length, stream->file) != length) {
+        stream->failed = 1;
     }
-    result[5] = '\0';
-    return result;
+    ctx->stats.bytes_written += (long)length;
+    stream->out = stream->buffer;
 }
 
 /*
- * ENCODE_DECIMAL_ADDRESS_TO_LETTERS - Convert decimal address to 5-letter code
+ * STREAM_CODE - Format the code words encoded since the last call
  * 
- * Input: decimal address (e.g., 1210)
- * Output: 5-letter encoded address (e.g., "bbacc")
+ * The second pass calls this after every instruction, so everything below
+ * ctx->IC is final.
+ */
+static void stream_code(assembler_context_t *ctx, object_stream_t *stream) {
+    int end = ctx->IC - INITIAL_IC;
+    
+    if (end > ctx->code.count) {
+        end = ctx->code.count;  /* Only after errors */
+    }
+    for (; stream->emitted < end; stream->emitted++) {
+        if (stream->out + OB_LINE_LENGTH > stream->buffer + OB_STREAM_BUFFER) {
+            stream_flush(ctx, stream);
+        }
+        stream->out = append_ob_line(stream->out, INITIAL_IC + stream->emitted, ctx->code.words[stream->emitted].value);
+    }
+}
+
+/*
+ * STREAM_CLOSE - Add the data words and give the file its .ob name
  * 
- * Steps:
- * 1. Convert to base-4: 1210 → 11022
- * 2. Pad to 5 digits if needed
- * 3. Map digits to letters: 1 1 0 2 2 → b b a c c
+ * keep is 0 when the pass had errors - then the .part file is just removed.
+ * Returns: 1 if NAME.ob was written, 0 if not
  */
-char* encode_decimal_address_to_letters(int address) {
-    static char result[6]; /* 5 letters + null terminator */
-    char base4_chars[] = "abcd";
-    unsigned int uaddress = (unsigned int)address;
+static int stream_close(assembler_context_t *ctx, object_stream_t *stream, int keep) {
+    int data_start = INITIAL_IC + ctx->code.count;  /* Data comes right after the code */
     int i;
     
-    /* Convert to base-4, filling from right to left */
-    for (i = 4; i >= 0; i--) {
-        result[i] = base4_chars[uaddress % 4];
-        uaddress /= 4;
+    if (keep) {
+        stream_code(ctx, stream);  /* Anything not formatted yet (normally nothing) */
+        for (i = 0; i < ctx->data.count; i++) {
+            if (stream->out + OB_LINE_LENGTH > stream->buffer + OB_STREAM_BUFFER) {
+                stream_flush(ctx, stream);
+            }
+            stream->out = append_ob_line(stream->out, data_start + i, ctx->data.words[i].value);
+        }
+        stream_flush(ctx, stream);
+    }
+    if (fclose(stream->file) != 0) {
+        stream->failed = 1;
+    }
+    memory_free(ctx, MEMORY_IMAGES, stream->buffer, OB_STREAM_BUFFER);
+    
+    if (!keep || stream->failed) {
+        remove(stream->part_filename);
+        return 0;
+    }
+    /* Not every system lets rename replace a file, so the old .ob goes first there */
+    if (rename(stream->part_filename, stream->filename) != 0 &&
+        (remove(stream->filename) != 0 || rename(stream->part_filename, stream->filename) != 0)) {
+        remove(stream->part_filename);
+        return 0;
     }
-    result[5] = '\0';
+    return 1;
+}
+
+/*
+ * ENCODE_DECIMAL_ADDRESS_TO_LETTERS - Convert an address to a 5-letter code
+ * 
+ * Input: decimal address (e.g., 1210)
+ * Output: 5-letter encoded address (e.g., "bbacc") in the caller's 6-char buffer
+ * 
+ * Five base-4 digits only hold 10 bits, so (like before) only the low
+ * 10 bits of the address are used - then it is just a table lookup.
+ */
+char* encode_decimal_address_to_letters(int address, char *result) {
+    memcpy(result, word_letters[(unsigned int)address & WORD_VALUE_MASK], LETTER_WORD_LENGTH + 1);
     return result;
 }
 
 /*
  * PRINT_SPECIALBASE - Print a number in base 4 format (legacy function)
  * 
- * This function is kept for backward compatibility but now uses the new encoding functions
+ * Counts under 64 fit in 3 letters and are printed that way, bigger
+ * values get all 5 letters (same rule as the .ob header).
  */
 void print_specialbase(FILE *file, int value) {
-    if (value < 64) {
-        /* For small values (counts), use 3 digits - legacy format */
-        char* encoded = encode_decimal_address_to_letters(value);
-        /* Print only last 3 characters for counts */
-        fprintf(file, "%s", encoded + 2);
+    char encoded[LETTER_WORD_LENGTH + 1];
+    
+    *append_count(encoded, value) = '\0';
+    fputs(encoded, file);
+}
+
+/*
+ * APPEND_WORD - Copy the 5 letters of a 10-bit value into the buffer
+ * Returns: Pointer just after the letters
+ */
+static char *append_word(char *out, int value) {
+    memcpy(out, word_letters[(unsigned int)value & WORD_VALUE_MASK], LETTER_WORD_LENGTH);
+    return out + LETTER_WORD_LENGTH;
+}
+
+/*
+ * APPEND_OB_LINE - One line of the .ob file: "aaaaa  aaaaa\n" (address, then value)
+ * Returns: Pointer just after the line
+ */
+static char *append_ob_line(char *out, int address, int value) {
+    out = append_word(out, address);
+    *out++ = ' ';
+    *out++ = ' ';
+    out = append_word(out, value);
+    *out++ = '\n';
+    return out;
+}
+
+/*
+ * APPEND_COUNT - Like append_word, but values under 64 only get their last 3 letters
+ */
+static char *append_count(char *out, int value) {
+    const char *letters = word_letters[(unsigned int)value & WORD_VALUE_MASK];
+    int skip = value < 64 ? 2 : 0;  /* Legacy format: short counts use 3 digits */
+    
+    memcpy(out, letters + skip, LETTER_WORD_LENGTH - skip);
+    return out + LETTER_WORD_LENGTH - skip;
+}
+
+/*
+ * APPEND_DECIMAL - Write a number in decimal, at least 4 digits (like "%04d")
+ * Returns: Pointer just after the digits
+ */
+static char *append_decimal(char *out, int value) {
+    char digits[DECIMAL_MAX];
+    int count = 0;
+    unsigned long number;
+    
+    if (value < 0) {
+        *out++ = '-';
+        number = 0UL - (unsigned long)value;
     } else {
-        /* For addresses, use 5 digits */
-        char* encoded = encode_decimal_address_to_letters(value);
-        fprintf(file, "%s", encoded);
+        number = (unsigned long)value;
+    }
+    
+    /* Digits come out backwards, so collect them first */
+    do {
+        digits[count++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+    while (count < 4 - (value < 0)) {
+        digits[count++] = '0';  /* Zero padding, like %04d */
+    }
+    
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+/*
+ * WRITE_OUTPUT_FILE - Write the first length bytes of buffer as filename + extension, and free it
+ * binary is 1 for the .bin file, so no system ever turns its bytes into \r\n
+ * The buffer came from memory_alloc(ctx, MEMORY_IMAGES, size).
+ * 
+ * With --async-write the buffer goes to the writer thread instead (writer.c),
+ * and a failed write is reported for this file when the run ends.
+ */
+static error_code_t write_output_file(assembler_context_t *ctx, const char *filename, const char *extension,
+                                      char *buffer, size_t size, size_t length, int binary) {
+    FILE *file;
+    char *output_filename;
+    int write_failed;
+    
+    memory_release(ctx, MEMORY_IMAGES, size);  /* Freed here or by the writer, not ours any more */
+    output_filename = create_filename(&ctx->arena, filename, extension);
+    if (!output_filename) {
+        free(buffer);
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    
+    ctx->stats.bytes_written += (long)length;
+    if (ctx->options->writer && ctx->writer_file >= 0 &&
+        writer_submit(ctx->options->writer, ctx->writer_file, output_filename, buffer, length, binary) == SUCCESS) {
+        return SUCCESS;  /* The writer frees the buffer */
+    }
+    
+    file = fopen(output_filename, binary ? "wb" : "w");
+    if (!file) {
+        free(buffer);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    
+    write_failed = fwrite(buffer, 1, length, file) != length;
+    free(buffer);
+    if (fclose(file) != 0 || write_failed) {
+        return ERROR_FILE_NOT_FOUND;
     }
+    
+    return SUCCESS;
 }
 
 /*
@@ -861,85 +1038,231 @@ void print_specialbase(FILE *file, int value) {
  * Example:
  * MAIN 0100
  * FUNC1 0150
+ * 
+ * The first walk over the symbols finds out how big the file will be,
+ * the second one fills the buffer.
  */
-error_code_t generate_entries_file(const char *filename) {
-    FILE *file;
-    char *output_filename;
-    symbol_t *current = symbol_table;
-    int has_entries = 0;
+error_code_t generate_entries_file(assembler_context_t *ctx, const char *filename) {
+    int current;
+    size_t size = 0;
+    char *buffer;
+    char *out;
     
-    /* Check if there are any entry symbols */
-    while (current) {
-        if (current->is_entry) {
-            has_entries = 1;
-            break;
+    /* Check if there are any entry symbols, and how much room they need (newest first) */
+    for (current = ctx->symbol_count - 1; current >= 0; current--) {
+        if (ctx->symbol_flags[current] & SYMBOL_ENTRY) {
+            size += strlen(symbol_name(ctx, current)) + 1 + DECIMAL_MAX + 1;
         }
-        current = current->next;
     }
     
-    if (!has_entries) {
+    if (size == 0) {
         return SUCCESS; /* No entries file needed */
     }
     
-    output_filename = create_filename(filename, ENT_EXT);
-    if (!output_filename) {
+    buffer = memory_alloc(ctx, MEMORY_IMAGES, size);
+    if (!buffer) {
         return ERROR_MEMORY_ALLOCATION;
     }
-    
-    file = fopen(output_filename, "w");
-    if (!file) {
-        free(output_filename);
-        return ERROR_FILE_NOT_FOUND;
-    }
+    out = buffer;
     
     /* Write all entry symbols */
-    current = symbol_table;
-    while (current) {
-        if (current->is_entry) {
-            fprintf(file, "%s %04d\n", current->name, current->address);
+    for (current = ctx->symbol_count - 1; current >= 0; current--) {
+        if (ctx->symbol_flags[current] & SYMBOL_ENTRY) {
+            const char *name = symbol_name(ctx, current);
+            size_t length = strlen(name);
+            
+            memcpy(out, name, length);
+            out += length;
+            *out++ = ' ';
+            out = append_decimal(out, symbol_address(ctx, current));
+            *out++ = '\n';
         }
-        current = current->next;
     }
     
-    fclose(file);
-    free(output_filename);
-    
-    return SUCCESS;
+    return write_output_file(ctx, filename, ENT_EXT, buffer, size, out - buffer, 0);
 }
 
 /*
  * GENERATE_EXTERNALS_FILE - Create the .ext output file
+ * 
+ * Format: <external_label> <address where it is used>, built the same
+ * way as the .ent file.
  */
-error_code_t generate_externals_file(const char *filename) {
-    FILE *file;
-    char *output_filename;
-    external_ref_t *current = external_references;
+error_code_t generate_externals_file(assembler_context_t *ctx, const char *filename) {
+    const external_ref_t *current;
+    size_t size = 0;
+    char *buffer;
+    char *out;
+    int i;
     
-    if (!current) {
+    if (ctx->external_reference_count == 0) {
         return SUCCESS; /* No externals file needed */
     }
     
-    output_filename = create_filename(filename, EXT_EXT);
-    if (!output_filename) {
+    for (i = 0; i < ctx->external_reference_count; i++) {
+        size += strlen(ctx->name_pool + ctx->external_references[i].label) + 1 + DECIMAL_MAX + 1;
+    }
+    
+    buffer = memory_alloc(ctx, MEMORY_IMAGES, size);
+    if (!buffer) {
         return ERROR_MEMORY_ALLOCATION;
     }
+    out = buffer;
     
-    file = fopen(output_filename, "w");
-    if (!file) {
-        free(output_filename);
-        return ERROR_FILE_NOT_FOUND;
+    /* Write all external references, newest first like the old list had them */
+    for (i = ctx->external_reference_count - 1; i >= 0; i--) {
+        const char *label;
+        size_t length;
+        
+        current = &ctx->external_references[i];
+        label = ctx->name_pool + current->label;
+        length = strlen(label);
+        memcpy(out, label, length);
+        out += length;
+        *out++ = ' ';
+        out = append_decimal(out, current->address);
+        *out++ = '\n';
     }
     
-    /* Write all external references */
-    while (current) {
-        fprintf(file, "%s %04d\n", current->label, current->address);
-        current = current->next;
+    return write_output_file(ctx, filename, EXT_EXT, buffer, size, out - buffer, 0);
+}
+
+/*
+ * BINARY OBJECT FILE (--format=bin)
+ * 
+ * The .ob text takes 12 bytes per word and the loader has to decode every
+ * letter again. The .bin file holds the same program (plus the .ent and .ext
+ * tables) in a fixed layout that a loader can mmap and use as it is:
+ * 
+ * Header - BIN_HEADER_FIELDS 32-bit numbers:
+ *   magic "A4OB", format version, code base address (100),
+ *   code word count, data word count, entry count, extern count,
+ *   string table size, then the byte offset of the code words, data words,
+ *   entry table, extern table and string table, and the total file size
+ * Code words, then data words - 16 bits each: value << 2 | ARE
+ * Entry table, then extern table - pairs of 32-bit numbers:
+ *   offset of the name in the string table, address
+ * String table - the names, each ending in '\0'
+ * 
+ * All numbers are little endian no matter what machine we run on. The header
+ * and the entry and extern tables start on a 4-byte boundary, so a C loader
+ * can point structs at them. The code and data words are only 2-byte aligned:
+ * the data words come right after the code words, so with an odd code word
+ * count they start 2 bytes past a 4-byte boundary. Use the offsets from the
+ * header, not a rounded position.
+ * Entries and externs are in the same order as the .ent and .ext lines.
+ */
+#define BIN_MAGIC "A4OB"
+#define BIN_VERSION 1
+#define BIN_HEADER_FIELDS 14
+#define BIN_ALIGN(size) (((size) + 3) & ~(size_t)3)
+
+error_code_t generate_binary_object_file(assembler_context_t *ctx, const char *filename) {
+    int symbol;
+    const external_ref_t *ref;
+    unsigned char *buffer;
+    unsigned char *out;
+    unsigned long entry_count = 0;
+    unsigned long extern_count = 0;
+    size_t strings_size = 0;
+    size_t code_offset, data_offset, entries_offset, externs_offset, strings_offset, file_size;
+    size_t name_offset;
+    int i;
+    
+    /* Count the tables first so every offset is known before writing */
+    for (symbol = ctx->symbol_count - 1; symbol >= 0; symbol--) {
+        if (ctx->symbol_flags[symbol] & SYMBOL_ENTRY) {
+            entry_count++;
+            strings_size += strlen(symbol_name(ctx, symbol)) + 1;
+        }
+    }
+    for (i = ctx->external_reference_count - 1; i >= 0; i--) {
+        extern_count++;
+        strings_size += strlen(ctx->name_pool + ctx->external_references[i].label) + 1;
     }
     
-    fclose(file);
-    free(output_filename);
+    code_offset = BIN_HEADER_FIELDS * 4;
+    data_offset = code_offset + (size_t)ctx->code.count * 2;
+    entries_offset = BIN_ALIGN(data_offset + (size_t)ctx->data.count * 2);
+    externs_offset = entries_offset + entry_count * 8;
+    strings_offset = externs_offset + extern_count * 8;
+    file_size = BIN_ALIGN(strings_offset + strings_size);
     
-    return SUCCESS;
+    buffer = memory_alloc(ctx, MEMORY_IMAGES, file_size);
+    if (!buffer) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    memset(buffer, 0, file_size);  /* Padding bytes stay 0 */
+    
+    /* Header */
+    memcpy(buffer, BIN_MAGIC, 4);
+    out = buffer + 4;
+    out = append_u32(out, BIN_VERSION);
+    out = append_u32(out, INITIAL_IC);
+    out = append_u32(out, ctx->code.count);
+    out = append_u32(out, ctx->data.count);
+    out = append_u32(out, entry_count);
+    out = append_u32(out, extern_count);
+    out = append_u32(out, strings_size);
+    out = append_u32(out, code_offset);
+    out = append_u32(out, data_offset);
+    out = append_u32(out, entries_offset);
+    out = append_u32(out, externs_offset);
+    out = append_u32(out, strings_offset);
+    append_u32(out, file_size);
+    
+    /* Code and data words, with their ARE bits this time */
+    out = buffer + code_offset;
+    for (i = 0; i < ctx->code.count; i++) {
+        out = append_u16(out, (unsigned long)ctx->code.words[i].value << 2 | ctx->code.words[i].are);
+    }
+    for (i = 0; i < ctx->data.count; i++) {
+        out = append_u16(out, (unsigned long)ctx->data.words[i].value << 2 | ctx->data.words[i].are);
+    }
+    
+    /* Entry and extern tables, with the names going into the string table */
+    out = buffer + entries_offset;
+    name_offset = 0;
+    for (symbol = ctx->symbol_count - 1; symbol >= 0; symbol--) {
+        if (ctx->symbol_flags[symbol] & SYMBOL_ENTRY) {
+            size_t length = strlen(symbol_name(ctx, symbol)) + 1;
+            
+            out = append_u32(out, name_offset);
+            out = append_u32(out, (unsigned long)symbol_address(ctx, symbol));
+            memcpy(buffer + strings_offset + name_offset, symbol_name(ctx, symbol), length);
+            name_offset += length;
+        }
+    }
+    for (i = ctx->external_reference_count - 1; i >= 0; i--) {
+        size_t length;
+        
+        ref = &ctx->external_references[i];
+        length = strlen(ctx->name_pool + ref->label) + 1;
+        out = append_u32(out, name_offset);
+        out = append_u32(out, (unsigned long)ref->address);
+        memcpy(buffer + strings_offset + name_offset, ctx->name_pool + ref->label, length);
+        name_offset += length;
+    }
+    
+    return write_output_file(ctx, filename, BIN_EXT, (char *)buffer, file_size, file_size, 1);
+}
+
+/*
+ * APPEND_U16 / APPEND_U32 - Write a number little endian, byte by byte
+ * Returns: Pointer just after the number
+ */
+static unsigned char *append_u16(unsigned char *out, unsigned long value) {
+    out[0] = (unsigned char)(value & 0xFF);
+    out[1] = (unsigned char)((value >> 8) & 0xFF);
+    return out + 2;
+}
+
+static unsigned char *append_u32(unsigned char *out, unsigned long value) {
+    out[0] = (unsigned char)(value & 0xFF);
+    out[1] = (unsigned char)((value >> 8) & 0xFF);
+    out[2] = (unsigned char)((value >> 16) & 0xFF);
+    out[3] = (unsigned char)((value >> 24) & 0xFF);
+    return out + 4;
 }
 
-/* END OF FILE - NO MORE FUNCTIONS AFTER THIS */
+/* END OF FILE - NO MORE FUNCTIONS AFTER THIS */
\ No newline at end of file
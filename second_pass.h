@@ -3,33 +3,27 @@
 
 #include <stdio.h>
 
-/* External reference entry */
+/* External reference entry - one use of an .extern symbol */
 typedef struct external_ref {
-    char label[MAX_LABEL_LENGTH];
-    int address;
-    struct external_ref *next;
+    int symbol;                     /* Symbol id of the extern */
+    int label;                      /* name_pool offset of the operand text (the .ext line) */
+    int address;                    /* Where the word is */
 } external_ref_t;
 
 /* Function prototypes */
-error_code_t second_pass(const char *filename);
-error_code_t process_line_second_pass(char *line, int line_number);
-error_code_t encode_instruction(char *line);
-error_code_t encode_instruction_from_parts(char **parts, int part_count);
-error_code_t encode_directive(char *line);
-char* encode_binary10_to_letters(const char* binary10);
-char* encode_decimal_address_to_letters(int address);
+error_code_t second_pass(assembler_context_t *ctx, const char *object_base);
+error_code_t process_line_second_pass(assembler_context_t *ctx, const line_record_t *record);
+error_code_t encode_instruction(assembler_context_t *ctx, const line_record_t *record);
+error_code_t encode_directive(assembler_context_t *ctx, const line_record_t *record);
+char* encode_decimal_address_to_letters(int address, char *result);
 void print_specialbase(FILE *file, int value);
-error_code_t add_external_reference(const char *label, int address);
-void free_external_references(void);
-error_code_t encode_operand_word(char *operand_str, operand_type_t type);
-error_code_t generate_object_file(const char *filename);
-error_code_t generate_entries_file(const char *filename);
-error_code_t generate_externals_file(const char *filename);
-operand_type_t get_operand_type(const char *operand);
-int get_register_number(const char *operand);
-error_code_t encode_word(int address, unsigned int value, int are);
-
-/* Global variables */
-extern word_t instruction_memory[MEMORY_SIZE];
-extern word_t data_memory[MEMORY_SIZE];
-extern external_ref_t *external_references;
\ No newline at end of file
+error_code_t add_external_reference(assembler_context_t *ctx, int symbol, int label, int address);
+void free_external_references(assembler_context_t *ctx);
+error_code_t encode_operand_word(assembler_context_t *ctx, const parsed_operand_t *operand, int line_number);
+error_code_t generate_object_file(assembler_context_t *ctx, const char *filename);
+error_code_t generate_entries_file(assembler_context_t *ctx, const char *filename);
+error_code_t generate_externals_file(assembler_context_t *ctx, const char *filename);
+error_code_t generate_binary_object_file(assembler_context_t *ctx, const char *filename);
+error_code_t encode_word(assembler_context_t *ctx, int address, unsigned int value, int are);
+error_code_t segment_reserve(assembler_context_t *ctx, segment_t *segment, int words);
+void free_segments(assembler_context_t *ctx);
\ No newline at end of file
@@ -0,0 +1,158 @@
+/*
+ * SERVER MODULE (--server)
+ *
+ * A build system that runs the assembler once per module pays for starting a
+ * process, and for building up the context's tables and buffers again, every
+ * time - and for small modules that is most of the work. With --server the
+ * assembler starts once and reads requests from stdin, one per line:
+ *
+ *   [OPTION ...] FILE
+ *
+ * FILE is a base name like on the command line (without .as). The options
+ * are the per-file ones (parse_file_option in main.c): --keep-am,
+ * --one-pass, --format=letters|bin, --output-dir=DIR, --max-errors=N,
+ * --file-threads=N and --quiet. A request starts from the options the server was started with
+ * and only changes what it lists. An empty line is ignored and "quit" (or
+ * the end of stdin) stops the server.
+ *
+ * The answer goes to stdout: the file's messages (progress and errors, in
+ * that order, errors in one piece - see diagnostics.c), its --stats if the
+ * server was started with them, and then always one last line
+ *
+ *   === ok FILE        or        === failed FILE
+ *
+ * and stdout is flushed, so the client can read up to the "===" line and
+ * send the next request. For example:
+ *
+ *   $ printf 'prog1\n--format=bin --output-dir=build prog2\n' | ./assembler --server -q
+ *   === ok prog1
+ *   === ok prog2
+ *
+ * All the requests share one context, so the symbol index, the macro
+ * index, the line records, the segments and the arena blocks keep their
+ * memory between files (reset_context only empties them). Words in a
+ * request are separated by spaces or tabs, so paths can't contain them.
+ */
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "server.h"
+#include "stats.h"
+
+static int split_request(char *line, char *words[]);
+
+/*
+ * RUN_SERVER - Answer requests from stdin until it ends (or "quit")
+ * Returns: exit status - 0 if every request succeeded, 1 otherwise
+ */
+int run_server(const assembler_options_t *options) {
+    assembler_context_t *ctx;
+    assembler_options_t request;        /* Server options + this request's */
+    assembler_stats_t file_stats;
+    char line[SERVER_LINE_LENGTH];
+    char *words[SERVER_MAX_WORDS];
+    int word_count;
+    const char *file;                   /* The request's file, NULL if the request was wrong */
+    int succeeded;
+    int request_count = 0;
+    int success_count = 0;
+    int valid;
+    int i;
+    
+    ctx = malloc(sizeof(assembler_context_t));
+    if (!ctx) {
+        fprintf(stderr, "Error: Memory allocation failed for assembler context.\n");
+        return 1;
+    }
+    init_context(ctx, options, stdout, stdout);  /* Errors are part of the answer too */
+    
+    while (fgets(line, sizeof(line), stdin)) {
+        /* A line that did not fit: skip the rest of it and refuse it */
+        if (!strchr(line, '\n') && !feof(stdin)) {
+            int c;
+            
+            while ((c = getchar()) != EOF && c != '\n') {
+            }
+            printf("Error: Request longer than %d characters.\n", SERVER_LINE_LENGTH - 2);
+            printf("=== failed -\n");
+            fflush(stdout);
+            request_count++;
+            continue;
+        }
+        
+        word_count = split_request(line, words);
+        if (word_count == 0) {
+            continue;
+        }
+        if (word_count == 1 && strcmp(words[0], "quit") == 0) {
+            break;
+        }
+        request_count++;
+        
+        /* Everything before the file name is an option for this file only */
+        request = *options;
+        file = NULL;
+        succeeded = 0;
+        valid = word_count <= SERVER_MAX_WORDS && words[word_count - 1][0] != '-';
+        if (!valid) {
+            printf("Error: A request is [OPTION ...] FILE.\n");
+        }
+        for (i = 0; valid && i < word_count - 1; i++) {
+            int handled = parse_file_option(words[i], &request, stdout);
+            
+            if (handled == 0) {
+                printf("Error: Unknown option '%s'.\n", words[i]);
+            }
+            valid = handled > 0;
+        }
+        
+        if (valid) {
+            file = words[word_count - 1];
+            ctx->options = &request;
+            succeeded = process_single_file(ctx, file) == SUCCESS;
+            if (request.stats != STATS_OFF) {
+                stats_collect(ctx, &file_stats);
+                stats_print(stdout, file, &file_stats, request.stats);
+            }
+            ctx->options = options;
+        }
+        
+        success_count += succeeded;
+        printf("=== %s %s\n", succeeded ? "ok" : "failed", file ? file : "-");
+        fflush(stdout);
+    }
+    
+    free_context(ctx);
+    free(ctx);
+    return success_count == request_count ? 0 : 1;
+}
+
+/*
+ * SPLIT_REQUEST - Cut a request line into words, in place
+ *
+ * Returns: the number of words. More than SERVER_MAX_WORDS is reported as
+ *          SERVER_MAX_WORDS + 1 (only the first SERVER_MAX_WORDS are kept).
+ */
+static int split_request(char *line, char *words[]) {
+    int count = 0;
+    char *p = line;
+    
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (count == SERVER_MAX_WORDS) {
+            return SERVER_MAX_WORDS + 1;
+        }
+        words[count++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+        if (*p) {
+            *p++ = '\0';
+        }
+    }
+    return count;
+}
@@ -0,0 +1,8 @@
+/* Server mode (--server) - stay resident and assemble files named on stdin */
+/* Simple header - no includes needed */
+
+#define SERVER_LINE_LENGTH 4096      /* Longest request line */
+#define SERVER_MAX_WORDS 32          /* Most options + file name in one request */
+
+/* Function declarations */
+int run_server(const assembler_options_t *options);
@@ -0,0 +1,177 @@
+/*
+ * SOURCE INPUT MODULE
+ *
+ * Both the macro expander and the first pass used to read their input with
+ * fgets into a MAX_LINE_LENGTH buffer. That is one library call per line,
+ * and a line longer than the buffer was silently cut into pieces.
+ *
+ * Now the whole file is brought into memory in one go - with mmap where the
+ * system has it, or one read into a malloc'd buffer otherwise - and the lines
+ * are handed out as (pointer, length) slices straight out of that memory.
+ * Nothing is copied, and a line can be as long as it likes.
+ *
+ * Example:
+ *   source_file_t source;
+ *   const char *line;
+ *   int length;
+ *
+ *   source_open(&source, "prog.as");
+ *   while (source_next_line(&source, &line, &length)) {
+ *       ... line[0] .. line[length - 1], no '\n' and no '\0' ...
+ *   }
+ *   source_close(&source);
+ */
+
+/* mmap needs the POSIX declarations, which -ansi hides by default */
+#ifndef NO_MMAP
+#define _POSIX_C_SOURCE 200112L
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "source.h"
+
+#define SOURCE_READ_CHUNK 65536
+
+static error_code_t read_whole_file(source_file_t *source, const char *filename);
+
+/*
+ * SOURCE_OPEN - Bring a whole file into memory
+ *
+ * Tries mmap first. Files that can't be mapped (empty files, pipes, systems
+ * without mmap when built with -DNO_MMAP) are read in one go instead.
+ * Returns: SUCCESS, ERROR_FILE_NOT_FOUND or ERROR_MEMORY_ALLOCATION
+ */
+error_code_t source_open(source_file_t *source, const char *filename) {
+#ifndef NO_MMAP
+    struct stat info;
+    void *map;
+    int fd;
+#endif
+
+    source->text = NULL;
+    source->size = 0;
+    source->position = 0;
+    source->mapped = 0;
+
+#ifndef NO_MMAP
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);  /* The mapping stays valid without the descriptor */
+            source->text = map;
+            source->size = (size_t)info.st_size;
+            source->mapped = 1;
+            return SUCCESS;
+        }
+    }
+    close(fd);
+#endif
+
+    return read_whole_file(source, filename);
+}
+
+/*
+ * SOURCE_NEXT_LINE - Get the next line as a slice
+ *
+ * The slice does not include the '\n' and is NOT null terminated
+ * (the memory may be a read-only mapping of the file). A last line
+ * without a '\n' still counts as a line.
+ * Returns: 1 if there was a line, 0 at the end of the file
+ */
+int source_next_line(source_file_t *source, const char **line, int *length) {
+    const char *start;
+    const char *newline;
+    size_t left;
+
+    if (source->position >= source->size) {
+        return 0;
+    }
+
+    start = source->text + source->position;
+    left = source->size - source->position;
+    newline = memchr(start, '\n', left);
+
+    *line = start;
+    if (newline) {
+        *length = (int)(newline - start);
+        source->position += (size_t)(newline - start) + 1;
+    } else {
+        *length = (int)left;
+        source->position = source->size;
+    }
+    return 1;
+}
+
+/*
+ * SOURCE_REWIND - Start handing out lines from the beginning again
+ */
+void source_rewind(source_file_t *source) {
+    source->position = 0;
+}
+
+/*
+ * SOURCE_CLOSE - Unmap or free the file contents
+ */
+void source_close(source_file_t *source) {
+#ifndef NO_MMAP
+    if (source->mapped) {
+        munmap((void *)source->text, source->size);
+    }
+#endif
+    if (!source->mapped) {
+        free((void *)source->text);
+    }
+    source->text = NULL;
+    source->size = 0;
+    source->position = 0;
+    source->mapped = 0;
+}
+
+/*
+ * READ_WHOLE_FILE - The fallback: read the file into one malloc'd buffer
+ *
+ * The buffer doubles as needed, so this also works when the size is not
+ * known in advance.
+ */
+static error_code_t read_whole_file(source_file_t *source, const char *filename) {
+    FILE *file;
+    char *buffer = NULL;
+    size_t capacity = 0;
+    size_t size = 0;
+    size_t count;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    do {
+        if (size + SOURCE_READ_CHUNK > capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : SOURCE_READ_CHUNK;
+            char *new_buffer = realloc(buffer, new_capacity);
+
+            if (!new_buffer) {
+                free(buffer);
+                fclose(file);
+                return ERROR_MEMORY_ALLOCATION;
+            }
+            buffer = new_buffer;
+            capacity = new_capacity;
+        }
+        count = fread(buffer + size, 1, capacity - size, file);
+        size += count;
+    } while (count > 0);
+
+    fclose(file);
+    source->text = buffer;
+    source->size = size;
+    return SUCCESS;
+}
@@ -0,0 +1,16 @@
+/* Source file input - the whole file at once, read as line slices */
+/* Simple header - no includes needed */
+
+/* One input file, kept in memory while it is being processed */
+typedef struct {
+    const char *text;                /* The whole file (mapped or read) */
+    size_t size;                     /* Bytes in text */
+    size_t position;                 /* Where the next line starts */
+    int mapped;                      /* 1 if text is an mmap, 0 if malloc'd */
+} source_file_t;
+
+/* Function declarations */
+error_code_t source_open(source_file_t *source, const char *filename);
+int source_next_line(source_file_t *source, const char **line, int *length);
+void source_rewind(source_file_t *source);
+void source_close(source_file_t *source);
@@ -0,0 +1,204 @@
+/*
+ * STATS MODULE - Clocks and resource usage
+ *
+ * The benchmark (bench.c) needs to know how long each stage of
+ * process_single_file takes and how much memory the process used.
+ * Both need things outside of C90, so they are kept together here:
+ * - stats_now uses the POSIX monotonic clock (it never jumps when the
+ *   system time is changed), or clock() when built with -DNO_POSIX_TIMING
+ * - stats_peak_rss_kb uses getrusage, or says 0 without POSIX
+ *
+ * --stats uses the same stage times, plus the counters the passes keep in
+ * ctx->stats, and prints them per file as text or as JSON lines.
+ */
+
+/* clock_gettime and getrusage need the POSIX declarations, which -ansi hides */
+#ifndef NO_POSIX_TIMING
+#define _POSIX_C_SOURCE 200112L
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#else
+#include <time.h>
+#endif
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "memory.h"
+#include "stats.h"
+
+/* Names for the stages, in the order of stage_t */
+static const char *stage_names[STAGE_COUNT] = {
+    "Macro expansion",
+    "First pass",
+    "Second pass",
+    "Output files"
+};
+
+/*
+ * STATS_NOW - Seconds since some fixed point, as precise as the system allows
+ *
+ * Only the difference between two calls means anything.
+ */
+double stats_now(void) {
+#ifndef NO_POSIX_TIMING
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+        return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+    }
+#endif
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/*
+ * STATS_PEAK_RSS_KB - Most memory the process has had in RAM so far
+ * Returns: kilobytes, or 0 if the system can't tell us
+ */
+long stats_peak_rss_kb(void) {
+#ifndef NO_POSIX_TIMING
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return (long)(usage.ru_maxrss / 1024);  /* macOS gives bytes */
+#else
+        return (long)usage.ru_maxrss;           /* Linux and the BSDs give kilobytes */
+#endif
+    }
+#endif
+    return 0;
+}
+
+/*
+ * STATS_STAGE_NAME - Printable name of a stage
+ */
+const char *stats_stage_name(stage_t stage) {
+    return stage_names[stage];
+}
+
+/*
+ * STATS_COLLECT - Copy what one file cost out of the context
+ *
+ * The counters in ctx->stats are bumped while the file is assembled. The
+ * rest (lines, words, arena allocations, memory peaks) is already in the
+ * context, so it is picked up here instead of being counted twice.
+ */
+void stats_collect(const assembler_context_t *ctx, assembler_stats_t *out) {
+    *out = ctx->stats;
+    out->files = 1;
+    out->lines = ctx->line_number;
+    out->words = (long)ctx->code.count + (long)ctx->data.count;
+    out->allocations += ctx->arena.allocations;
+    memory_peaks(ctx, out->memory_peak, &out->memory_peak_total);
+}
+
+/*
+ * STATS_ADD - Add one file's numbers to a running total
+ * The memory peaks are not added up - the total keeps the biggest file's.
+ */
+void stats_add(assembler_stats_t *total, const assembler_stats_t *file) {
+    int s;
+
+    for (s = 0; s < STAGE_COUNT; s++) {
+        total->stage_seconds[s] += file->stage_seconds[s];
+    }
+    total->files += file->files;
+    total->lines_read += file->lines_read;
+    total->lines += file->lines;
+    total->tokens += file->tokens;
+    total->symbol_lookups += file->symbol_lookups;
+    total->symbol_probes += file->symbol_probes;
+    total->macro_expansions += file->macro_expansions;
+    total->words += file->words;
+    total->bytes_written += file->bytes_written;
+    total->allocations += file->allocations;
+    for (s = 0; s < MEMORY_KINDS; s++) {
+        if (file->memory_peak[s] > total->memory_peak[s]) {
+            total->memory_peak[s] = file->memory_peak[s];
+        }
+    }
+    if (file->memory_peak_total > total->memory_peak_total) {
+        total->memory_peak_total = file->memory_peak_total;
+    }
+}
+
+/*
+ * PRINT_JSON_STRING - A file name as a JSON string (quotes and backslashes escaped)
+ */
+static void print_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fprintf(out, "\\%c", *text);
+        } else if ((unsigned char)*text < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned int)(unsigned char)*text);
+        } else {
+            fputc(*text, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * STATS_PRINT - Report the numbers for one file (or the total, when name is NULL)
+ *
+ * Text is a small block meant for people. JSON is one object on one line, so
+ * a script can read the output of many files line by line:
+ *   {"file":"prog","total":false,"seconds":{"macros":...},"lines_read":...}
+ */
+void stats_print(FILE *out, const char *name, const assembler_stats_t *stats, stats_format_t format) {
+    static const char *json_stage_names[STAGE_COUNT] = {
+        "macros", "first_pass", "second_pass", "output"
+    };
+    double total_seconds = 0.0;
+    double probes_per_lookup;
+    int s;
+
+    for (s = 0; s < STAGE_COUNT; s++) {
+        total_seconds += stats->stage_seconds[s];
+    }
+    probes_per_lookup = stats->symbol_lookups ? (double)stats->symbol_probes / stats->symbol_lookups : 0.0;
+
+    if (format == STATS_JSON) {
+        fprintf(out, "{\"file\":");
+        if (name) {
+            print_json_string(out, name);
+        } else {
+            fprintf(out, "null");
+        }
+        fprintf(out, ",\"total\":%s,\"files\":%ld,\"seconds\":{", name ? "false" : "true", stats->files);
+        for (s = 0; s < STAGE_COUNT; s++) {
+            fprintf(out, "\"%s\":%.6f,", json_stage_names[s], stats->stage_seconds[s]);
+        }
+        fprintf(out, "\"total\":%.6f}", total_seconds);
+        fprintf(out, ",\"lines_read\":%ld,\"lines\":%ld,\"tokens\":%ld", stats->lines_read, stats->lines, stats->tokens);
+        fprintf(out, ",\"symbol_lookups\":%ld,\"symbol_probes\":%ld", stats->symbol_lookups, stats->symbol_probes);
+        fprintf(out, ",\"macro_expansions\":%ld,\"words\":%ld", stats->macro_expansions, stats->words);
+        fprintf(out, ",\"bytes_written\":%ld,\"allocations\":%ld", stats->bytes_written, stats->allocations);
+        fprintf(out, ",\"memory_peak\":{");
+        for (s = 0; s < MEMORY_KINDS; s++) {
+            fprintf(out, "\"%s\":%ld,", memory_kind_name((memory_kind_t)s), stats->memory_peak[s]);
+        }
+        fprintf(out, "\"total\":%ld}}\n", stats->memory_peak_total);
+        return;
+    }
+
+    if (name) {
+        fprintf(out, "Stats for %s:\n", name);
+    } else {
+        fprintf(out, "Stats for all %ld file(s):\n", stats->files);
+    }
+    for (s = 0; s < STAGE_COUNT; s++) {
+        fprintf(out, "  %-16s %10.6f s\n", stage_names[s], stats->stage_seconds[s]);
+    }
+    fprintf(out, "  %-16s %10.6f s\n", "Total", total_seconds);
+    fprintf(out, "  Lines: %ld read, %ld after macro expansion, %ld tokens\n", stats->lines_read, stats->lines, stats->tokens);
+    fprintf(out, "  Symbol lookups: %ld (%.2f probes each)\n", stats->symbol_lookups, probes_per_lookup);
+    fprintf(out, "  Macro expansions: %ld\n", stats->macro_expansions);
+    fprintf(out, "  Words: %ld, bytes written: %ld, allocations: %ld\n", stats->words, stats->bytes_written, stats->allocations);
+    fprintf(out, "  Memory peak: %ld bytes (", stats->memory_peak_total);
+    for (s = 0; s < MEMORY_KINDS; s++) {
+        fprintf(out, "%s%s %ld", s ? ", " : "", memory_kind_name((memory_kind_t)s), stats->memory_peak[s]);
+    }
+    fprintf(out, ")\n");
+}
@@ -0,0 +1,10 @@
+/* Timing, counters and resource usage for --bench and --stats */
+/* Simple header - no includes needed */
+
+/* Function declarations */
+double stats_now(void);
+long stats_peak_rss_kb(void);
+const char *stats_stage_name(stage_t stage);
+void stats_collect(const assembler_context_t *ctx, assembler_stats_t *out);
+void stats_add(assembler_stats_t *total, const assembler_stats_t *file);
+void stats_print(FILE *out, const char *name, const assembler_stats_t *stats, stats_format_t format);
@@ -12,7 +12,10 @@
  * - Error reporting
  */
 
+#include <stdarg.h>     /* print_progress takes a printf style format */
+
 #include "assembler.h"  /* Must include this first for basic types */
+#include "arena.h"
 #include "utils.h"
 
 /* 
@@ -23,116 +26,108 @@
  * - name: The instruction mnemonic (like "mov", "add")
  * - opcode: The numeric code for this instruction (0-15)
  * - operand_count: How many operands this instruction expects (0, 1, or 2)
- * - valid_src_types: Which operand types are valid for source operand
- * - valid_dest_types: Which operand types are valid for destination operand
+ * 
+ * INSTRUCTION_LIST is the one place an instruction is described. Besides
+ * the name, opcode and count, every line has the operand types the source
+ * and the destination may have, as bit masks with OPERAND_BIT(type) set for
+ * every allowed type. NO_TYPES means the operand must be left out.
+ * Both instruction_table and encoding_table (below) are built from it,
+ * so a new opcode only needs a new line here.
  * 
  * Operand types: 0=immediate (#5), 1=direct (LABEL), 2=indirect (*r1), 3=register (r1)
- * Array format: {immediate, direct, indirect, register}
- * 1 = allowed, 0 = not allowed
  */
+#define ALL_TYPES    (OPERAND_BIT(IMMEDIATE) | OPERAND_BIT(DIRECT) | OPERAND_BIT(INDIRECT) | OPERAND_BIT(REGISTER))
+#define NO_IMMEDIATE (OPERAND_BIT(DIRECT) | OPERAND_BIT(INDIRECT) | OPERAND_BIT(REGISTER))
+#define DIRECT_ONLY  OPERAND_BIT(DIRECT)
+#define JUMP_TYPES   (OPERAND_BIT(DIRECT) | OPERAND_BIT(REGISTER))
+#define NO_TYPES     OPERAND_BIT(NO_OPERAND)
+
+/*   name   opcode  count  source_types  dest_types (rows in opcode order) */
+#define INSTRUCTION_LIST(X) \
+    X("mov", MOV_OP, 2, ALL_TYPES,   NO_IMMEDIATE) /* mov allows all src, can't have immediate dest */ \
+    X("cmp", CMP_OP, 2, ALL_TYPES,   ALL_TYPES)    /* cmp allows all types */ \
+    X("add", ADD_OP, 2, ALL_TYPES,   NO_IMMEDIATE) /* add allows all src, can't have immediate dest */ \
+    X("sub", SUB_OP, 2, ALL_TYPES,   NO_IMMEDIATE) /* sub allows all src, can't have immediate dest */ \
+    X("not", NOT_OP, 1, NO_TYPES,    NO_IMMEDIATE) /* not: one operand, no immediate dest */ \
+    X("clr", CLR_OP, 1, NO_TYPES,    NO_IMMEDIATE) /* clr: one operand, no immediate dest */ \
+    X("lea", LEA_OP, 2, DIRECT_ONLY, NO_IMMEDIATE) /* lea: source must be direct only */ \
+    X("inc", INC_OP, 1, NO_TYPES,    NO_IMMEDIATE) /* inc: one operand, no immediate dest */ \
+    X("dec", DEC_OP, 1, NO_TYPES,    NO_IMMEDIATE) /* dec: one operand, no immediate dest */ \
+    X("jmp", JMP_OP, 1, NO_TYPES,    JUMP_TYPES)   /* jmp: direct or register only */ \
+    X("bne", BNE_OP, 1, NO_TYPES,    JUMP_TYPES)   /* bne: direct or register only */ \
+    X("red", RED_OP, 1, NO_TYPES,    NO_IMMEDIATE) /* red: one operand, no immediate dest */ \
+    X("prn", PRN_OP, 1, NO_TYPES,    ALL_TYPES)    /* prn: allows all dest types */ \
+    X("jsr", JSR_OP, 1, NO_TYPES,    JUMP_TYPES)   /* jsr: direct or register only */ \
+    X("rts", RTS_OP, 0, NO_TYPES,    NO_TYPES)     /* rts: no operands */ \
+    X("hlt", HLT_OP, 0, NO_TYPES,    NO_TYPES)     /* hlt: no operands */
+
+#define INSTRUCTION_ROW(name, opcode, count, src_types, dest_types) {name, opcode, count},
+
 instruction_info_t instruction_table[] = {
-    /* name   opcode   count  source_types     dest_types */
-    {"mov", MOV_OP, 2, {1,1,1,1}, {0,1,1,1}},  /* mov allows all src, can't have immediate dest */
-    {"cmp", CMP_OP, 2, {1,1,1,1}, {1,1,1,1}},  /* cmp allows all types */
-    {"add", ADD_OP, 2, {1,1,1,1}, {0,1,1,1}},  /* add allows all src, can't have immediate dest */
-    {"sub", SUB_OP, 2, {1,1,1,1}, {0,1,1,1}},  /* sub allows all src, can't have immediate dest */
-    {"not", NOT_OP, 1, {0,0,0,0}, {0,1,1,1}},  /* not: one operand, no immediate dest */
-    {"clr", CLR_OP, 1, {0,0,0,0}, {0,1,1,1}},  /* clr: one operand, no immediate dest */
-    {"lea", LEA_OP, 2, {0,1,0,0}, {0,1,1,1}},  /* lea: source must be direct only */
-    {"inc", INC_OP, 1, {0,0,0,0}, {0,1,1,1}},  /* inc: one operand, no immediate dest */
-    {"dec", DEC_OP, 1, {0,0,0,0}, {0,1,1,1}},  /* dec: one operand, no immediate dest */
-    {"jmp", JMP_OP, 1, {0,0,0,0}, {0,1,0,1}},  /* jmp: direct or register only */
-    {"bne", BNE_OP, 1, {0,0,0,0}, {0,1,0,1}},  /* bne: direct or register only */
-    {"red", RED_OP, 1, {0,0,0,0}, {0,1,1,1}},  /* red: one operand, no immediate dest */
-    {"prn", PRN_OP, 1, {0,0,0,0}, {1,1,1,1}},  /* prn: allows all dest types */
-    {"jsr", JSR_OP, 1, {0,0,0,0}, {0,1,0,1}},  /* jsr: direct or register only */
-    {"rts", RTS_OP, 0, {0,0,0,0}, {0,0,0,0}},  /* rts: no operands */
-    {"hlt", HLT_OP, 0, {0,0,0,0}, {0,0,0,0}},  /* hlt: no operands */
-    {"stop", HLT_OP, 0, {0,0,0,0}, {0,0,0,0}}, /* stop: alias for hlt - no operands */
-    {"", -1, 0, {0,0,0,0}, {0,0,0,0}}           /* End marker - signals end of table */
+    INSTRUCTION_LIST(INSTRUCTION_ROW)
+    {"stop", HLT_OP, 0},   /* stop: alias for hlt - no operands */
+    {"", -1, 0}            /* End marker - signals end of table */
 };
 
- /*
- * GET_OPERAND_TYPE - Determine the type of an operand
- * 
- * Operand types in our assembly language:
- * - IMMEDIATE (0): #123 - immediate value
- * - DIRECT (1): LABEL - direct address 
- * - INDIRECT (2): *r1 - indirect through register
- * - REGISTER (3): r1 - register
- * 
- * This function looks at the first character(s) to determine type.
- */
-operand_type_t get_operand_type(const char *operand) {
-    if (!operand) return -1;
-    
-    if (operand[0] == '#') {
-        return IMMEDIATE;    /* #123 */
-    } else if (operand[0] == '*') {
-        return INDIRECT;     /* *r1 */
-    } else if (operand[0] == 'r' && isdigit(operand[1]) && operand[2] == '\0') {
-        return REGISTER;     /* r1, r2, etc. */
-    } else {
-        /* Check for matrix indexing syntax: MATRIX[index1][index2] */
-        if (strchr(operand, '[') && strchr(operand, ']')) {
-            return INDIRECT;   /* Matrix indexing with registers is indirect addressing */
-        }
-        return DIRECT;       /* LABEL */
-    }
-}
-
 /*
- * GET_REGISTER_NUMBER - Extract register number from register operand
- * 
- * Takes strings like "r1", "r7" and returns the number (1, 7).
- * Returns -1 if not a valid register.
- * Our CPU has registers r0 through r7.
+ * ENCODING TABLE - Everything about an instruction's first word, precomputed
+ * 
+ * encoding_table[opcode][source mode][destination mode] is one entry per
+ * combination of operand types the words of a line can have. The mode is
+ * the operand type, or NO_OPERAND when there is no such operand (a one
+ * operand instruction only has a destination). Each entry has:
+ * - first_word: opcode in bits 9-6, source type in 5-4, destination in 3-2
+ *   (a missing operand leaves its bits 0)
+ * - length: the words the instruction takes - 1 + one per operand, one
+ *   more for each INDIRECT operand's index word, and just 2 for two
+ *   registers (they share a word)
+ * - legal: 1 if the instruction takes exactly these operand types. This
+ *   covers the operand count too, since a missing operand has to match
+ *   NO_TYPES and a present one can't
+ * 
+ * The compiler works the whole table out from INSTRUCTION_LIST - nothing
+ * is filled in at run time. The first pass does one lookup per instruction
+ * and the second pass copies first_word out of the entry it saved.
  */
-int get_register_number(const char *operand) {
-    int reg_num;
-    
-    if (!operand || operand[0] != 'r') return -1;
-    
-    reg_num = operand[1] - '0';  /* Convert character to number */
-    return (reg_num >= 0 && reg_num <= 7) ? reg_num : -1;
-}
+#define ENCODING_LENGTH(src, dest) \
+    ((src) == REGISTER && (dest) == REGISTER ? 2 : \
+     1 + ((src) != NO_OPERAND) + ((dest) != NO_OPERAND) + ((src) == INDIRECT) + ((dest) == INDIRECT))
 
-/*
- * PARSE_MATRIX_OPERAND - Parse matrix indexing operand
- * 
- * Takes operand like "M1[r2][r7]" and extracts:
- * - base_name: "M1" 
- * - Returns: pointer to base name (static buffer)
- * 
- * For matrix indexing, we treat it as direct addressing to the base symbol.
- * The actual index calculation would be done at runtime.
- */
-char *parse_matrix_operand(const char *operand) {
-    static char base_name[MAX_LABEL_LENGTH];
-    char *bracket_pos;
-    int base_len;
-    
-    if (!operand) return NULL;
-    
-    /* Find first bracket */
-    bracket_pos = strchr(operand, '[');
-    if (!bracket_pos) {
-        /* No brackets - just return the operand as-is */
-        strcpy(base_name, operand);
-        return base_name;
-    }
-    
-    /* Extract base name before first bracket */
-    base_len = bracket_pos - operand;
-    if (base_len >= MAX_LABEL_LENGTH) {
-        return NULL; /* Base name too long */
-    }
-    
-    strncpy(base_name, operand, base_len);
-    base_name[base_len] = '\0';
-    
-    return base_name;
-}
+#define ENCODING(opcode, src_types, dest_types, src, dest) \
+    { (unsigned short)((opcode) << 6 | ((src) & 3) << 4 | ((dest) & 3) << 2), \
+      (unsigned char)ENCODING_LENGTH(src, dest), \
+      (unsigned char)((src_types) >> (src) & (dest_types) >> (dest) & 1) }
+
+#define ENCODING_DESTS(opcode, src_types, dest_types, src) { \
+    ENCODING(opcode, src_types, dest_types, src, IMMEDIATE), \
+    ENCODING(opcode, src_types, dest_types, src, DIRECT), \
+    ENCODING(opcode, src_types, dest_types, src, INDIRECT), \
+    ENCODING(opcode, src_types, dest_types, src, REGISTER), \
+    ENCODING(opcode, src_types, dest_types, src, NO_OPERAND) }
+
+#define ENCODING_ROW(name, opcode, count, src_types, dest_types) { \
+    ENCODING_DESTS(opcode, src_types, dest_types, IMMEDIATE), \
+    ENCODING_DESTS(opcode, src_types, dest_types, DIRECT), \
+    ENCODING_DESTS(opcode, src_types, dest_types, INDIRECT), \
+    ENCODING_DESTS(opcode, src_types, dest_types, REGISTER), \
+    ENCODING_DESTS(opcode, src_types, dest_types, NO_OPERAND) },
+
+const encoding_t encoding_table[OPCODE_COUNT][OPERAND_MODES][OPERAND_MODES] = {
+    INSTRUCTION_LIST(ENCODING_ROW)
+};
+
+/* Row of "stop" in instruction_table (rows 0-15 are in opcode order) */
+#define STOP_ROW 16
+
+/* Directive names - indexed by directive_t */
+const char *directive_names[] = {
+    ".data", ".string", ".entry", ".extern", ".mat"
+};
+
+/* Macro keywords: the ones process_macros() uses, plus the older spelling */
+static const char *macro_keywords[] = {
+    "mcro", "mcroend", "macr", "endmacr"
+};
 
 /*
  * TRIM_WHITESPACE - Remove leading and trailing spaces from a string
@@ -171,85 +166,272 @@ char *trim_whitespace(char *str) {
 }
 
 /*
- * SPLIT_LINE - Break a line into individual words/tokens
+ * TRIM_SLICE - trim_whitespace for a line that is only a (text, length) slice
+ * 
+ * Used on lines that come straight out of the input file (source.c), which
+ * can't be changed - so instead of writing a '\0', this moves *text past the
+ * leading whitespace and returns the length without the trailing whitespace.
+ * Returns: The trimmed length (0 if the line is only whitespace)
+ */
+int trim_slice(const char **text, int length) {
+    const char *start = *text;
+    
+    while (length > 0 && isspace((unsigned char)*start)) {
+        start++;
+        length--;
+    }
+    while (length > 0 && isspace((unsigned char)start[length - 1])) {
+        length--;
+    }
+    
+    *text = start;
+    return length;
+}
+
+/*
+ * CHARACTER CLASSES
+ * 
+ * Finding out what a line is used to take several walks over it, every one
+ * calling isspace() for each character: trim it, check if it is empty, trim
+ * again to check for a comment, strchr for the label colon, trim the rest,
+ * then split it. Now scan_line answers the first questions once per line,
+ * and scan_line and tokenize_line test a character with one table lookup
+ * instead of a function call or a chain of comparisons.
+ * Only the first 64 characters have a class, the rest are 0 (C fills in the
+ * missing initializers with zeros).
+ */
+#define CHAR_SPACE 1   /* Whitespace, like isspace() in the C locale */
+#define CHAR_BREAK 2   /* Token separator: space, tab or comma */
+#define CHAR_END   4   /* The '\0' at the end of a line */
+#define CHAR_COLON 8   /* ':' after a label */
+
+static const unsigned char char_class[256] = {
+    /* 0-15: '\0', then '\t' '\n' '\v' '\f' '\r' */
+    4, 0, 0, 0, 0, 0, 0, 0, 0, 3, 1, 1, 1, 1, 0, 0,
+    /* 16-31 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 32-47: ' ' and ',' */
+    3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0,
+    /* 48-63: ':' */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0, 0, 0, 0
+};
+
+/*
+ * SCAN_LINE - Find the trimmed bounds, comment flag and label colon of a line
+ * 
+ * The text does not have to be null terminated and is not changed. Only the
+ * whitespace at the two ends is looked at character by character; the colon
+ * is found with memchr, which the C library does many bytes at a time.
+ * Example for "  LOOP: inc r1 ":
+ *   start 2, end 14, colon 6, is_comment 0
+ */
+void scan_line(const char *text, int length, line_scan_t *scan) {
+    int start = 0;
+    int end = length;
+    const char *colon;
+    
+    while (start < end && (char_class[(unsigned char)text[start]] & CHAR_SPACE)) {
+        start++;
+    }
+    while (end > start && (char_class[(unsigned char)text[end - 1]] & CHAR_SPACE)) {
+        end--;
+    }
+    
+    scan->start = start;
+    scan->end = end;
+    scan->is_comment = start < end && text[start] == ';';
+    colon = start < end ? memchr(text + start, ':', end - start) : NULL;
+    scan->colon = colon ? (int)(colon - text) : -1;
+}
+
+/*
+ * TOKENIZE_LINE - Break a line into individual words/tokens
  * 
  * This function is like the "split" function in Python - it takes a line
  * and breaks it up into separate words, handling commas, spaces, and tabs.
  * 
  * Example: "mov r1, r2" becomes ["mov", "r1", "r2"]
  * 
- * Parameters:
- * - line: The input string to split (gets modified!)
- * - count: Pointer to store how many parts we found
+ * Unlike strtok() this keeps no hidden state between calls, and unlike a
+ * malloc'd array of copies it costs nothing to clean up: every token is a
+ * (pointer, length) slice into the caller's own line buffer, stored in a
+ * token_list_t that the caller usually keeps on the stack.
  * 
- * Returns: Array of strings (char**), or NULL if memory allocation fails
+ * Parameters:
+ * - line: The input string to split (gets modified! a '\0' is written
+ *         after each token so the slices can also be used as C strings)
+ * - tokens: Where to store the slices
  * 
- * IMPORTANT: Caller must free the returned array using free_split_line()
+ * Returns: The number of tokens found. If the line had more than
+ *          MAX_TOKENS tokens, tokens->truncated is set.
  */
-char **split_line(char *line, int *count) {
-    char **parts = NULL;    /* Array to store the split parts */
-    char *token;            /* Current token from strtok */
-    int capacity = 10;      /* Initial capacity - will grow if needed */
-    char **temp;            /* C90: Declare at beginning for realloc */
+int tokenize_line(char *line, token_list_t *tokens) {
+    char *p = line;
+    char *start;
     
-    *count = 0;  /* Start with zero parts found */
+    tokens->count = 0;
+    tokens->truncated = 0;
     
-    /* Allocate initial array for storing parts */
-    parts = malloc(capacity * sizeof(char*));
-    if (!parts) {
-        return NULL;  /* Memory allocation failed */
+    while (*p) {
+        /* Skip separators: space, tab, or comma */
+        while (char_class[(unsigned char)*p] & CHAR_BREAK) p++;
+        if (*p == '\0') break;
+        
+        if (tokens->count >= MAX_TOKENS) {
+            tokens->truncated = 1;  /* No room - the rest of the line is ignored */
+            break;
+        }
+        
+        /* Find the end of this token */
+        start = p;
+        while (!(char_class[(unsigned char)*p] & (CHAR_BREAK | CHAR_END))) p++;
+        
+        tokens->tokens[tokens->count].text = start;
+        tokens->tokens[tokens->count].length = p - start;
+        tokens->count++;
+        
+        /* Terminate the token and move past the separator */
+        if (*p) {
+            *p++ = '\0';
+        }
     }
     
-    /* Use strtok to break line into tokens, separated by space, tab, or comma */
-    token = strtok(line, " \t,");
-    while (token != NULL) {
-        /* If we've filled our array, make it bigger (dynamic array growth) */
-        if (*count >= capacity) {
-            capacity *= 2;  /* Double the size */
-            temp = realloc(parts, capacity * sizeof(char*));  /* Use pre-declared variable */
-            if (!temp) {
-                free_split_line(parts, *count);  /* Clean up on failure */
-                return NULL;
-            }
-            parts = temp;
+    return tokens->count;
+}
+
+/*
+ * DATA DIRECTIVE SCANNERS - .data, .string and .mat without tokenize_line
+ * 
+ * A data table can have thousands of values on one line, far more than
+ * MAX_TOKENS, and splitting them into tokens first only to convert each one
+ * afterwards is two passes over the text. These read the values right out
+ * of the line, in one pass, into an array the caller made big enough. They
+ * use the same separators as tokenize_line, so a line means what it meant
+ * when it was tokenized.
+ */
+#define MAX_MATRIX_SIZE 1024   /* Most rows (or columns) a .mat can have */
+
+/*
+ * DATA_DIRECTIVE - Check if a line starts with .data, .string or .mat
+ * 
+ * text is the line after its label. The name has to be a whole word.
+ * Returns: the directive_t, with *rest just after the name, or -1
+ */
+int data_directive(const char *text, const char **rest) {
+    static const directive_t data_directives[] = { DIR_DATA, DIR_STRING, DIR_MAT };
+    const char *name;
+    size_t length;
+    size_t i;
+    
+    if (text[0] != '.') {
+        return -1;
+    }
+    for (i = 0; i < sizeof(data_directives) / sizeof(data_directives[0]); i++) {
+        name = directive_names[data_directives[i]];
+        length = strlen(name);
+        if (strncmp(text, name, length) == 0 && (char_class[(unsigned char)text[length]] & (CHAR_BREAK | CHAR_END))) {
+            *rest = text + length;
+            return data_directives[i];
         }
+    }
+    return -1;
+}
+
+/*
+ * SCAN_DATA_VALUES - Convert every number of a .data (or .mat) line
+ * 
+ * Each word between separators is one value, read the way atoi reads it:
+ * whitespace, a sign, then digits up to the first character that is not
+ * one (so "5x" is 5 and "x" is 0, like before).
+ * values needs room for (strlen(text) + 1) / 2 numbers.
+ * Returns: how many values were written
+ */
+int scan_data_values(const char *text, int *values) {
+    const unsigned char *p = (const unsigned char *)text;
+    unsigned int value;
+    int negative;
+    int count = 0;
+    
+    for (;;) {
+        while (char_class[*p] & CHAR_BREAK) p++;
+        if (*p == '\0') break;
         
-        /* Allocate memory for this token and copy it */
-        parts[*count] = malloc(strlen(token) + 1);
-        if (!parts[*count]) {
-            free_split_line(parts, *count);
-            return NULL;
+        while (char_class[*p] & CHAR_SPACE) p++;  /* atoi skips '\r', '\v' and so on */
+        negative = *p == '-';
+        if (*p == '-' || *p == '+') p++;
+        for (value = 0; *p >= '0' && *p <= '9'; p++) {
+            value = value * 10 + (unsigned int)(*p - '0');
         }
-        strcpy(parts[*count], token);
-        (*count)++;
+        values[count++] = (int)(negative ? 0U - value : value);
         
-        /* Get next token */
-        token = strtok(NULL, " \t,");
+        while (!(char_class[*p] & (CHAR_BREAK | CHAR_END))) p++;  /* The rest of the word */
     }
-    
-    return parts;
+    return count;
 }
 
 /*
- * FREE_SPLIT_LINE - Clean up memory allocated by split_line()
+ * SCAN_STRING_VALUES - One value per character of a .string, then a 0
  * 
- * This function frees all the memory that split_line() allocated.
- * Always call this after you're done with the result from split_line()!
+ * Only the first word is used, and it has to be in quotes - regular
+ * quotes (") or the 3-byte Unicode quotes some editors put in.
+ * values needs room for strlen(text) + 1 values.
+ * Returns: how many values were written (0 if the word is not quoted)
+ */
+int scan_string_values(const char *text, int *values) {
+    const char *str;
+    int len;
+    int start_offset;
+    int end_offset;
+    int count = 0;
+    int i;
+    
+    while (char_class[(unsigned char)*text] & CHAR_BREAK) text++;
+    str = text;
+    while (!(char_class[(unsigned char)*text] & (CHAR_BREAK | CHAR_END))) text++;
+    len = (int)(text - str);
+    
+    if (len == 0 || !((str[0] == '"' && str[len - 1] == '"') ||
+                      ((unsigned char)str[0] >= 128 && (unsigned char)str[len - 1] >= 128))) {
+        return 0;
+    }
+    start_offset = (str[0] == '"') ? 1 : 3;
+    end_offset = (str[len - 1] == '"') ? 1 : 3;
+    for (i = start_offset; i < len - end_offset; i++) {
+        values[count++] = str[i];
+    }
+    values[count++] = 0;  /* Null terminator */
+    return count;
+}
+
+/*
+ * SCAN_MATRIX_SIZE - Read the "[rows][columns]" at the start of a .mat line
  * 
- * C programming rule: For every malloc(), there must be a free()!
+ * Both sizes have to be 1 to MAX_MATRIX_SIZE, and the word has to end right
+ * after the second ']'.
+ * Returns: the text after the sizes, or NULL if they are not there
  */
-void free_split_line(char **parts, int count) {
-    int i;  /* C90: Declare loop variable at beginning */
-    
-    if (!parts) return;  /* Nothing to free */
-    
-    /* Free each individual string */
-    for (i = 0; i < count; i++) {  /* FIXED: Use pre-declared variable */
-        free(parts[i]);
+const char *scan_matrix_size(const char *text, int *rows, int *columns) {
+    int *size[2];
+    int i;
+    
+    size[0] = rows;
+    size[1] = columns;
+    while (char_class[(unsigned char)*text] & CHAR_BREAK) text++;
+    for (i = 0; i < 2; i++) {
+        if (*text++ != '[' || *text < '0' || *text > '9') {
+            return NULL;
+        }
+        for (*size[i] = 0; *text >= '0' && *text <= '9'; text++) {
+            if (*size[i] > MAX_MATRIX_SIZE) {
+                return NULL;
+            }
+            *size[i] = *size[i] * 10 + (*text - '0');
+        }
+        if (*text++ != ']' || *size[i] < 1 || *size[i] > MAX_MATRIX_SIZE) {
+            return NULL;
+        }
     }
-    
-    /* Free the array itself */
-    free(parts);
+    return (char_class[(unsigned char)*text] & (CHAR_BREAK | CHAR_END)) ? text : NULL;
 }
 
 /*
@@ -291,25 +473,23 @@ int is_comment_line(const char *line) {
  * Example: "LOOP: mov r1, r2"
  * - Extracts "LOOP" as the label.
  * - Sets *line_ptr to point to " mov r1, r2".
+ * colon is where the first ':' in the line is (scan_line already found it),
+ * or -1 if there is none.
  *
- * Returns: Pointer to static buffer containing the label, or NULL if no label.
- *
- * IMPORTANT: Uses a static buffer for the label, so its value is only valid
- *            until the next call to this function.
+ * Returns: Pointer to the label (inside the caller's MAX_LABEL_LENGTH
+ *          buffer), or NULL if no label.
  */
-char *extract_label(char *line, char **line_ptr) {
-    static char label[MAX_LABEL_LENGTH];
+char *extract_label(char *line, int colon, char **line_ptr, char *label) {
     char *colon_pos;
     int label_len;
 
-    colon_pos = strchr(line, ':');
-
-    if (!colon_pos) {
+    if (colon < 0) {
         *line_ptr = line; /* No label, rest of the line is the original line */
         return NULL;
     }
 
-    label_len = colon_pos - line;
+    colon_pos = line + colon;
+    label_len = colon;
     if (label_len >= MAX_LABEL_LENGTH) {
         *line_ptr = line; /* Treat as if no label was found */
         return NULL; /* Label too long */
@@ -365,10 +545,10 @@ int string_to_int(const char *str) {
  * If no extension exists, just appends the new extension
  * Example: create_filename("program", ".am") returns "program.am"
  * 
- * Returns: Newly allocated string with the filename, or NULL on error
- * IMPORTANT: Caller must free() the returned string!
+ * Returns: New string in the arena with the filename, or NULL on error
+ * (it goes away with the next arena_reset - no free() needed)
  */
-char *create_filename(const char *base, const char *extension) {
+char *create_filename(arena_t *arena, const char *base, const char *extension) {
     char *filename;
     char *dot_pos;
     int base_len;
@@ -384,7 +564,7 @@ char *create_filename(const char *base, const char *extension) {
     }
     
     /* Allocate memory for new filename */
-    filename = malloc(base_len + strlen(extension) + 1);
+    filename = arena_alloc(arena, base_len + strlen(extension) + 1);
     if (!filename) {
         return NULL;  /* Memory allocation failed */
     }
@@ -400,38 +580,183 @@ char *create_filename(const char *base, const char *extension) {
 }
 
 /*
- * PRINT_ERROR - Display error message with file and line information
+ * CREATE_OUTPUT_FILENAME - create_filename for a file we write
+ * 
+ * Without an output directory this is just create_filename (the outputs go
+ * next to the .as file). With one, only the last part of the base name is used:
+ * Example: create_output_filename(arena, "build", "src/prog", ".ob") returns "build/prog.ob"
+ * 
+ * Returns: New string in the arena, or NULL on error
+ */
+char *create_output_filename(arena_t *arena, const char *dir, const char *base, const char *extension) {
+    const char *slash;
+    char *name;
+    char *filename;
+    
+    if (!dir) {
+        return create_filename(arena, base, extension);
+    }
+    
+    /* Only the file's own name, without the directories in front of it */
+    slash = strrchr(base, '/');
+    name = create_filename(arena, slash ? slash + 1 : base, extension);
+    if (!name) {
+        return NULL;
+    }
+    
+    filename = arena_alloc(arena, strlen(dir) + 1 + strlen(name) + 1);
+    if (!filename) {
+        return NULL;
+    }
+    sprintf(filename, "%s/%s", dir, name);
+    return filename;
+}
+
+/*
+ * PRINT_PROGRESS - Print one of the "Stage N: ..." style progress messages
  * 
- * Standardized error reporting function used throughout the assembler
- * Makes it easy to show users exactly where problems occurred
+ * Works like fprintf to the context's output stream, except that nothing is
+ * printed with --quiet. Errors go through report_error (diagnostics.c), so
+ * --quiet never hides a problem.
  */
-void print_error(const char *filename, int line_number, const char *message) {
-    if (line_number > 0) {
-        /* Include line number if provided */
-        fprintf(stderr, "Error in file %s, line %d: %s\n", filename, line_number, message);
+void print_progress(assembler_context_t *ctx, const char *format, ...) {
+    va_list args;
+    
+    if (ctx->options->quiet) {
+        return;
+    }
+    va_start(args, format);
+    vfprintf(ctx->out, format, args);
+    va_end(args);
+}
+
+/*
+ * CLASSIFY_WORD - Find out what kind of word a token is, in one step
+ * 
+ * Every token used to be compared against the whole instruction table,
+ * then against each directive name, and so on - often several times for
+ * the same token. Instead we look at the length and the first one or two
+ * characters, which is enough to pick the ONLY keyword the word could be.
+ * Then a single strcmp confirms it.
+ * 
+ * Example: "jsr" has length 3, starts with 'j' and the second letter is
+ * not 'm', so it can only be the jsr row of instruction_table.
+ * 
+ * Parameters:
+ * - word: a NUL terminated token
+ * - index: if not NULL, receives the instruction_table row, the
+ *          directive_t value or the register number
+ * 
+ * Returns: The word class (WORD_IDENTIFIER if it is not a keyword)
+ */
+word_class_t classify_word(const char *word, int *index) {
+    word_class_t type = WORD_IDENTIFIER;
+    int candidate = -1;
+    const char *keyword;
+    
+    switch (strlen(word)) {
+        case 2:
+            /* Registers r0 through r7 - nothing else to check */
+            if (word[0] == 'r' && word[1] >= '0' && word[1] <= '7') {
+                if (index) *index = word[1] - '0';
+                return WORD_REGISTER;
+            }
+            return WORD_IDENTIFIER;
+            
+        case 3:
+            /* The 16 three-letter mnemonics - the table row is the opcode */
+            type = WORD_INSTRUCTION;
+            switch (word[0]) {
+                case 'm': candidate = MOV_OP; break;
+                case 'c': candidate = (word[1] == 'm') ? CMP_OP : CLR_OP; break;
+                case 'a': candidate = ADD_OP; break;
+                case 's': candidate = SUB_OP; break;
+                case 'n': candidate = NOT_OP; break;
+                case 'l': candidate = LEA_OP; break;
+                case 'i': candidate = INC_OP; break;
+                case 'd': candidate = DEC_OP; break;
+                case 'j': candidate = (word[1] == 'm') ? JMP_OP : JSR_OP; break;
+                case 'b': candidate = BNE_OP; break;
+                case 'r': candidate = (word[1] == 'e') ? RED_OP : RTS_OP; break;
+                case 'p': candidate = PRN_OP; break;
+                case 'h': candidate = HLT_OP; break;
+                default: break;
+            }
+            break;
+            
+        case 4:
+            if (word[0] == 's') {
+                type = WORD_INSTRUCTION;    /* stop */
+                candidate = STOP_ROW;
+            } else if (word[0] == '.') {
+                type = WORD_DIRECTIVE;      /* .mat */
+                candidate = DIR_MAT;
+            } else if (word[0] == 'm') {
+                type = WORD_MACRO_KEYWORD;  /* mcro or macr */
+                candidate = (word[1] == 'c') ? 0 : 2;
+            }
+            break;
+            
+        case 5:
+            type = WORD_DIRECTIVE;          /* .data */
+            candidate = DIR_DATA;
+            break;
+            
+        case 6:
+            type = WORD_DIRECTIVE;          /* .entry */
+            candidate = DIR_ENTRY;
+            break;
+            
+        case 7:
+            if (word[0] == '.') {
+                type = WORD_DIRECTIVE;      /* .string or .extern */
+                candidate = (word[1] == 's') ? DIR_STRING : DIR_EXTERN;
+            } else {
+                type = WORD_MACRO_KEYWORD;  /* mcroend or endmacr */
+                candidate = (word[0] == 'm') ? 1 : 3;
+            }
+            break;
+            
+        default:
+            break;
+    }
+    
+    if (candidate < 0) {
+        return WORD_IDENTIFIER;
+    }
+    
+    /* Confirm the candidate - this is the only string comparison we do */
+    if (type == WORD_INSTRUCTION) {
+        keyword = instruction_table[candidate].name;
+    } else if (type == WORD_DIRECTIVE) {
+        keyword = directive_names[candidate];
     } else {
-        /* General file error without specific line */
-        fprintf(stderr, "Error in file %s: %s\n", filename, message);
+        keyword = macro_keywords[candidate];
+    }
+    if (strcmp(keyword, word) != 0) {
+        return WORD_IDENTIFIER;
     }
+    
+    if (index) *index = candidate;
+    return type;
 }
 
 /*
  * GET_INSTRUCTION_INFO - Look up information about an instruction
  * 
- * Searches the instruction_table for the given instruction name
- * Returns pointer to the instruction info, or NULL if not found
+ * Returns pointer to the instruction_table row for the given name,
+ * or NULL if it is not an instruction.
  * 
  * This is how we validate that "mov" is a real instruction and
  * find out how many operands it needs, what types are allowed, etc.
+ * Code that classifies a token anyway should use classify_word() and
+ * index instruction_table directly instead of calling this again.
  */
 instruction_info_t *get_instruction_info(const char *name) {
-    int i;  /* C90: Declare loop variable at beginning */
+    int row;
     
-    /* Linear search through instruction table */
-    for (i = 0; instruction_table[i].opcode != -1; i++) {  /* FIXED: Use pre-declared variable */
-        if (strcmp(instruction_table[i].name, name) == 0) {
-            return &instruction_table[i];  /* Found it! */
-        }
+    if (classify_word(name, &row) == WORD_INSTRUCTION) {
+        return &instruction_table[row];  /* Found it! */
     }
     return NULL;  /* Not found */
 }
@@ -443,34 +768,12 @@ instruction_info_t *get_instruction_info(const char *name) {
  * - All instruction names (mov, add, etc.)
  * - All directive names (.data, .string, etc.)
  * - All register names (r0, r1, ..., r7)
- * - Macro keywords (macr, endmacr)
+ * - Macro keywords (mcro, mcroend, macr, endmacr)
  * 
  * This prevents users from creating labels like "mov:" or "r1:"
  */
 int is_reserved_word(const char *word) {
-    /* Check if word is an instruction name */
-    if (get_instruction_info(word)) {
-        return 1;  /* Found in instruction table = reserved */
-    }
-    
-    /* Check if word is a directive */
-    if (strcmp(word, ".data") == 0 || strcmp(word, ".string") == 0 ||
-        strcmp(word, ".entry") == 0 || strcmp(word, ".extern") == 0) {
-        return 1;
-    }
-    
-    /* Check if word is a register name (r0 through r7) */
-    if (word[0] == 'r' && strlen(word) == 2 && 
-        word[1] >= '0' && word[1] <= '7') {
-        return 1;
-    }
-    
-    /* Check macro-related keywords */
-    if (strcmp(word, "macr") == 0 || strcmp(word, "endmacr") == 0) {
-        return 1;
-    }
-    
-    return 0;  /* Not reserved */
+    return classify_word(word, NULL) != WORD_IDENTIFIER;
 }
 
 /*
@@ -485,83 +788,30 @@ opcode_t get_opcode(const char *instruction) {
 }
 
 /*
- * GET_INSTRUCTION_LENGTH - Calculate how many memory words an instruction needs
+ * HASH_STRING - Compute a hash value for a name
  * 
- * This is CRUCIAL for the first pass - we need to know how much memory
- * each instruction will take up so we can assign correct addresses to labels
+ * Uses the FNV-1a algorithm: for every character we XOR it into the hash
+ * and then multiply by a prime. It is short, fast and spreads similar
+ * names (LABEL1, LABEL2, ...) well across a hash table.
  * 
- * Length calculation:
- * - Base instruction word: 1 word (always)
- * - Each operand: usually 1 additional word
- * - SPECIAL CASE: Two registers can share one word (saves space)
- * 
- * Examples:
- * - "mov r1, r2" = 2 words (1 base + 1 shared register word)
- * - "mov #5, r1" = 3 words (1 base + 1 immediate + 1 register)
- * - "mov LABEL, r1" = 3 words (1 base + 1 address + 1 register)
+ * The result is kept to 32 bits so it is the same on every platform.
  */
-int get_instruction_length(const char *instruction, char **operands, int operand_count) {
-    int length = 1; /* Base instruction word */
-    instruction_info_t *info = get_instruction_info(instruction);
-    if (!info) {
-        return -1;  /* Unknown instruction */
-    }
-    
-    if (operand_count != info->operand_count) {
-        return -1;  /* Wrong number of operands */
-    }
-    if (operand_count == 0) {
-        return length;
-    }
-
-    if (operand_count == 1) {
-        operand_type_t type = get_operand_type(operands[0]);
-        if (type == (operand_type_t)-1 || !info->valid_dest_types[type]) {
-            return -1;
-        }
-    }
-
-    /*
-     * VALIDATE TWO-OPERAND INSTRUCTIONS
-     * Check that both operands are valid for this instruction type.
-     * For example, "mov" accepts most operand types, but "lea" might be more restrictive.
-     */
-    if (operand_count == 2) {
-        operand_type_t src_type = get_operand_type(operands[0]);
-        operand_type_t dest_type = get_operand_type(operands[1]);
-        
-        /* Basic operand type validation */
-        if (src_type == (operand_type_t)-1 || dest_type == (operand_type_t)-1) {
-            return -1;  /* Invalid operand type */
-        }
-        
-        /* Check if source operand type is allowed for this instruction */
-        if (!info->valid_src_types[src_type]) {
-            return -1;  /* Invalid source type */
-        }
-        
-        /* Check if destination operand type is allowed for this instruction */
-        if (!info->valid_dest_types[dest_type]) {
-            return -1;  /* Invalid destination type */
-        }
-    }
+unsigned long hash_string(const char *str) {
+    return hash_text(str, (int)strlen(str));
+}
 
-    if (operand_count == 2 && get_operand_type(operands[0]) == REGISTER && get_operand_type(operands[1]) == REGISTER) {
-        /* Two registers can be packed into one additional word */
-        length += 1; /* One additional word for both registers */
-    } else {
-        /* Each operand gets its own word */
-        /* Matrix addressing (INDIRECT) requires an additional word for index registers */
-        int i; /* C90: Declare variables at beginning of block */
-        
-        length += operand_count;
-        
-        for (i = 0; i < operand_count; i++) {
-            if (get_operand_type(operands[i]) == INDIRECT) {
-                length += 1; /* Additional word for matrix index registers */
-            }
-        }
+/*
+ * HASH_TEXT - hash_string for a name that is a slice (no '\0' needed)
+ * Gives the same value as hash_string on the same characters.
+ */
+unsigned long hash_text(const char *text, int length) {
+    unsigned long hash = 2166136261UL;  /* FNV offset basis */
+    int i;
+    
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash = (hash * 16777619UL) & 0xFFFFFFFFUL;  /* FNV prime */
     }
     
-    return length;
-}
\ No newline at end of file
+    return hash;
+}
@@ -1,21 +1,31 @@
 /* Utility functions */  
 /* Simple header - demonstrates that not all headers need includes */
 
+/* Instruction table and directive names - defined in utils.c */
+extern instruction_info_t instruction_table[];
+extern const encoding_t encoding_table[OPCODE_COUNT][OPERAND_MODES][OPERAND_MODES];
+extern const char *directive_names[];
+
 /* Function declarations */
 char *trim_whitespace(char *str);
-char **split_line(char *line, int *count);
-void free_split_line(char **parts, int count);
+int trim_slice(const char **text, int length);
+void scan_line(const char *text, int length, line_scan_t *scan);
+int tokenize_line(char *line, token_list_t *tokens);
+int data_directive(const char *text, const char **rest);
+int scan_data_values(const char *text, int *values);
+int scan_string_values(const char *text, int *values);
+const char *scan_matrix_size(const char *text, int *rows, int *columns);
 int is_empty_line(const char *line);
 int is_comment_line(const char *line);
-char *extract_label(char *line, char **line_ptr);
+char *extract_label(char *line, int colon, char **line_ptr, char *label);
 int is_valid_integer(const char *str);
 int string_to_int(const char *str);
-char *create_filename(const char *base, const char *extension);
-void print_error(const char *filename, int line_number, const char *message);
+char *create_filename(arena_t *arena, const char *base, const char *extension);
+char *create_output_filename(arena_t *arena, const char *dir, const char *base, const char *extension);
+void print_progress(assembler_context_t *ctx, const char *format, ...);
+word_class_t classify_word(const char *word, int *index);
 instruction_info_t *get_instruction_info(const char *name);
 int is_reserved_word(const char *word);
 opcode_t get_opcode(const char *instruction);
-int get_instruction_length(const char *instruction, char **operands, int operand_count);
-operand_type_t get_operand_type(const char *operand);
-int get_register_number(const char *operand);
-char *parse_matrix_operand(const char *operand);
\ No newline at end of file
+unsigned long hash_string(const char *str);
+unsigned long hash_text(const char *text, int length);
\ No newline at end of file
@@ -0,0 +1,432 @@
+/*
+ * OUTPUT WRITER MODULE (--async-write)
+ *
+ * Stage 4 used to write the .ob, .ent and .ext files itself - fopen, fwrite,
+ * fclose, then the next one - and only after the last one could the next .as
+ * file start. On slow (network) storage most of a run is spent waiting for
+ * that. With --async-write the finished buffer of each output file goes on a
+ * queue instead, and one background thread writes the files while the
+ * assembler goes on with the next .as file:
+ *
+ * - write_output_file (second_pass.c) hands the buffer over with
+ *   writer_submit, and the writer frees it once it is written.
+ * - Every file is written unbuffered with one fwrite, so it goes to the
+ *   system as one big write and not in stdio-sized pieces.
+ * - With --fsync every file is fsync'ed before the run ends, in batches: a
+ *   written file stays open until WRITER_SYNC_BATCH of them are waiting (or
+ *   the queue runs empty), and then they are all synced and closed, so the
+ *   thread doesn't stop for the disk after every small file.
+ * - The outputs of one assembled file share the id writer_begin gave it, and
+ *   a failed write is recorded for that id. Stage 4 doesn't wait for them:
+ *   the caller calls writer_wait later (serial mode after the next file is
+ *   assembled, -j when the file's messages are printed), so a failed write
+ *   still makes that file fail. writer_finish only reports what failed after
+ *   that (an fsync that fails). --cache-dir and --link wait at once, since
+ *   they need the files on disk.
+ *
+ * The queue holds at most WRITER_MAX_QUEUED bytes. writer_submit waits while
+ * it is fuller than that, so a disk that can't keep up slows the assembler
+ * down instead of making it keep every output in memory.
+ *
+ * Built with NO_THREADS there is no writer thread: writer_start returns NULL
+ * and the outputs are written directly, like before.
+ */
+
+/* pthreads and fsync need the POSIX declarations, which -ansi hides by default */
+#ifndef NO_THREADS
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "assembler.h"  /* Must include this first for basic types */
+#include "writer.h"
+
+#ifndef NO_THREADS
+
+#define WRITER_MAX_QUEUED (64L * 1024 * 1024)  /* Bytes of output waiting before writer_submit blocks */
+#define WRITER_SYNC_BATCH 16                    /* Files that are fsync'ed together with --fsync */
+
+/* One output file waiting to be written (and with --fsync, to be synced) */
+typedef struct write_job {
+    struct write_job *next;          /* Next job in the queue */
+    int file;                        /* writer_begin id of the file it is an output of */
+    char *filename;                  /* Own copy - the caller's is in its arena */
+    char *buffer;                    /* The whole file, freed as soon as it is written */
+    size_t length;
+    int binary;                      /* 1 for a .bin file ("wb") */
+    FILE *stream;                    /* Stays open until the batch is synced (--fsync) */
+} write_job_t;
+
+/* What the writer knows about one assembled file */
+typedef struct {
+    char *source;                    /* Its name from the command line, for messages */
+    int pending;                     /* Outputs submitted but not written yet */
+    int failed;                      /* Some output could not be written */
+    char *failed_output;             /* The first one (NULL if there was no memory to copy it) */
+    int reported;                    /* writer_wait already gave the failure to the file */
+} writer_file_t;
+
+struct output_writer {
+    pthread_t thread;
+    pthread_mutex_t lock;            /* Protects everything up to batch */
+    pthread_cond_t work;             /* Signalled when a job is queued, or on stop */
+    pthread_cond_t written;          /* Signalled every time a job was written */
+    write_job_t *head;               /* Oldest job - written first */
+    write_job_t *tail;
+    long queued_bytes;               /* Sum of the queued jobs' lengths */
+    int stopping;                    /* writer_finish was called */
+    int sync_files;                  /* --fsync */
+    writer_file_t *files;
+    int file_count;
+    int file_capacity;
+    write_job_t *batch[WRITER_SYNC_BATCH];  /* Written, waiting for fsync (writer thread only) */
+    int batch_count;
+};
+
+static void *writer_thread(void *arg);
+static int write_job(output_writer_t *writer, write_job_t *job);
+static void sync_batch(output_writer_t *writer);
+static void record_failure(output_writer_t *writer, int file, const char *filename);
+static void free_job(write_job_t *job);
+
+/*
+ * WRITER_START - Create the writer and start its thread
+ * sync_files is 1 with --fsync.
+ * Returns: the writer, or NULL if it could not be started (write directly then)
+ */
+output_writer_t *writer_start(int sync_files) {
+    output_writer_t *writer = calloc(1, sizeof(output_writer_t));
+
+    if (!writer) {
+        return NULL;
+    }
+    writer->sync_files = sync_files;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work, NULL);
+    pthread_cond_init(&writer->written, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+        pthread_cond_destroy(&writer->written);
+        pthread_cond_destroy(&writer->work);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+/*
+ * WRITER_BEGIN - Get the id the outputs of one assembled file are written under
+ * Returns: the id, or -1 if there is no memory (write that file directly then)
+ */
+int writer_begin(output_writer_t *writer, const char *source) {
+    writer_file_t *temp;
+    char *copy;
+    int file = -1;
+
+    copy = malloc(strlen(source) + 1);
+    if (!copy) {
+        return -1;
+    }
+    strcpy(copy, source);
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->file_count >= writer->file_capacity) {
+        temp = realloc(writer->files, (writer->file_capacity ? writer->file_capacity * 2 : 16) * sizeof(writer_file_t));
+        if (temp) {
+            writer->files = temp;
+            writer->file_capacity = writer->file_capacity ? writer->file_capacity * 2 : 16;
+        }
+    }
+    if (writer->file_count < writer->file_capacity) {
+        file = writer->file_count++;
+        writer->files[file].source = copy;
+        writer->files[file].pending = 0;
+        writer->files[file].failed = 0;
+        writer->files[file].failed_output = NULL;
+        writer->files[file].reported = 0;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    if (file < 0) {
+        free(copy);
+    }
+    return file;
+}
+
+/*
+ * WRITER_SUBMIT - Queue buffer to be written as filename
+ *
+ * On SUCCESS the buffer belongs to the writer. On an error (no memory for the
+ * job) it is still the caller's, who should write it directly.
+ */
+error_code_t writer_submit(output_writer_t *writer, int file, const char *filename, char *buffer, size_t length, int binary) {
+    write_job_t *job = malloc(sizeof(write_job_t));
+
+    if (!job) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    job->filename = malloc(strlen(filename) + 1);
+    if (!job->filename) {
+        free(job);
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    strcpy(job->filename, filename);
+    job->next = NULL;
+    job->file = file;
+    job->buffer = buffer;
+    job->length = length;
+    job->binary = binary;
+    job->stream = NULL;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued_bytes > 0 && writer->queued_bytes + (long)length > WRITER_MAX_QUEUED) {
+        pthread_cond_wait(&writer->written, &writer->lock);  /* The disk is behind - wait for it */
+    }
+    if (writer->tail) {
+        writer->tail->next = job;
+    } else {
+        writer->head = job;
+    }
+    writer->tail = job;
+    writer->queued_bytes += (long)length;
+    writer->files[file].pending++;
+    pthread_cond_signal(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+    return SUCCESS;
+}
+
+/*
+ * WRITER_WAIT - Wait until every output of file is written
+ *
+ * With --fsync they may not be synced yet - a sync that fails after this is
+ * still reported by writer_finish. A failure returned here is not reported
+ * again, the caller tells the user.
+ * Returns: SUCCESS, or ERROR_FILE_NOT_FOUND if one of them could not be written
+ */
+error_code_t writer_wait(output_writer_t *writer, int file) {
+    error_code_t result;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->files[file].pending > 0) {
+        pthread_cond_wait(&writer->written, &writer->lock);
+    }
+    result = writer->files[file].failed ? ERROR_FILE_NOT_FOUND : SUCCESS;
+    writer->files[file].reported = writer->files[file].failed;
+    pthread_mutex_unlock(&writer->lock);
+    return result;
+}
+
+/*
+ * WRITER_FINISH - Write (and sync) everything still queued, then stop the writer
+ *
+ * Every file with an output that could not be written (and that writer_wait
+ * did not return already) gets a message on errors.
+ * The writer is freed (NULL is fine - then there is nothing to do).
+ * Returns: how many files got a message
+ */
+int writer_finish(output_writer_t *writer, FILE *errors) {
+    writer_file_t *file;
+    int failed = 0;
+    int i;
+
+    if (!writer) {
+        return 0;
+    }
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = 1;
+    pthread_cond_signal(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    for (i = 0; i < writer->file_count; i++) {
+        file = &writer->files[i];
+        if (file->failed && !file->reported) {
+            fprintf(errors, "Error: Could not write %s%s%s of '%s'.\n",
+                    file->failed_output ? "'" : "", file->failed_output ? file->failed_output : "the output files",
+                    file->failed_output ? "'" : "", file->source);
+            failed++;
+        }
+        free(file->failed_output);
+        free(file->source);
+    }
+    free(writer->files);
+    pthread_cond_destroy(&writer->written);
+    pthread_cond_destroy(&writer->work);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+    return failed;
+}
+
+/*
+ * WRITER_THREAD - Thread function: write the queued jobs, oldest first
+ *
+ * The lock is only held to take a job and to record how it went - the
+ * writing itself happens without it, so writer_submit never waits for the disk
+ * (unless the queue is full).
+ */
+static void *writer_thread(void *arg) {
+    output_writer_t *writer = (output_writer_t *)arg;
+    write_job_t *job;
+    int written;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        if (!writer->head) {
+            if (writer->batch_count > 0) {
+                /* Nothing else to do right now - a good time to sync */
+                pthread_mutex_unlock(&writer->lock);
+                sync_batch(writer);
+                pthread_mutex_lock(&writer->lock);
+                continue;
+            }
+            if (writer->stopping) {
+                break;
+            }
+            pthread_cond_wait(&writer->work, &writer->lock);
+            continue;
+        }
+        job = writer->head;
+        writer->head = job->next;
+        if (!writer->head) {
+            writer->tail = NULL;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        written = write_job(writer, job);
+
+        pthread_mutex_lock(&writer->lock);
+        if (!written) {
+            record_failure(writer, job->file, job->filename);
+        }
+        writer->queued_bytes -= (long)job->length;
+        writer->files[job->file].pending--;
+        pthread_cond_broadcast(&writer->written);
+
+        if (job->stream) {
+            writer->batch[writer->batch_count++] = job;  /* Synced and closed later */
+            if (writer->batch_count == WRITER_SYNC_BATCH) {
+                pthread_mutex_unlock(&writer->lock);
+                sync_batch(writer);
+                pthread_mutex_lock(&writer->lock);
+            }
+        } else {
+            free_job(job);
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/*
+ * WRITE_JOB - Write one output file (on the writer thread)
+ *
+ * With --fsync a file that was written fine is left open in job->stream for
+ * sync_batch. The buffer is freed either way.
+ * Returns: 1 if the file was written, 0 if not
+ */
+static int write_job(output_writer_t *writer, write_job_t *job) {
+    FILE *file;
+    int ok = 0;
+
+    file = fopen(job->filename, job->binary ? "wb" : "w");
+    if (file) {
+        setvbuf(file, NULL, _IONBF, 0);  /* One write for the whole buffer */
+        ok = fwrite(job->buffer, 1, job->length, file) == job->length;
+        if (ok && writer->sync_files) {
+            job->stream = file;
+        } else if (fclose(file) != 0) {
+            ok = 0;
+        }
+    }
+    free(job->buffer);
+    job->buffer = NULL;
+    return ok;
+}
+
+/*
+ * SYNC_BATCH - fsync and close every file in the batch (on the writer thread)
+ */
+static void sync_batch(output_writer_t *writer) {
+    write_job_t *job;
+    int synced;
+    int i;
+
+    for (i = 0; i < writer->batch_count; i++) {
+        job = writer->batch[i];
+        synced = fsync(fileno(job->stream)) == 0;
+        if (fclose(job->stream) != 0) {
+            synced = 0;
+        }
+        if (!synced) {
+            pthread_mutex_lock(&writer->lock);
+            record_failure(writer, job->file, job->filename);
+            pthread_mutex_unlock(&writer->lock);
+        }
+        free_job(job);
+    }
+    writer->batch_count = 0;
+}
+
+/*
+ * RECORD_FAILURE - Remember that an output of file could not be written
+ * Called with the lock held. Only the first failed output's name is kept.
+ */
+static void record_failure(output_writer_t *writer, int file, const char *filename) {
+    writer_file_t *entry = &writer->files[file];
+
+    if (!entry->failed) {
+        entry->failed = 1;
+        entry->failed_output = malloc(strlen(filename) + 1);
+        if (entry->failed_output) {
+            strcpy(entry->failed_output, filename);
+        }
+    }
+}
+
+/*
+ * FREE_JOB - Give back a job that is done
+ */
+static void free_job(write_job_t *job) {
+    free(job->buffer);
+    free(job->filename);
+    free(job);
+}
+
+#else /* NO_THREADS */
+
+/* No threads - there is never a writer, so the outputs are written directly */
+output_writer_t *writer_start(int sync_files) {
+    (void)sync_files;
+    return NULL;
+}
+
+int writer_begin(output_writer_t *writer, const char *source) {
+    (void)writer;
+    (void)source;
+    return -1;
+}
+
+error_code_t writer_submit(output_writer_t *writer, int file, const char *filename, char *buffer, size_t length, int binary) {
+    (void)writer;
+    (void)file;
+    (void)filename;
+    (void)buffer;
+    (void)length;
+    (void)binary;
+    return ERROR_MEMORY_ALLOCATION;
+}
+
+error_code_t writer_wait(output_writer_t *writer, int file) {
+    (void)writer;
+    (void)file;
+    return SUCCESS;
+}
+
+int writer_finish(output_writer_t *writer, FILE *errors) {
+    (void)writer;
+    (void)errors;
+    return 0;
+}
+
+#endif /* NO_THREADS */
@@ -0,0 +1,12 @@
+/* Background writer for the output files (--async-write) */
+/* Simple header - no includes needed */
+
+/* The writer itself is only known to writer.c */
+typedef struct output_writer output_writer_t;
+
+/* Function declarations */
+output_writer_t *writer_start(int sync_files);
+int writer_begin(output_writer_t *writer, const char *source);
+error_code_t writer_submit(output_writer_t *writer, int file, const char *filename, char *buffer, size_t length, int binary);
+error_code_t writer_wait(output_writer_t *writer, int file);
+int writer_finish(output_writer_t *writer, FILE *errors);